@@ -0,0 +1,26 @@
+TEMPLATE = app
+TARGET = Mpx3DriverBenchmark
+
+QT -= gui core
+CONFIG *= console c++1z optimize_full
+CONFIG -= qt
+
+DESTDIR = $$PWD/../build
+
+QMAKE_CXXFLAGS *= -mavx2
+
+INCLUDEPATH += ../src ../src/libs ../generator
+
+SOURCES += \
+    main.cpp \
+    ../generator/TrafficGenerator.cpp \
+    ../src/FrameAssembler.cpp \
+    ../src/FrameSet.cpp \
+    ../src/FrameSetManager.cpp \
+    ../src/ChipFrame.cpp \
+    ../src/ChipFramePool.cpp \
+    ../src/DetectorLayout.cpp \
+    ../src/PixelUnpacker.cpp \
+    ../src/LatencyHistogram.cpp
+
+LIBS += -lpthread
@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+#include "FrameAssembler.h"
+#include "FrameSetManager.h"
+#include "TrafficGenerator.h"
+
+/**
+ * Decode path benchmarks. Every result is one JSON object per line on stdout
+ * (logging goes to stderr), so runs before and after a change can be diffed
+ * or loaded into a script as they are.
+ *
+ *   decode   FrameAssembler::onEvent() on synthetic packets, per counter
+ *            depth, with and without LUT decoding, and with packet loss;
+ *            the sets that come out are checked against the generator's
+ *            pattern, a wrong one makes the exit status non-zero
+ *   fsm      FrameSetManager putChipFrame(), getFrameSet() and
+ *            releaseFrameSet() latency, and the hand-over latency to a
+ *            consumer thread waiting in wait()
+ *   copy     FrameSet::copyTo32() bandwidth, plain and per-chip threaded
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+constexpr static int packet_words = 1125; //! 9000 byte datagrams, as the SPIDR sends
+constexpr static unsigned fsm_depth = 64; //! Small ring, as a consumer that keeps up needs
+
+static long frames = 1000;       //! Per decode and fsm case
+static long copies = 2000;       //! Per copy case
+static std::string only;         //! Run only benchmarks whose name contains this
+
+static double seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+static double nanoseconds(Clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+}
+
+struct Latency {
+    std::vector<double> ns;
+
+    void add(Clock::duration d) { ns.push_back(nanoseconds(d)); }
+    double percentile(double p) {
+        if (ns.empty()) return 0.;
+        size_t i = size_t(p / 100. * double(ns.size() - 1) + 0.5);
+        std::nth_element(ns.begin(), ns.begin() + long(i), ns.end());
+        return ns[i];
+    }
+    double mean() {
+        double sum = 0.;
+        for (double v : ns) sum += v;
+        return ns.empty() ? 0. : sum / double(ns.size());
+    }
+    double max() { return ns.empty() ? 0. : *std::max_element(ns.begin(), ns.end()); }
+    void print(const char *op) {
+        printf("{\"bench\":\"fsm\",\"op\":\"%s\",\"samples\":%zu,\"mean_ns\":%.1f,"
+               "\"p50_ns\":%.1f,\"p99_ns\":%.1f,\"p999_ns\":%.1f,\"max_ns\":%.1f}\n",
+               op, ns.size(), mean(), percentile(50.), percentile(99.), percentile(99.9), max());
+    }
+};
+
+static bool selected(const char *bench) {
+    return only.empty() || std::string(bench).find(only) != std::string::npos;
+}
+
+// ----------------------------------------------------------------------------
+
+enum Loss { NO_LOSS, RANDOM_LOSS, PERIODIC_LOSS };
+static const char *lossNames[] = {"none", "random_1pct", "every_97th"};
+
+static int failures = 0; //! Decode cases whose output was wrong
+
+//! The counter the decoder should make of the generator's pixel
+static uint32_t expectedPixel(int depth, bool lut, int chipIndex, int row, int column) {
+    uint32_t v = TrafficGenerator::pixel(chipIndex, row, column);
+    if (depth != 24) {
+        v &= (1u << depth) - 1;
+        return lut ? FrameAssembler::lutValue(depth, uint16_t(v)) : v;
+    }
+    v &= 0xffffff;
+    if (!lut) return v;
+    return uint32_t(FrameAssembler::lutValue(12, uint16_t(v >> 12))) << 12
+            | FrameAssembler::lutValue(12, uint16_t(v & 0xfff));
+}
+
+//! Decode results, checked outside the timed part
+struct DecodeCheck {
+    int sets = 0;
+    uint64_t chipFrames = 0;  //! Loss-free chip frames compared pixel by pixel
+    uint64_t wrongPixels = 0;
+};
+
+static void drainChecked(FrameSetManager *fsm, int depth, bool lut, DecodeCheck &check) {
+    while (FrameSet *fs = fsm->getFrameSet()) {
+        check.sets++;
+        for (int c = 0; c < number_of_chips; c++) {
+            ChipView v = fs->view(c);
+            if (!v.valid() || v.pixelsLost != 0)
+                continue;
+            check.chipFrames++;
+            for (int row = 0; row < MPX_PIXEL_ROWS; row++) {
+                for (int col = 0; col < MPX_PIXEL_COLUMNS; col++) {
+                    if (v.pixel(row, col) != expectedPixel(depth, lut, c, row, col))
+                        check.wrongPixels++;
+                }
+            }
+        }
+        fsm->releaseFrameSet(fs);
+    }
+}
+
+/**
+ * @brief Feed frames chip frames per chip through the assemblers, draining
+ * the FrameSetManager after every frame as a fast consumer would. Only the
+ * onEvent() calls are timed. Every frame carries its own id in the EOF
+ * words; publish_lag + 1 loss-free frames at the end flush the ring, after
+ * which every frame must have come out as a set or been counted lost.
+ */
+static void benchDecode(int depth, bool lut, Loss loss) {
+    int halves = depth == 24 ? 2 : 1;
+    std::vector<PacketContainer> packets[number_of_chips][2];
+    for (int c = 0; c < number_of_chips; c++) {
+        for (int h = 0; h < halves; h++) {
+            std::vector<uint64_t> words;
+            TrafficGenerator::encodeFrame(depth, c, h == 0 ? 0 : 4, words);
+            for (size_t i = 0; i < words.size(); i += packet_words) {
+                size_t n = std::min(words.size() - i, size_t(packet_words));
+                PacketContainer pc;
+                pc.chipIndex = c;
+                pc.size = long(n * sizeof(uint64_t));
+                pc.timestamp_ns = 0;
+                memcpy(pc.data, words.data() + i, size_t(pc.size));
+                packets[c][h].push_back(pc);
+            }
+        }
+    }
+    long total = frames + long(FrameSetManager::publish_lag) + 1;
+
+    //! The order the packets arrive in, lost ones left out, decided up front
+    std::vector<PacketContainer *> sequence;
+    std::vector<size_t> frameEnd;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    uint64_t n = 0, dropped = 0;
+    for (long f = 0; f < total; f++) {
+        for (int c = 0; c < number_of_chips; c++) {
+            for (int h = 0; h < halves; h++) {
+                for (PacketContainer &pc : packets[c][h]) {
+                    n++;
+                    if (f < frames && ((loss == RANDOM_LOSS && uniform(rng) < 0.01)
+                                       || (loss == PERIODIC_LOSS && n % 97 == 0))) {
+                        dropped++;
+                        continue;
+                    }
+                    sequence.push_back(&pc);
+                }
+            }
+        }
+        frameEnd.push_back(sequence.size());
+    }
+    size_t timedPackets = frameEnd[size_t(frames) - 1];
+
+    FrameAssembler::setLutDecode(lut);
+    FrameSetManager *fsm = new FrameSetManager(fsm_depth);
+    FrameAssembler *assemblers[number_of_chips];
+    for (int c = 0; c < number_of_chips; c++) {
+        assemblers[c] = new FrameAssembler(c);
+        assemblers[c]->setFrameSetManager(fsm);
+    }
+
+    DecodeCheck check;
+    Clock::duration busy = Clock::duration::zero();
+    size_t i = 0;
+    for (long f = 0; f < total; f++) {
+        //! The EOF words are the last of each chip frame
+        for (int c = 0; c < number_of_chips; c++) {
+            for (int h = 0; h < halves; h++) {
+                PacketContainer &last = packets[c][h].back();
+                uint64_t &eof = reinterpret_cast<uint64_t *>(last.data)[last.size / long(sizeof(uint64_t)) - 1];
+                eof = (eof & ~FRAME_FLAGS_MASK) | (uint64_t(uint16_t(f + 1)) << FRAME_FLAGS_SHIFT);
+            }
+        }
+        auto start = Clock::now();
+        for (; i < frameEnd[size_t(f)]; i++) {
+            assemblers[sequence[i]->chipIndex]->onEvent(*sequence[i]);
+        }
+        if (f < frames)
+            busy += Clock::now() - start;
+        drainChecked(fsm, depth, lut, check);
+    }
+    double elapsed = seconds(busy);
+
+    bool ok = check.sets + fsm->_framesLost == total && check.wrongPixels == 0;
+    if (!ok) {
+        failures++;
+        spdlog::get("console")->error("decode {}-bit{} loss {}: {} sets + {} lost of {} frames, {} wrong pixels",
+                                      depth, lut ? " lut" : "", lossNames[loss], check.sets,
+                                      int(fsm->_framesLost), total, check.wrongPixels);
+    }
+    double chipFrames = double(frames * number_of_chips * halves);
+    double pixels = chipFrames * MPX_PIXELS;
+    printf("{\"bench\":\"decode\",\"depth\":%d,\"lut\":%s,\"loss\":\"%s\",\"packets\":%zu,"
+           "\"packets_dropped\":%lu,\"chip_frames\":%.0f,\"seconds\":%.6f,\"packets_per_s\":%.1f,"
+           "\"pixels_per_s\":%.1f,\"ns_per_packet\":%.1f,\"frames\":%ld,\"sets\":%d,\"sets_lost\":%d,"
+           "\"chip_frames_checked\":%lu,\"pixels_wrong\":%lu,\"ok\":%s}\n",
+           depth, lut ? "true" : "false", lossNames[loss], timedPackets, (unsigned long) dropped,
+           chipFrames, elapsed, double(timedPackets) / elapsed, pixels / elapsed,
+           elapsed * 1e9 / double(timedPackets), total, check.sets, int(fsm->_framesLost),
+           (unsigned long) check.chipFrames, (unsigned long) check.wrongPixels, ok ? "true" : "false");
+    fflush(stdout);
+
+    for (int c = 0; c < number_of_chips; c++) {
+        delete assemblers[c];
+    }
+    delete fsm;
+    FrameAssembler::setLutDecode(false);
+}
+
+// ----------------------------------------------------------------------------
+
+static ChipFrame *newFrame(FrameSetManager *fsm, int chipIndex, long f, int countL, int mode) {
+    ChipFrame *cf = fsm->newChipFrame(chipIndex);
+    cf->frameId = uint8_t(f);
+    cf->omr.setCountL(countL);
+    cf->omr.setMode(mode);
+    return cf;
+}
+
+static void benchFsm() {
+    FrameSetManager *fsm = new FrameSetManager(fsm_depth);
+    Latency put, get, release;
+    for (long f = 0; f < frames; f++) {
+        for (int c = 0; c < number_of_chips; c++) {
+            ChipFrame *cf = newFrame(fsm, c, f, 2, 0);
+            auto t0 = Clock::now();
+            fsm->putChipFrame(c, cf);
+            put.add(Clock::now() - t0);
+        }
+        auto t0 = Clock::now();
+        FrameSet *fs = fsm->getFrameSet();
+        auto t1 = Clock::now();
+        fsm->releaseFrameSet(fs);
+        auto t2 = Clock::now();
+        get.add(t1 - t0);
+        release.add(t2 - t1);
+    }
+    put.print("put");
+    get.print("get");
+    release.print("release");
+    delete fsm;
+
+    //! Last putChipFrame() of a set until a consumer in wait() has it
+    fsm = new FrameSetManager(fsm_depth);
+    std::vector<Clock::time_point> stamps(static_cast<size_t>(frames));
+    Latency handoff;
+    std::thread consumer([&]() {
+        for (long f = 0; f < frames; f++) {
+            FrameSet *fs = nullptr;
+            while (fs == nullptr) {
+                if (fsm->wait(1000))
+                    fs = fsm->getFrameSet();
+            }
+            handoff.add(Clock::now() - stamps[size_t(f)]);
+            fsm->releaseFrameSet(fs);
+        }
+    });
+    for (long f = 0; f < frames; f++) {
+        for (int c = 0; c < number_of_chips; c++) {
+            ChipFrame *cf = newFrame(fsm, c, f, 2, 0);
+            if (c == number_of_chips - 1)
+                stamps[size_t(f)] = Clock::now();
+            fsm->putChipFrame(c, cf);
+        }
+        //! One set in flight at a time, otherwise this measures queueing
+        while (!fsm->isEmpty()) std::this_thread::yield();
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    consumer.join();
+    handoff.print("handoff");
+    fflush(stdout);
+    delete fsm;
+}
+
+// ----------------------------------------------------------------------------
+
+static void benchCopy(int depth, int threads) {
+    FrameSetManager *fsm = new FrameSetManager(fsm_depth);
+    int countL = depth == 24 ? 3 : 2;
+    for (int c = 0; c < number_of_chips; c++) {
+        fsm->putChipFrame(c, newFrame(fsm, c, 1, countL, 0));
+        if (depth == 24)
+            fsm->putChipFrame(c, newFrame(fsm, c, 1, countL, 4));
+    }
+    FrameSet *fs = fsm->getFrameSet();
+    if (fs == nullptr) {
+        spdlog::get("console")->error("copy: no complete FrameSet");
+        delete fsm;
+        return;
+    }
+    uint32_t *dest = new uint32_t[number_of_chips * MPX_PIXELS];
+    memset(dest, 0, number_of_chips * MPX_PIXELS * sizeof(uint32_t));
+    if (threads > 1)
+        fs->copyTo32(dest, threads); //! Starts the helper threads, once per process
+
+    auto start = Clock::now();
+    for (long i = 0; i < copies; i++) {
+        if (threads > 1)
+            fs->copyTo32(dest, threads);
+        else
+            fs->copyTo32(dest);
+    }
+    double elapsed = seconds(Clock::now() - start);
+    double bytes = double(copies) * number_of_chips * MPX_PIXELS * sizeof(uint32_t);
+    printf("{\"bench\":\"copy\",\"depth\":%d,\"threads\":%d,\"copies\":%ld,\"seconds\":%.6f,"
+           "\"bytes_per_s\":%.1f,\"us_per_copy\":%.2f}\n",
+           depth, threads, copies, elapsed, bytes / elapsed, elapsed * 1e6 / double(copies));
+    fflush(stdout);
+
+    delete[] dest;
+    fsm->releaseFrameSet(fs);
+    delete fsm;
+}
+
+// ----------------------------------------------------------------------------
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n <frames>  frames per decode and fsm case (1000)\n"
+            "  -c <copies>  copyTo32() calls per copy case (2000)\n"
+            "  -b <name>    only benchmarks whose name contains this: decode, fsm, copy\n",
+            name);
+}
+
+int main(int argc, char * argv[]) {
+    auto console = spdlog::stderr_color_mt("console");
+    console->set_level(spdlog::level::warn);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:b:h")) != -1) {
+        switch (opt) {
+        case 'n': frames = atol(optarg); break;
+        case 'c': copies = atol(optarg); break;
+        case 'b': only = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (frames < 1 || copies < 1) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    FrameAssembler::lutInit(false);
+    if (selected("decode")) {
+        for (int depth : {1, 6, 12, 24}) {
+            for (bool lut : {false, true}) {
+                if (lut && depth == 1) continue; //! No LUT for 1-bit counters
+                for (Loss loss : {NO_LOSS, RANDOM_LOSS, PERIODIC_LOSS}) {
+                    benchDecode(depth, lut, loss);
+                }
+            }
+        }
+    }
+    if (selected("fsm")) {
+        benchFsm();
+    }
+    if (selected("copy")) {
+        for (int depth : {12, 24}) {
+            for (int threads : {1, number_of_chips}) {
+                benchCopy(depth, threads);
+            }
+        }
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,259 @@
+#include "TrafficGenerator.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "FrameAssembler.h"
+#include "OMR.h"
+#include "spdlog/spdlog.h"
+
+constexpr static int send_batch = 8; //! Datagrams per sendmmsg(), per chip in turn
+constexpr static size_t max_gso_bytes = 65000; //! Below the 64 KiB IP datagram limit
+
+TrafficGenerator::TrafficGenerator(const Settings &settings)
+    : settings(settings), rng(settings.seed)
+{
+    for (int i = 0; i < number_of_chips; i++) {
+        sockets[i] = -1;
+    }
+    halves = settings.depth == 24 ? 2 : 1;
+    for (int i = 0; i < number_of_chips; i++) {
+        encodeFrame(settings.depth, i, 0, words[i][0]);
+        if (halves == 2) {
+            encodeFrame(settings.depth, i, 4, words[i][1]);
+        }
+    }
+    packetsPerFrame = int((words[0][0].size() + size_t(settings.packet_words) - 1) / size_t(settings.packet_words));
+}
+
+TrafficGenerator::~TrafficGenerator()
+{
+    for (int i = 0; i < number_of_chips; i++) {
+        if (sockets[i] >= 0) {
+            close(sockets[i]);
+        }
+    }
+}
+
+bool TrafficGenerator::open()
+{
+    for (int i = 0; i < number_of_chips; i++) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(settings.port + i));
+        if (inet_pton(AF_INET, settings.host.c_str(), &addr.sin_addr) != 1) {
+            spdlog::get("console")->error("Invalid address \"{}\"", settings.host);
+            return false;
+        }
+        sockets[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockets[i] < 0 || connect(sockets[i], (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            spdlog::get("console")->error("Socket to {}:{}: {}", settings.host, settings.port + i, strerror(errno));
+            return false;
+        }
+        int sndbuf = 8 << 20;
+        setsockopt(sockets[i], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    }
+    spdlog::get("console")->info("Sending {}-bit frames to {}:{}-{}, {} packets of {} bytes per chip frame",
+                                 settings.depth, settings.host, settings.port, settings.port + number_of_chips - 1,
+                                 packetsPerFrame * halves, settings.packet_words * 8);
+    return true;
+}
+
+/**
+ * @brief Encode one chip frame (one half of a 24-bit frame) as the SPIDR does
+ * @param mode OMR mode, 0 for a low half or a 1, 6 or 12-bit frame, 4 for the
+ *        high half of a 24-bit frame
+ */
+void TrafficGenerator::encodeFrame(int depth, int chipIndex, int mode, std::vector<uint64_t> &words)
+{
+    int bits = depth == 24 ? 12 : depth;
+    int shift = mode == 4 ? 12 : 0;
+    int pixelsPerWord = 60 / bits;
+    int endCursor = MPX_PIXEL_COLUMNS - (MPX_PIXEL_COLUMNS % pixelsPerWord);
+    uint64_t mask = (uint64_t(1) << bits) - 1;
+
+    OMR omr;
+    switch (depth) {
+    case 1:  omr.setCountL(0); break;
+    case 6:  omr.setCountL(1); break;
+    case 12: omr.setCountL(2); break;
+    default: omr.setCountL(3); break;
+    }
+    omr.setMode(mode);
+
+    words.clear();
+    words.push_back(INFO_HEADER_SOF);
+    for (int i = 0; i < 6; i++) {
+        uint64_t v = 0;
+        if (i == 4) {
+            v = uint32_t((chipIndex + 1) * 0x11111111); //! Chip id, must not be < 5
+        } else if (i == 5) {
+            //! Inverse of OMR::setHighR()
+            v = uint32_t(OMR::reverse(unsigned(omr.content >> 32) & 0xffff)) >> 16;
+        }
+        words.push_back(INFO_HEADER_MID | v);
+    }
+    words.push_back(INFO_HEADER_EOF | uint32_t(OMR::reverse(unsigned(omr.content & 0xffffffff))));
+
+    for (int r = 0; r < MPX_PIXEL_ROWS; r++) {
+        int c = 0;
+        for (int k = 0; c < endCursor; k++) {
+            uint64_t v = 0;
+            for (int p = 0; p < pixelsPerWord; p++, c++) {
+                v |= ((pixel(chipIndex, r, c) >> shift) & mask) << (bits * p);
+            }
+            uint64_t type = k > 0 ? PIXEL_DATA_MID : r == 0 ? PIXEL_DATA_SOF : PIXEL_DATA_SOR;
+            words.push_back(type | v);
+        }
+        //! The row end carries the remaining pixels and the row counter
+        uint64_t v = 0;
+        for (int p = 0; c < MPX_PIXEL_COLUMNS; p++, c++) {
+            v |= ((pixel(chipIndex, r, c) >> shift) & mask) << (bits * p);
+        }
+        v |= uint64_t(r) << ROW_COUNT_SHIFT;
+        words.push_back((r == MPX_PIXEL_ROWS - 1 ? PIXEL_DATA_EOF : PIXEL_DATA_EOR) | v);
+    }
+}
+
+void TrafficGenerator::run(const std::atomic_bool *stop)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long period_ns = settings.rate > 0. ? long(1e9 / settings.rate) : 0;
+    std::uniform_real_distribution<double> jitter(-settings.jitter_us, settings.jitter_us);
+    uint16_t frameId = 0;
+
+    while ((settings.frames == 0 || long(framesSent) < settings.frames)
+           && (stop == nullptr || !*stop)) {
+        if (period_ns > 0) {
+            long ns = next.tv_nsec + period_ns;
+            if (settings.jitter_us > 0.) {
+                ns += long(jitter(rng) * 1000.);
+            }
+            next.tv_sec += ns / 1000000000;
+            next.tv_nsec = ns % 1000000000;
+            if (next.tv_nsec < 0) {
+                next.tv_sec--;
+                next.tv_nsec += 1000000000;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR) {}
+        }
+        sendFrame(++frameId);
+        framesSent++;
+    }
+    spdlog::get("console")->info("Sent {} frames, {} packets, injected {} lost and {} reordered, {} send errors",
+                                 framesSent, packetsSent, packetsLost, packetsReordered, sendErrors);
+}
+
+void TrafficGenerator::sendFrame(uint16_t frameId)
+{
+    int n = packetsPerFrame * halves;
+    for (int i = 0; i < number_of_chips; i++) {
+        for (int h = 0; h < halves; h++) {
+            uint64_t &eof = words[i][h].back();
+            eof = (eof & ~FRAME_FLAGS_MASK) | (uint64_t(frameId) << FRAME_FLAGS_SHIFT);
+        }
+        //! Packet send order, with neighbours swapped now and then
+        order[i].resize(size_t(n));
+        for (int k = 0; k < n; k++) {
+            order[i][size_t(k)] = k;
+        }
+        for (int k = 0; k + 1 < n; k++) {
+            if (chance(settings.reorder)) {
+                std::swap(order[i][size_t(k)], order[i][size_t(k + 1)]);
+                packetsReordered++;
+                k++;
+            }
+        }
+    }
+    //! The chips stream in parallel on the SPIDR, interleave them
+    for (int k = 0; k < n; k += send_batch) {
+        int count = std::min(send_batch, n - k);
+        for (int i = 0; i < number_of_chips; i++) {
+            sendPackets(i, order[i].data() + k, count);
+        }
+    }
+}
+
+void TrafficGenerator::sendPackets(int chipIndex, const int *packets, int count)
+{
+    struct mmsghdr msgs[send_batch];
+    struct iovec iovs[send_batch];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } controls[send_batch];
+    int datagrams[send_batch];
+    int m = 0;
+    for (int k = 0; k < count; k++) {
+        if (chance(settings.loss)) {
+            packetsLost++;
+            continue;
+        }
+        int half = packets[k] / packetsPerFrame;
+        size_t first = size_t(packets[k] % packetsPerFrame) * size_t(settings.packet_words);
+        const std::vector<uint64_t> &w = words[chipIndex][half];
+        size_t len = std::min(w.size() - first, size_t(settings.packet_words));
+        char *base = reinterpret_cast<char *>(const_cast<uint64_t *>(w.data() + first));
+        size_t bytes = len * sizeof(uint64_t);
+        size_t segment = size_t(settings.packet_words) * sizeof(uint64_t);
+        if (settings.gso && m > 0) {
+            //! Append to the previous buffer if this packet follows it in
+            //! memory and all before it are full segments
+            struct iovec &prev = iovs[m - 1];
+            if (static_cast<char *>(prev.iov_base) + prev.iov_len == base && prev.iov_len % segment == 0
+                    && prev.iov_len + bytes <= max_gso_bytes) {
+                prev.iov_len += bytes;
+                datagrams[m - 1]++;
+                continue;
+            }
+        }
+        iovs[m].iov_base = base;
+        iovs[m].iov_len = bytes;
+        memset(&msgs[m], 0, sizeof(msgs[m]));
+        msgs[m].msg_hdr.msg_iov = &iovs[m];
+        msgs[m].msg_hdr.msg_iovlen = 1;
+        datagrams[m] = 1;
+        m++;
+    }
+    if (settings.gso) {
+        for (int k = 0; k < m; k++) {
+            if (datagrams[k] == 1) {
+                continue;
+            }
+            //! The kernel cuts the buffer into datagrams of this size
+            uint16_t segment = uint16_t(settings.packet_words * sizeof(uint64_t));
+            msgs[k].msg_hdr.msg_control = controls[k].buf;
+            msgs[k].msg_hdr.msg_controllen = sizeof(controls[k].buf);
+            struct cmsghdr *c = CMSG_FIRSTHDR(&msgs[k].msg_hdr);
+            c->cmsg_level = SOL_UDP;
+            c->cmsg_type = UDP_SEGMENT;
+            c->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(c), &segment, sizeof(segment));
+        }
+    }
+    int sent = 0;
+    while (sent < m) {
+        int ret = sendmmsg(sockets[chipIndex], msgs + sent, unsigned(m - sent), 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            //! e.g. ECONNREFUSED when nothing listens on loopback yet, skip one
+            sendErrors++;
+            sent++;
+            continue;
+        }
+        for (int k = sent; k < sent + ret; k++) {
+            packetsSent += uint64_t(datagrams[k]);
+        }
+        sent += ret;
+    }
+}
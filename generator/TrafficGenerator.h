@@ -0,0 +1,82 @@
+#ifndef TRAFFICGENERATOR_H
+#define TRAFFICGENERATOR_H
+
+#include <stdint.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "configs.h"
+
+/**
+ * @brief Sends SPIDR MPX3 pixel data streams over UDP, one per chip, so the
+ * receive path can be loaded without hardware or the Java emulator.
+ *
+ * Every chip frame is an info header (iSOF, 6 x iMID carrying the chip id and
+ * the high OMR bits, iEOF carrying the low OMR bits) followed by 256 rows of
+ * SOF/SOR, MID and EOR/EOF pixel words, with the row counter in each row end
+ * and the frame id in the EOF word. 24-bit frames go out as a low (mode 0)
+ * and a high (mode 4) half. The pixel data is built once; per frame only the
+ * frame id is patched, so the generator itself is cheap to run.
+ *
+ * Pixel (row, column) of chip c holds (c * 0x111 + row * 256 + column),
+ * masked to the counter width, which lets a receiver check what it decoded.
+ */
+class TrafficGenerator
+{
+public:
+    struct Settings {
+        std::string host = "127.0.0.1";
+        int port = 8192;          //! Chip i goes to port + i
+        int depth = 12;           //! Counter depth, 1, 6, 12 or 24
+        double rate = 1000.;      //! Frames per second, 0 = as fast as possible
+        double jitter_us = 0.;    //! Frame start jitter, uniform in +-jitter_us
+        double loss = 0.;         //! Probability a packet is not sent
+        double reorder = 0.;      //! Probability a packet swaps with the next
+        int packet_words = 1125;  //! 64-bit words per datagram (9000 bytes)
+        long frames = 0;          //! 0 = until stopped
+        bool gso = false;         //! Send runs of packets as one UDP_SEGMENT buffer
+        unsigned seed = 1;
+    };
+
+    explicit TrafficGenerator(const Settings &settings);
+    ~TrafficGenerator();
+
+    bool open();
+    void run(const std::atomic_bool *stop = nullptr);
+
+    // Statistics
+    uint64_t framesSent = 0;
+    uint64_t packetsSent = 0;
+    uint64_t packetsLost = 0;      //! Injected
+    uint64_t packetsReordered = 0; //! Injected
+    uint64_t sendErrors = 0;
+
+    //! The pixel value the generator puts in (row, column) of a chip
+    static uint32_t pixel(int chipIndex, int row, int column) {
+        return uint32_t(chipIndex * 0x111 + row * 256 + column);
+    }
+    //! The words of one chip frame with that pattern, as sent
+    static void encodeFrame(int depth, int chipIndex, int mode, std::vector<uint64_t> &words);
+
+private:
+    constexpr static int number_of_chips = Config::number_of_chips;
+
+    void sendFrame(uint16_t frameId);
+    void sendPackets(int chipIndex, const int *packets, int count);
+    bool chance(double p) { return p > 0. && uniform(rng) < p; }
+
+    Settings settings;
+    int sockets[number_of_chips];
+    //! Words of one chip frame per chip and counter half
+    std::vector<uint64_t> words[number_of_chips][2];
+    int halves;
+    int packetsPerFrame;
+    std::vector<int> order[number_of_chips];
+
+    std::mt19937 rng;
+    std::uniform_real_distribution<double> uniform{0., 1.};
+};
+
+#endif // TRAFFICGENERATOR_H
@@ -0,0 +1,17 @@
+TEMPLATE = app
+TARGET = SpidrTrafficGenerator
+
+QT -= gui core
+CONFIG *= console c++1z
+CONFIG -= qt
+
+DESTDIR = $$PWD/../build
+
+INCLUDEPATH += ../src ../src/libs
+
+SOURCES += \
+    main.cpp \
+    TrafficGenerator.cpp
+
+HEADERS += \
+    TrafficGenerator.h
@@ -0,0 +1,78 @@
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <getopt.h>
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+#include "TrafficGenerator.h"
+
+static std::atomic_bool stopping{false};
+
+static void onSignal(int) {
+  stopping = true;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -a <address>  destination address (127.0.0.1)\n"
+          "  -p <port>     port of chip 0, chip i gets port + i (8192)\n"
+          "  -d <depth>    counter depth: 1, 6, 12 or 24 (12)\n"
+          "  -r <rate>     frames per second, 0 = as fast as possible (1000)\n"
+          "  -n <frames>   number of frames, 0 = until interrupted (0)\n"
+          "  -j <us>       frame start jitter, +- microseconds (0)\n"
+          "  -l <p>        probability of dropping a packet (0)\n"
+          "  -o <p>        probability of swapping a packet with the next (0)\n"
+          "  -w <words>    64-bit words per packet, at most 1125 (1125)\n"
+          "  -s <seed>     random seed for jitter, loss and reordering (1)\n"
+          "  -g            segmentation offload, sends runs of packets with UDP_SEGMENT\n",
+          name);
+}
+
+/**
+ * @brief Stand-in for the SPIDR/emulator: streams MPX3 pixel packets to the
+ * receiver ports, e.g. on loopback for load testing the receive path
+ */
+int main(int argc, char * argv[]) {
+  auto console = spdlog::stdout_color_mt("console");
+  TrafficGenerator::Settings settings;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:d:r:n:j:l:o:w:s:gh")) != -1) {
+    switch (opt) {
+    case 'a': settings.host = optarg; break;
+    case 'p': settings.port = atoi(optarg); break;
+    case 'd': settings.depth = atoi(optarg); break;
+    case 'r': settings.rate = atof(optarg); break;
+    case 'n': settings.frames = atol(optarg); break;
+    case 'j': settings.jitter_us = atof(optarg); break;
+    case 'l': settings.loss = atof(optarg); break;
+    case 'o': settings.reorder = atof(optarg); break;
+    case 'w': settings.packet_words = atoi(optarg); break;
+    case 's': settings.seed = unsigned(atol(optarg)); break;
+    case 'g': settings.gso = true; break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : -1;
+    }
+  }
+  if (settings.depth != 1 && settings.depth != 6 && settings.depth != 12 && settings.depth != 24) {
+    spdlog::get("console")->error("Counter depth must be 1, 6, 12 or 24");
+    return -1;
+  }
+  if (settings.packet_words < 16 || settings.packet_words > 1125) {
+    spdlog::get("console")->error("Packet size must be 16 to 1125 words"); //! PacketContainer holds 9000 bytes
+    return -1;
+  }
+
+  TrafficGenerator generator(settings);
+  if (!generator.open()) {
+    return -2;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  generator.run(&stopping);
+  return 0;
+}
@@ -3,5 +3,7 @@ TEMPLATE = subdirs
 CONFIG += ordered
 
 SUBDIRS = src/mpx3-driver.pro \
+        generator/generator.pro \
+        bench/bench.pro \
         tests/tests.pro
 
@@ -2,7 +2,8 @@
 
 ChipFrame::ChipFrame()
 {
-
+    frameId = 0;
+    clear();
 }
 
 //bool ChipFrame::isEmpty() {
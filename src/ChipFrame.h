@@ -14,12 +14,16 @@ public:
     int pixelsLost;
     OMR omr;
     int brokenRows;
-    void clear() { memset(data, 0, sizeof(data)); pixelsLost = 0; brokenRows = 0;}
+    uint64_t firstPacket_ns = 0; //! Arrival of its first packet, CLOCK_MONOTONIC
+    uint64_t lastPacket_ns = 0;  //! ... and of the packet that finished it
+    void clear() { memset(data, 0, sizeof(data)); reset(); }
+    //! Clear the bookkeeping but not the pixels
+    void reset() { pixelsLost = 0; brokenRows = 0; firstPacket_ns = 0; lastPacket_ns = 0; }
     //bool isEmpty();
     uint16_t * getRow(int rowNum) { return data + MPX_PIXEL_COLUMNS * rowNum; }
     void finish();
 private:
-    uint16_t data[MPX_PIXELS];
+    alignas(64) uint16_t data[MPX_PIXELS];
 };
 
 #endif // CHIPFRAME_H
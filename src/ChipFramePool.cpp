@@ -0,0 +1,142 @@
+#include "ChipFramePool.h"
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <new>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "spdlog/spdlog.h"
+
+constexpr static size_t huge_page_size = 2 << 20;
+
+ChipFramePool::ChipFramePool(unsigned capacity, bool hugePages, int numaNode, bool prefault)
+    : _capacity(capacity)
+{
+    next = new std::atomic_uint[capacity];
+
+    size_t bytes = size_t(capacity) * sizeof(ChipFrame);
+    void *block = map(bytes, hugePages, numaNode);
+    if (block == nullptr) {
+        _capacity = 0;
+        return;
+    }
+    mappedBytes = bytes;
+    frames = static_cast<ChipFrame *>(block);
+    if (prefault) {
+        // The constructor clears every frame, touching all pages up front
+        for (unsigned i = capacity; i-- > 0; ) {
+            push(new (&frames[i]) ChipFrame());
+        }
+        fresh_.store(capacity, std::memory_order_relaxed);
+    }
+    spdlog::get("console")->info("ChipFrame pool: {} frames, {} MiB{}", capacity, bytes >> 20,
+                                 prefault ? ", pre-faulted" : "");
+}
+
+/**
+ * @brief Map the frame storage. The NUMA binding is applied before the
+ * caller touches the pages, so they are faulted in on that node.
+ * @param bytes in: wanted, out: mapped (rounded up to the page size)
+ */
+void *ChipFramePool::map(size_t &bytes, bool hugePages, int numaNode)
+{
+    void *block = MAP_FAILED;
+    if (hugePages) {
+        size_t hugeBytes = (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+        block = mmap(nullptr, hugeBytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block != MAP_FAILED) {
+            bytes = hugeBytes;
+            spdlog::get("console")->info("ChipFrames on {} huge pages", hugeBytes / huge_page_size);
+        } else {
+            spdlog::get("console")->warn("No {} MiB of huge pages reserved ({}), trying transparent huge pages",
+                                         hugeBytes >> 20, strerror(errno));
+        }
+    }
+    if (block == MAP_FAILED) {
+        bytes = (bytes + 4095) & ~size_t(4095);
+        block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            spdlog::get("console")->error("Could not map {} MiB for ChipFrames: {}", bytes >> 20, strerror(errno));
+            return nullptr;
+        }
+        if (hugePages && madvise(block, bytes, MADV_HUGEPAGE) != 0) {
+            spdlog::get("console")->warn("madvise(MADV_HUGEPAGE): {}", strerror(errno));
+        }
+    }
+    if (numaNode >= 0) {
+        unsigned long nodemask = 1UL << numaNode;
+        if (syscall(SYS_mbind, block, bytes, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0) != 0) {
+            spdlog::get("console")->error("mbind, node {}: {}", numaNode, strerror(errno));
+        }
+    }
+    return block;
+}
+
+ChipFramePool::~ChipFramePool()
+{
+    if (frames != nullptr) {
+        unsigned constructed = fresh_.load();
+        for (unsigned i = 0; i < constructed; i++) {
+            frames[i].~ChipFrame();
+        }
+        munmap(frames, mappedBytes);
+    }
+    delete[] next;
+}
+
+/**
+ * @brief The most recently released frame, or one never used before when
+ * none is free. A fresh frame is constructed (and so cleared) here, on first
+ * use.
+ */
+ChipFrame *ChipFramePool::acquire()
+{
+    ChipFrame *cf = pop();
+    if (cf == nullptr) {
+        unsigned i = fresh_.load(std::memory_order_relaxed);
+        do {
+            if (i >= _capacity) {
+                exhausted.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+        } while (!fresh_.compare_exchange_weak(i, i + 1, std::memory_order_relaxed));
+        cf = new (&frames[i]) ChipFrame();
+    }
+    inUse_.fetch_add(1, std::memory_order_relaxed);
+    return cf;
+}
+
+void ChipFramePool::release(ChipFrame *cf)
+{
+    cf->frameId = 0;
+    cf->reset();
+    inUse_.fetch_sub(1, std::memory_order_relaxed);
+    push(cf);
+}
+
+ChipFrame *ChipFramePool::pop()
+{
+    uint64_t top = top_.load(std::memory_order_acquire);
+    for (;;) {
+        uint32_t i = uint32_t(top);
+        if (i == none)
+            return nullptr;
+        uint64_t after = (top & ~uint64_t(none)) | next[i].load(std::memory_order_relaxed);
+        if (top_.compare_exchange_weak(top, after, std::memory_order_acquire))
+            return &frames[i];
+    }
+}
+
+void ChipFramePool::push(ChipFrame *cf)
+{
+    uint32_t i = uint32_t(cf - frames);
+    uint64_t top = top_.load(std::memory_order_relaxed);
+    uint64_t after;
+    do {
+        next[i].store(uint32_t(top), std::memory_order_relaxed);
+        after = ((top >> 32) + 1) << 32 | i;
+    } while (!top_.compare_exchange_weak(top, after, std::memory_order_release, std::memory_order_relaxed));
+}
@@ -0,0 +1,62 @@
+#ifndef CHIPFRAMEPOOL_H
+#define CHIPFRAMEPOOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include "ChipFrame.h"
+
+/**
+ * @brief Fixed set of ChipFrames in one block of memory, mapped once at
+ * start-up.
+ *
+ * The frames live in one mmap()ed block, optionally backed by 2 MiB huge
+ * pages and bound to a NUMA node. Free frames are kept on a lock-free LIFO
+ * list, so any thread may acquire or release and the frames released last
+ * are handed out again first: only as many frames as are ever in flight at
+ * once get faulted in, unless the pool is pre-faulted as a whole.
+ *
+ * Frames come out with their metadata reset but the pixels of their last
+ * use; FrameAssembler writes or zeroes every pixel of a frame.
+ */
+class ChipFramePool
+{
+public:
+    //! @param hugePages back the frames with MAP_HUGETLB pages, falling back
+    //!        to transparent huge pages when none are reserved
+    //! @param numaNode bind the frames to this node, -1 = first touch
+    //! @param prefault fault every frame in now instead of on first use
+    ChipFramePool(unsigned capacity, bool hugePages = false, int numaNode = -1, bool prefault = false);
+    ~ChipFramePool();
+
+    //! @return nullptr when the pool is exhausted, which is counted
+    ChipFrame *acquire();
+    //! Hands the frame back, without touching its pixels
+    void release(ChipFrame *cf);
+
+    unsigned capacity() { return _capacity; }
+    unsigned available() { return _capacity - inUse_.load(std::memory_order_relaxed); }
+    //! Frames handed out at least once, which is what the pool has in memory
+    unsigned touched() { return fresh_.load(std::memory_order_relaxed); }
+
+    std::atomic<uint64_t> exhausted{0};
+
+private:
+    constexpr static uint32_t none = ~0u;
+
+    ChipFrame *pop();
+    void push(ChipFrame *cf);
+    void *map(size_t &bytes, bool hugePages, int numaNode);
+
+    unsigned _capacity;
+    ChipFrame *frames = nullptr;
+    size_t mappedBytes = 0;
+    std::atomic_uint *next = nullptr;   //! Free list links, by frame index
+
+    //! Free list head: push count << 32 | index of the first free frame. The
+    //! count changes with every push, so a stale head never compares equal.
+    alignas(64) std::atomic<uint64_t> top_{none};
+    alignas(64) std::atomic_uint fresh_{0};  //! Frames from here on were never handed out
+    std::atomic_uint inUse_{0};
+};
+
+#endif // CHIPFRAMEPOOL_H
@@ -0,0 +1,59 @@
+#include "DetectorLayout.h"
+
+#include <cassert>
+
+DetectorLayout DetectorLayout::quad() {
+    DetectorLayout l(2 * MPX_PIXEL_COLUMNS, 2 * MPX_PIXEL_ROWS);
+    l.setChip(0, 0, 0);
+    l.setChip(1, MPX_PIXEL_COLUMNS, 0);
+    l.setChip(2, MPX_PIXEL_COLUMNS, MPX_PIXEL_ROWS, ROT180);
+    l.setChip(3, 0, MPX_PIXEL_ROWS, ROT180);
+    return l;
+}
+
+DetectorLayout DetectorLayout::strip() {
+    DetectorLayout l(number_of_chips * MPX_PIXEL_COLUMNS, MPX_PIXEL_ROWS);
+    for (int i = 0; i < number_of_chips; i++) {
+        l.setChip(i, i * MPX_PIXEL_COLUMNS, 0);
+    }
+    return l;
+}
+
+DetectorLayout DetectorLayout::single(int chipIndex) {
+    DetectorLayout l(MPX_PIXEL_COLUMNS, MPX_PIXEL_ROWS);
+    l.setChip(chipIndex, 0, 0);
+    return l;
+}
+
+DetectorLayout DetectorLayout::stacked() {
+    DetectorLayout l(MPX_PIXEL_COLUMNS, number_of_chips * MPX_PIXEL_ROWS);
+    for (int i = 0; i < number_of_chips; i++) {
+        l.setChip(i, 0, i * MPX_PIXEL_ROWS);
+    }
+    return l;
+}
+
+void DetectorLayout::setChip(int chipIndex, int x, int y, Orientation orientation) {
+    assert (chipIndex >= 0 && chipIndex < number_of_chips);
+    assert (x >= 0 && x + MPX_PIXEL_COLUMNS <= width);
+    assert (y >= 0 && y + MPX_PIXEL_ROWS <= height);
+    chips[chipIndex].used = true;
+    chips[chipIndex].x = x;
+    chips[chipIndex].y = y;
+    chips[chipIndex].orientation = orientation;
+}
+
+bool DetectorLayout::isTiled() const {
+    int used = 0;
+    for (int i = 0; i < number_of_chips; i++) {
+        if (!chips[i].used) continue;
+        used++;
+        for (int j = 0; j < i; j++) {
+            if (chips[j].used
+                    && chips[i].x < chips[j].x + MPX_PIXEL_COLUMNS && chips[j].x < chips[i].x + MPX_PIXEL_COLUMNS
+                    && chips[i].y < chips[j].y + MPX_PIXEL_ROWS && chips[j].y < chips[i].y + MPX_PIXEL_ROWS)
+                return false;
+        }
+    }
+    return used * MPX_PIXELS == width * height;
+}
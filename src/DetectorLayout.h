@@ -0,0 +1,45 @@
+#ifndef DETECTORLAYOUT_H
+#define DETECTORLAYOUT_H
+
+#include "FrameSet.h"
+
+/**
+ * @brief Where each chip sits in the assembled detector image.
+ *
+ * Chip pixel (row, column) lands at image (x, y) + the rotated position,
+ * rotations are clockwise. Chips that are not used are left out; pixels of
+ * the image that no chip covers are zero.
+ */
+class DetectorLayout
+{
+public:
+    enum Orientation { ROT0, ROT90, ROT180, ROT270 };
+
+    struct ChipPlacement {
+        bool used = false;
+        int x = 0, y = 0;   //! Top-left corner in the image [pixels]
+        Orientation orientation = ROT0;
+    };
+
+    DetectorLayout() {}
+    DetectorLayout(int width, int height) : width(width), height(height) {}
+
+    //! 2x2 quad, 512x512: chips 0 and 1 on top, 3 and 2 rotated below them
+    static DetectorLayout quad();
+    //! 1x4 strip, 1024x256
+    static DetectorLayout strip();
+    //! One chip, 256x256
+    static DetectorLayout single(int chipIndex = 0);
+    //! The chips one after another, 256x1024, as copyTo32() writes them
+    static DetectorLayout stacked();
+
+    void setChip(int chipIndex, int x, int y, Orientation orientation = ROT0);
+    //! The chips tile the image without gaps or overlap
+    bool isTiled() const;
+
+    int width = 0;
+    int height = 0;
+    ChipPlacement chips[number_of_chips];
+};
+
+#endif // DETECTORLAYOUT_H
@@ -1,11 +1,13 @@
 #include "FrameAssembler.h"
 #include "UdpReceiver.h"
+#include "PixelUnpacker.h"
 #include <iomanip> // For pretty column printing --> std::setw()
 
 //#define SKIPMOSTPIXELS
 
 FrameAssembler::FrameAssembler(int chipIndex) {
     this->chipIndex = chipIndex;
+    setCounterDepth(counter_depth);
 }
 
 void FrameAssembler::onEvent(PacketContainer &pc) {
@@ -13,8 +15,14 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
     if (pc.chipIndex != chipIndex) {
         return;
     }
-    uint64_t *pixel_packet = reinterpret_cast<uint64_t *>(pc.data);
-    uint64_t packetSize = uint64_t(pc.size / sizeofuint64_t);
+    onPacket(pc.data, pc.size, pc.timestamp_ns);
+}
+
+void FrameAssembler::onPacket(char *data, long size, uint64_t timestamp_ns) {
+    decodeStart = monotonic_ns();
+    uint64_t *pixel_packet = reinterpret_cast<uint64_t *>(data);
+    uint64_t packetSize = uint64_t(size / sizeofuint64_t);
+    packetTime = timestamp_ns;
     bool packetLoss;
     if (row_counter >= 0) {
         // we're in a frame
@@ -27,6 +35,8 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
         // bugger, we lost something, find first special packet
         uint16_t i = 0;
         int missing = MPX_PIXEL_COLUMNS - cursor;
+        //! Pixels of the current frame up to here are written
+        int written = row_counter >= 0 ? row_counter * MPX_PIXEL_COLUMNS + cursor : 0;
         int last_row = row_counter,
                 next_row = 0;
         uint16_t next_cursor = 0;
@@ -44,7 +54,9 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
             // somehow we found a new frame, store the current row/frame
             if (frame != nullptr) {
                 frame->pixelsLost += missing + (MPX_PIXEL_ROWS - last_row) * MPX_PIXEL_COLUMNS;
-                fsm->putChipFrame(chipIndex, frame);
+                frame->brokenRows += (missing > 0) + (MPX_PIXEL_ROWS - 1 - last_row);
+                zeroPixels(written, MPX_PIXELS);
+                putFrame();
             }
             frame = nullptr;
             break;
@@ -64,32 +76,28 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
                 // we lost the rest of the frame; finish the current and start a new one
                 if (frame != nullptr) {
                     frame->pixelsLost += missing + (MPX_PIXEL_ROWS - last_row) * MPX_PIXEL_COLUMNS;
-                    fsm->putChipFrame(chipIndex, frame);
+                    frame->brokenRows += (missing > 0) + (MPX_PIXEL_ROWS - 1 - last_row);
+                    zeroPixels(written, MPX_PIXELS);
+                    putFrame();
                 }
-                frame = fsm->newChipFrame(chipIndex);
+                // without its header, a 24-bit frame is the other half of the last one
+                highHalf = counter_depth == 24 && !highHalf;
+                omr.setMode(highHalf ? 4 : 0);
+                newFrame();
                 missing = 0;
                 last_row = -1;
-                if (counter_depth == 24) {
-                    if (omr.getMode() == 1) {
-                        // finished high, next frame
-                        omr.setMode(0);
-                        frameId++;
-                    } else {
-                        // finished low, expect high
-                        omr.setMode(1);
-                    }
-                } else {
-                    frameId++;
-                }
+                written = 0;
                 frame->omr = omr;
             } else {
                 // we lost part of this frame; store the row, start a new one
             }
             cursor = next_cursor;
+            zeroPixels(written, next_row * MPX_PIXEL_COLUMNS + cursor);
             assert (cursor >= 0 && cursor < MPX_PIXEL_COLUMNS);
             assert (packetEndsRow(pixel_packet[(endCursor - cursor) / pixels_per_word]));
             row_counter = next_row;
             frame->pixelsLost += missing + (row_counter - 1 - last_row) * MPX_PIXEL_COLUMNS + cursor;
+            frame->brokenRows += (missing > 0) + (row_counter - 1 - last_row) + (cursor > 0);
             if (cursor == 0) {
                 assert (packetType(pixel_packet[0]) == PIXEL_DATA_SOR);
                 row_counter--;	// the normal processing will start with incrementing and getting the row
@@ -99,20 +107,52 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
         }
     }
 
-    //! Start processing the pixel packet
-    //row_number_from_packet = -1;
+    //! Start processing the pixel packet with the decoder for the current
+    //! counter depth. A decoder hands back early when an info header changes
+    //! the depth, and the rest of the packet goes to the new one.
+    unsigned j = 0;
+    while (j < packetSize) {
+        j += (this->*decoder)(pixel_packet + j, unsigned(packetSize) - j);
+    }
+    publishWordCounts();
+    decodeNs += monotonic_ns() - decodeStart;
+}
+
+//! The decoders count words in plain members, readers get them once per packet
+void FrameAssembler::publishWordCounts() {
+    stats.pSOF.set(words.pSOF);
+    stats.pSOR.set(words.pSOR);
+    stats.pMID.set(words.pMID);
+    stats.pEOR.set(words.pEOR);
+    stats.pEOF.set(words.pEOF);
+    stats.iSOF.set(words.iSOF);
+    stats.iMID.set(words.iMID);
+    stats.iEOF.set(words.iEOF);
+    stats.rubbishWords.set(words.rubbishWords);
+}
+
+/**
+ * @brief Decode pixel words of a Depth-bit frame. The word geometry is known
+ * at compile time, so the compiler can unroll the per-word loops.
+ * @return The number of words consumed. Less than packetSize when an info
+ * header switched to another counter depth.
+ */
+template <int Depth>
+unsigned FrameAssembler::decode(uint64_t *pixel_packet, unsigned packetSize) {
+    using G = PixelGeometry<Depth>;
+
     for (unsigned j = 0; j < packetSize; ++j, ++pixel_packet) {
         uint64_t pixelword = *pixel_packet;
         uint64_t type = pixelword & PKT_TYPE_MASK;
 
         switch (type) {
         case PIXEL_DATA_SOF:
-            ++pSOF;
+            ++words.pSOF;
             row_counter = -1;
-            --pSOR;
             [[fallthrough]];
         case PIXEL_DATA_SOR:
-            ++pSOR;
+            if (type == PIXEL_DATA_SOR)
+                ++words.pSOR;
             ++row_counter;
             if (!(row_counter >= 0 && row_counter < MPX_PIXEL_ROWS)) {
                 spdlog::get("console")->debug(std::string("Row_counter = ").append(std::to_string(row_counter)));
@@ -120,48 +160,56 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
             assert (row_counter >= 0 && row_counter < MPX_PIXEL_ROWS);
             row = frame->getRow(row_counter);
             cursor = 0;
-            --pMID;
             [[fallthrough]];
         case PIXEL_DATA_MID:
-            ++pMID;
-#ifdef SKIPMOSTPIXELS
-            cursor += pixels_per_word;
-#else
-            for(int k=0; k<pixels_per_word; ++k, ++cursor ) {
-                row[cursor] = uint16_t(pixelword & pixel_mask);
-                pixelword >>= counter_bits;
+        {
+            //! Unpack this word and all MID words following it in one go,
+            //! without running past the end of the row
+            unsigned run = 1;
+            unsigned maxRun = unsigned((MPX_PIXEL_COLUMNS - cursor) / G::pixels_per_word);
+            while (run < maxRun && j + run < packetSize
+                   && packetType(pixel_packet[run]) == PIXEL_DATA_MID) {
+                ++run;
             }
+            words.pMID += type == PIXEL_DATA_MID ? run : run - 1;
+#ifndef SKIPMOSTPIXELS
+            PixelUnpacker::unpack<G::counter_bits>(pixel_packet, int(run),
+                                                   row + cursor, MPX_PIXEL_COLUMNS - cursor);
 #endif
+            cursor += run * G::pixels_per_word;
+            j += run - 1;
+            pixel_packet += run - 1;
             assert (cursor < MPX_PIXEL_COLUMNS);
             break;
+        }
         case PIXEL_DATA_EOF:
-            ++pEOF;
+            ++words.pEOF;
             row_counter = -1;
-            --pEOR;
             [[fallthrough]];
         case PIXEL_DATA_EOR:
-            ++pEOR;
+            if (type == PIXEL_DATA_EOR)
+                ++words.pEOR;
             pixelword = lutBugFix(pixelword);
             if (type == PIXEL_DATA_EOF) {
-                frameId = extractFrameId(pixelword);
+                frame->frameId = extractFrameId(pixelword);
             }
             for (; cursor < MPX_PIXEL_COLUMNS; cursor++) {
-                row[cursor] = uint16_t(pixelword & pixel_mask);
-                pixelword >>= counter_bits;
+                row[cursor] = uint16_t(pixelword & G::pixel_mask);
+                pixelword >>= G::counter_bits;
             }
             if (type == PIXEL_DATA_EOF) {
                 // we're done with this one!
-                fsm->putChipFrame(chipIndex, frame);
+                putFrame();
                 frame = nullptr;
             }
             break;
         case INFO_HEADER_SOF:
             //! This is really iSOF (N*1) + iMID (N*6) + iEOF (N*1) = 8*N
-            ++iSOF;
+            ++words.iSOF;
             infoIndex = 0; break;
         case INFO_HEADER_MID:
             //! This is really iMID (N*6) + iEOF (N*1) = 7*N
-            ++iMID;
+            ++words.iMID;
             if (infoIndex == 4)
                 chipId = int((pixelword & 0xffffffff));
             else if (infoIndex == 5 && chipId != 0) {
@@ -169,7 +217,7 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
             }
             infoIndex++; break;
         case INFO_HEADER_EOF:
-            ++iEOF;
+            ++words.iEOF;
             if (chipId < 5) break;
             omr.setLowR(pixelword & 0xffffffff);
             switch (omr.getCountL()) {
@@ -178,26 +226,47 @@ void FrameAssembler::onEvent(PacketContainer &pc) {
             case 2: counter_depth = 12; break;
             case 3: counter_depth = 24; break;
             }
-            counter_bits = counter_depth == 24 ? 12 : counter_depth;
-            pixels_per_word = 60 / counter_bits;
-            pixel_mask = (1 << counter_bits) - 1;
-            endCursor = MPX_PIXEL_COLUMNS - (MPX_PIXEL_COLUMNS % pixels_per_word);
+            setCounterDepth(counter_depth);
             assert (frame == nullptr);
-            frame = fsm->newChipFrame(chipIndex);
+            highHalf = counter_depth == 24 && omr.getMode() == 4;
+            newFrame();
             frame->omr = omr;
+            if (counter_depth != Depth) {
+                return j + 1; //! Continue with the matching decoder
+            }
             break;
         default:
             // Rubbish packets - skip these
             // In theory, there should be none ever
             if (type != 0) {
-                std::cout << "Rubbish packet count: " << rubbish_counter << ": " << type
-                          << "\n";
-                ++rubbish_counter;
+                ++words.rubbishWords;
+                spdlog::get("console")->debug("Rubbish word {}: {:x}", words.rubbishWords, type);
             }
-            ++def;
             break;
         }
     }
+    return packetSize;
+}
+
+void FrameAssembler::setCounterDepth(uint16_t depth) {
+    counter_depth = depth;
+    counter_bits = counter_depth == 24 ? 12 : counter_depth;
+    pixels_per_word = 60 / counter_bits;
+    pixel_mask = (1 << counter_bits) - 1;
+    endCursor = MPX_PIXEL_COLUMNS - (MPX_PIXEL_COLUMNS % pixels_per_word);
+
+    switch (counter_depth) {
+    case 1:  decoder = &FrameAssembler::decode<1>; break;
+    case 6:  decoder = &FrameAssembler::decode<6>; break;
+    case 24: decoder = &FrameAssembler::decode<24>; break;
+    default: decoder = &FrameAssembler::decode<12>; break;
+    }
+}
+
+void FrameAssembler::onEvents(PacketContainer *pcs, int count) {
+    for (int k = 0; k < count; ++k) {
+        onEvent(pcs[k]);
+    }
 }
 
 uint64_t FrameAssembler::lutBugFix(uint64_t pixelword) {
@@ -233,40 +302,93 @@ uint64_t FrameAssembler::lutBugFix(uint64_t pixelword) {
     }
     return pixelword;
 }
+
+/**
+ * @brief Start decoding a frame. It gets the id it should have until its EOF
+ * tells otherwise: the next one, or for the high counters of a 24-bit frame
+ * the same as the low ones. A frame whose EOF got lost keeps that id, so it
+ * still lines up with the other chips. The frame holds the pixels of its
+ * last use: every pixel gets decoded or, where packets got lost, zeroed.
+ */
+void FrameAssembler::newFrame() {
+    frame = fsm->newChipFrame(chipIndex);
+    row_counter = -1;
+    frame->firstPacket_ns = packetTime;
+    frame->frameId = highHalf ? frameId : uint8_t(frameId + 1);
+}
+
+//! Clear pixels [from, to) of the current frame, which lost packets would have filled
+void FrameAssembler::zeroPixels(int from, int to) {
+    if (to > from) {
+        memset(frame->getRow(0) + from, 0, size_t(to - from) * sizeof(uint16_t));
+    }
+}
+
+/**
+ * @brief Hand the current frame to the FrameSetManager, decoding the counters
+ * of the whole frame through the look-up table first if requested.
+ */
+void FrameAssembler::putFrame() {
+    frameId = frame->frameId;
+    frame->lastPacket_ns = packetTime;
+    stats.framesDecoded.add();
+    stats.pixelsLost.add(uint64_t(frame->pixelsLost));
+    stats.rowsLost.add(uint64_t(frame->brokenRows));
+    if (lutDecode() && counter_bits != 1) {
+        PixelUnpacker::decodeLut(counter_bits == 12 ? _mpx3Rx12BitsLut : _mpx3Rx6BitsLut,
+                                 counter_bits, frame->getRow(0), MPX_PIXELS);
+    }
+    //! The frame's share of the packet being decoded ends here
+    uint64_t now = monotonic_ns();
+    decodeTime.record(decodeNs + now - decodeStart);
+    decodeNs = 0;
+    decodeStart = now;
+    fsm->putChipFrame(chipIndex, frame);
+}
+
 void FrameAssembler::lutInit(bool lutBug) {
 
     _lutBug = lutBug;
-    if (lutBug) {
-        // Generate the 6-bit look-up table (LUT) for Medipix3RX decoding
-        int pixcode = 0;
-        for(int i=0; i<64; i++ )
-        {
-            _mpx3Rx6BitsLut[pixcode] = i;
-            _mpx3Rx6BitsEnc[i] = pixcode;
-            // Next code = (!b0 & !b1 & !b2 & !b3 & !b4) ^ b4 ^ b5
-            int bit = (pixcode & 0x01) ^ ((pixcode & 0x20)>>5);
-            if( (pixcode & 0x1F) == 0 ) bit ^= 1;
-            pixcode = ((pixcode << 1) | bit) & 0x3F;
-        }
 
-        // Generate the 12-bit look-up table (LUT) for Medipix3RX decoding
-        pixcode = 0;
-        for(int i=0; i<4096; i++ )
-        {
-            _mpx3Rx12BitsLut[pixcode] = i;
-            _mpx3Rx12BitsEnc[i] = pixcode;
-            // Next code = (!b0 & !b1 & !b2 & !b3 & !b4& !b5& !b6 & !b7 &
-            //              !b8 & !b9 & !b10) ^ b0 ^ b3 ^ b5 ^ b11
-            int bit = ((pixcode & 0x001) ^ ((pixcode & 0x008)>>3) ^
-                       ((pixcode & 0x020)>>5) ^ ((pixcode & 0x800)>>11));
-            if( (pixcode & 0x7FF) == 0 ) bit ^= 1;
-            pixcode = ((pixcode << 1) | bit) & 0xFFF;
-        }
+    //! The tables are built even without the bug, setLutDecode() uses them too
+    // Generate the 6-bit look-up table (LUT) for Medipix3RX decoding
+    int pixcode = 0;
+    for(int i=0; i<64; i++ )
+    {
+        _mpx3Rx6BitsLut[pixcode] = uint16_t(i);
+        _mpx3Rx6BitsEnc[i] = uint16_t(pixcode);
+        // Next code = (!b0 & !b1 & !b2 & !b3 & !b4) ^ b4 ^ b5
+        int bit = (pixcode & 0x01) ^ ((pixcode & 0x20)>>5);
+        if( (pixcode & 0x1F) == 0 ) bit ^= 1;
+        pixcode = ((pixcode << 1) | bit) & 0x3F;
+    }
+
+    // Generate the 12-bit look-up table (LUT) for Medipix3RX decoding
+    pixcode = 0;
+    for(int i=0; i<4096; i++ )
+    {
+        _mpx3Rx12BitsLut[pixcode] = uint16_t(i);
+        _mpx3Rx12BitsEnc[i] = uint16_t(pixcode);
+        // Next code = (!b0 & !b1 & !b2 & !b3 & !b4& !b5& !b6 & !b7 &
+        //              !b8 & !b9 & !b10) ^ b0 ^ b3 ^ b5 ^ b11
+        int bit = ((pixcode & 0x001) ^ ((pixcode & 0x008)>>3) ^
+                   ((pixcode & 0x020)>>5) ^ ((pixcode & 0x800)>>11));
+        if( (pixcode & 0x7FF) == 0 ) bit ^= 1;
+        pixcode = ((pixcode << 1) | bit) & 0xFFF;
+    }
+}
+
+uint16_t FrameAssembler::lutValue(int counterBits, uint16_t raw) {
+    switch (counterBits) {
+    case 6:  return _mpx3Rx6BitsLut[raw & 0x3f];
+    case 12: return _mpx3Rx12BitsLut[raw & 0xfff];
+    default: return raw;
     }
 }
 
-int   FrameAssembler::_mpx3Rx6BitsLut[64];
-int   FrameAssembler::_mpx3Rx6BitsEnc[64];
-int   FrameAssembler::_mpx3Rx12BitsLut[4096];
-int   FrameAssembler::_mpx3Rx12BitsEnc[4096];
+uint16_t FrameAssembler::_mpx3Rx6BitsLut[64 + 1];
+uint16_t FrameAssembler::_mpx3Rx6BitsEnc[64];
+uint16_t FrameAssembler::_mpx3Rx12BitsLut[4096 + 1];
+uint16_t FrameAssembler::_mpx3Rx12BitsEnc[4096];
 bool  FrameAssembler::_lutBug;
+std::atomic_bool FrameAssembler::_lutDecode{false};
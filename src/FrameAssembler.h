@@ -1,12 +1,15 @@
 #ifndef FRAMEASSEMBLER_H
 #define FRAMEASSEMBLER_H
 
+#include <atomic>
 #include <stdint.h>
 
 #include "OMR.h"
 #include "FrameSetManager.h"
+#include "LatencyHistogram.h"
 #include "UdpReceiver.h"
 #include "PacketContainer.h"
+#include "Statistics.h"
 
 //! See Table 54 (MPX3 Packet Format) - SPIDR Register Map
 //! 64 bit masks because of the uint64_t data type
@@ -27,24 +30,49 @@ const static uint64_t ROW_COUNT_SHIFT = 52;
 const static uint64_t FRAME_FLAGS_MASK = 0x000FFFF000000000;
 const static uint64_t FRAME_FLAGS_SHIFT = 36;
 
+//! Pixel word geometry of a counter depth, 24-bit frames arrive as two
+//! 12-bit halves
+template <int Depth>
+struct PixelGeometry {
+    static constexpr int counter_bits = Depth == 24 ? 12 : Depth;
+    static constexpr int pixels_per_word = 60 / counter_bits;
+    static constexpr uint64_t pixel_mask = (uint64_t(1) << counter_bits) - 1;
+    static constexpr int endCursor = MPX_PIXEL_COLUMNS - (MPX_PIXEL_COLUMNS % pixels_per_word);
+};
+
 class FrameAssembler {
 public:
   FrameAssembler(int chipIndex);
   void setFrameSetManager (FrameSetManager * fsm) { this->fsm = fsm; }
   void onEvent(PacketContainer &pc);
+  void onEvents(PacketContainer *pcs, int count);
+  //! Decode a datagram of this chip where it lies, e.g. in a kernel ring.
+  //! @param data must be 8-byte aligned
+  void onPacket(char *data, long size, uint64_t timestamp_ns);
 
   int infoIndex = 0;
   int chipId;
   OMR omr;
 
   int chipIndex;
+  //! Decode counters of this chip; the receive side fills in packets and bytes
+  ChipStatistics stats;
+  //! Time spent in onPacket() per chip frame [ns], LUT decoding included
+  LatencyHistogram decodeTime;
 
   static void lutInit(bool lutBug);
+  //! Decode raw Medipix3RX pseudo-random counter values on the host, for
+  //! when the SPIDR does not apply its look-up table. May change while the
+  //! chip threads decode; a frame picks it up at putFrame().
+  static void setLutDecode(bool enable) { _lutDecode.store(enable, std::memory_order_relaxed); }
+  static bool lutDecode() { return _lutDecode.load(std::memory_order_relaxed); }
+  //! What LUT decoding makes of a raw counter value, for checking decoded frames
+  static uint16_t lutValue(int counterBits, uint16_t raw);
 
 private:
   FrameSetManager *fsm;
   int sizeofuint64_t = sizeof(uint64_t);
-  int row_counter = -1, rubbish_counter = 0;
+  int row_counter = -1;
   uint16_t cursor = 55555;
   uint16_t counter_depth = 12;
   uint16_t counter_bits  = 12;
@@ -53,8 +81,15 @@ private:
   uint32_t pixel_mask = 0xfff;
   uint16_t endCursor = 256;
 
-  uint8_t frameId = 0;
+  uint8_t frameId = 0;     //! Of the last frame handed over
+  bool highHalf = false;   //! Decoding the high counters of a 24-bit frame
   ChipFrame *frame = nullptr;
+  uint64_t packetTime = 0; //! Arrival of the packet being decoded
+  uint64_t decodeStart = 0; //! When decoding of this packet, or the frame in it, began
+  uint64_t decodeNs = 0;    //! Spent on the current frame in earlier packets
+  struct {
+      uint64_t pSOF, pSOR, pMID, pEOR, pEOF, iSOF, iMID, iEOF, rubbishWords;
+  } words = {};
   uint16_t *row;
 
   inline uint8_t extractRow(uint64_t pixelword) { return uint8_t(((pixelword & ROW_COUNT_MASK) >> ROW_COUNT_SHIFT));}
@@ -63,13 +98,25 @@ private:
   inline bool packetEndsRow(uint64_t pixelword) { return (pixelword & 0x6000000000000000) == 0x6000000000000000; }
 
   uint64_t lutBugFix(uint64_t pixelword);
+  void newFrame();
+  void zeroPixels(int from, int to);
+  void publishWordCounts();
+  void putFrame();
+
+  //! One decoder per counter depth, picked when an info header sets the depth
+  typedef unsigned (FrameAssembler::*Decoder)(uint64_t *pixel_packet, unsigned packetSize);
+  Decoder decoder;
+  template <int Depth> unsigned decode(uint64_t *pixel_packet, unsigned packetSize);
+  void setCounterDepth(uint16_t depth);
 
-  // Look-up tables for Medipix3RX pixel data decoding
-  static int   _mpx3Rx6BitsLut[64];
-  static int   _mpx3Rx6BitsEnc[64];
-  static int   _mpx3Rx12BitsLut[4096];
-  static int   _mpx3Rx12BitsEnc[4096];
+  // Look-up tables for Medipix3RX pixel data decoding.
+  // The decoding tables have one spare entry so 32-bit gathers stay in bounds.
+  static uint16_t _mpx3Rx6BitsLut[64 + 1];
+  static uint16_t _mpx3Rx6BitsEnc[64];
+  static uint16_t _mpx3Rx12BitsLut[4096 + 1];
+  static uint16_t _mpx3Rx12BitsEnc[4096];
   static bool  _lutBug;
+  static std::atomic_bool _lutDecode;
 
 };
 #endif // FRAMEASSEMBLER_H
@@ -0,0 +1,330 @@
+#include "FrameRecorder.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mpx3defs.h"
+#include "PixelUnpacker.h"
+#include "spdlog/spdlog.h"
+
+constexpr static size_t block_size = 4096; //! O_DIRECT alignment of buffers, sizes and offsets
+
+static size_t roundUp(size_t n) { return (n + block_size - 1) & ~(block_size - 1); }
+
+//! Largest event: 24-bit counters stored as 32 bits
+constexpr static size_t max_event_size =
+        EVT_HEADER_SIZE + number_of_chips * (DEV_HEADER_SIZE + MPX_PIXELS * sizeof(uint32_t));
+
+FrameRecorder::FrameRecorder(size_t bufferBytes, int buffers)
+    : bufferBytes(roundUp(bufferBytes < max_event_size ? max_event_size : bufferBytes)),
+      nBuffers(buffers < 2 ? 2 : buffers)
+{
+    this->buffers = new Buffer[nBuffers];
+    for (int i = 0; i < nBuffers; i++) {
+        this->buffers[i].data = static_cast<uint8_t *>(aligned_alloc(block_size, this->bufferBytes));
+        memset(this->buffers[i].data, 0, this->bufferBytes); //! Fault the pages in now
+    }
+
+    // Preset the headers
+    memset(&evtHdr, 0, sizeof(evtHdr));
+    evtHdr.headerId   = EVT_HEADER_ID;
+    evtHdr.headerSize = EVT_HEADER_SIZE;
+    evtHdr.format     = EVT_HEADER_VERSION;
+    evtHdr.nrOfDevices = number_of_chips;
+    for (size_t i = 0; i < sizeof(evtHdr.unused) / sizeof(uint32_t); ++i)
+        evtHdr.unused[i] = HEADER_FILLER_WORD;
+    for (size_t i = 0; i < sizeof(evtHdr.triggerConfig) / sizeof(uint32_t); ++i)
+        evtHdr.triggerConfig[i] = 0xAAAAAAAA; // ### Not yet implemented
+    for (int i = 0; i < number_of_chips; ++i) {
+        memset(&devHdr[i], 0, sizeof(devHdr[i]));
+        devHdr[i].headerId   = DEV_HEADER_ID;
+        devHdr[i].headerSize = DEV_HEADER_SIZE;
+        devHdr[i].format     = DEV_HEADER_VERSION | DEV_DATA_DECODED;
+        devHdr[i].deviceId   = (i+1) * 0x11111111; // Dummy ID
+        devHdr[i].deviceType = MPX_TYPE_NC; // Not connected
+        for (size_t j = 0; j < sizeof(devHdr[i].unused) / sizeof(uint32_t); ++j)
+            devHdr[i].unused[j] = HEADER_FILLER_WORD;
+    }
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+    for (int i = 0; i < nBuffers; i++) {
+        free(buffers[i].data);
+    }
+    delete[] buffers;
+}
+
+void FrameRecorder::setAddrInfo(int *ipaddr, int *ports)
+{
+    evtHdr.ipAddress = ((ipaddr[0] << 0)  | (ipaddr[1] << 8) |
+                        (ipaddr[2] << 16) | (ipaddr[3] << 24));
+    for (int i = 0; i < 4; ++i)
+        evtHdr.ports[i] = ports[i];
+}
+
+void FrameRecorder::setDeviceIdsAndTypes(int *ids, int *types)
+{
+    for (int i = 0; i < number_of_chips; ++i) {
+        devHdr[i].deviceId   = ids[i];
+        devHdr[i].deviceType = types[i];
+    }
+}
+
+bool FrameRecorder::open(const std::string &filename, bool overwrite)
+{
+    close();
+
+    int flags = O_WRONLY | O_CREAT | (overwrite ? O_TRUNC : O_EXCL);
+    fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+    direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL) {
+        //! e.g. tmpfs does not do O_DIRECT
+        fd = ::open(filename.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        spdlog::get("console")->error("Failed to open file \"{}\": {}", filename, strerror(errno));
+        return false;
+    }
+    spdlog::get("console")->info("Recording to \"{}\"{}, {} x {} MiB buffers", filename,
+                                 direct ? " with O_DIRECT" : "", nBuffers, bufferBytes >> 20);
+    eventsRecorded = 0;
+    eventsDropped = 0;
+    bytesWritten = 0;
+    writeErrors = 0;
+    evtNr = 0;
+    fileOffset = 0;
+    return true;
+}
+
+void FrameRecorder::start(FrameSetManager *fsm)
+{
+    if (fd < 0 || stager.joinable()) {
+        return;
+    }
+    this->fsm = fsm;
+    for (int i = 0; i < nBuffers; i++) {
+        buffers[i].fill = 0;
+        buffers[i].state = FREE;
+    }
+    current = next = 0;
+    buffers[0].state = FILLING;
+    stopping = false;
+    staging = true;
+    writer = std::thread(&FrameRecorder::write, this);
+    stager = std::thread(&FrameRecorder::stage, this);
+}
+
+bool FrameRecorder::close()
+{
+    if (fd < 0) {
+        return false;
+    }
+    stopping = true;
+    if (stager.joinable()) stager.join();
+    if (writer.joinable()) writer.join();
+
+    //! The last buffer was padded for O_DIRECT, cut the file to its real length
+    if (ftruncate(fd, off_t(bytesWritten)) != 0) {
+        spdlog::get("console")->error("ftruncate: {}", strerror(errno));
+    }
+    ::close(fd);
+    fd = -1;
+    spdlog::get("console")->info("Recorded {} events, {} dropped, {} MiB", eventsRecorded,
+                                 eventsDropped, bytesWritten >> 20);
+    return true;
+}
+
+void FrameRecorder::stage()
+{
+    while (!stopping) {
+        if (!fsm->wait(100))
+            continue;
+        FrameSet *fs = fsm->takeFrameSet();
+        if (fs == nullptr) {
+            //! The live consumer still holds a set it got before we started
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        if (record(fs))
+            eventsRecorded++;
+        else
+            eventsDropped++;
+        passOn(fs);
+    }
+    //! Take back a set the live consumer did not pick up
+    unsigned st = FrameSet::PUBLISHED;
+    if (live.state.compare_exchange_strong(st, FrameSet::EVICTING, std::memory_order_acq_rel))
+        fsm->releaseFrameSet(&live);
+    //! Hand over what is left for the writer
+    if (buffers[current].fill > 0) {
+        buffers[current].state.store(FULL, std::memory_order_release);
+    }
+    staging = false;
+    filled.notifyAll();
+}
+
+bool FrameRecorder::record(FrameSet *fs)
+{
+    int depth = fs->counterDepth();
+    size_t pixelBytes = depth == 24 ? sizeof(uint32_t) : sizeof(uint16_t);
+    size_t devData = MPX_PIXELS * pixelBytes;
+    size_t evtBytes = EVT_HEADER_SIZE + number_of_chips * (DEV_HEADER_SIZE + devData);
+    if (!reserve(evtBytes))
+        return false;
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    evtHdr.dataSize = uint32_t(evtBytes - EVT_HEADER_SIZE);
+    evtHdr.evtNr = evtNr++;
+    evtHdr.secs = uint32_t(ms / 1000);
+    evtHdr.msecs = uint32_t(ms % 1000);
+    evtHdr.pixelDepth = depth;
+    append(&evtHdr, EVT_HEADER_SIZE);
+
+    uint32_t row32[MPX_PIXEL_COLUMNS];
+    for (int i = 0; i < number_of_chips; ++i) {
+        ChipView v = fs->view(i);
+        devHdr[i].dataSize = uint32_t(devData);
+        devHdr[i].spidrHeader[0] = uint32_t(fs->frameId);
+        devHdr[i].lostPackets = v.pixelsLost;
+        append(&devHdr[i], DEV_HEADER_SIZE);
+        for (int r = 0; r < MPX_PIXEL_ROWS; ++r) {
+            if (!v.valid()) {
+                memset(row32, 0, sizeof(row32));
+                append(row32, MPX_PIXEL_COLUMNS * pixelBytes);
+            } else if (depth == 24) {
+                PixelUnpacker::widen(v.lowRow(r), v.highRow(r), row32, MPX_PIXEL_COLUMNS);
+                append(row32, sizeof(row32));
+            } else {
+                append(v.lowRow(r), MPX_PIXEL_COLUMNS * sizeof(uint16_t));
+            }
+        }
+    }
+    return true;
+}
+
+//! Hand fs on to the live consumer, unless it is still reading the last one
+void FrameRecorder::passOn(FrameSet *fs)
+{
+    unsigned st = FrameSet::PUBLISHED;
+    if (live.state.compare_exchange_strong(st, FrameSet::EVICTING, std::memory_order_acq_rel)) {
+        //! Not picked up yet, the newer set replaces it
+        fsm->releaseFrameSet(&live);
+        st = FrameSet::FREE;
+    }
+    if (st != FrameSet::FREE) {
+        fsm->releaseFrameSet(fs);
+        return;
+    }
+    fsm->detachFrameSet(fs, &live);
+    passed.notifyAll();
+}
+
+bool FrameRecorder::wait(unsigned long timeout_ms)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (;;) {
+        unsigned epoch = passed.epoch();
+        unsigned st = live.state.load(std::memory_order_acquire);
+        if (st == FrameSet::PUBLISHED || st == FrameSet::READING)
+            return true;
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            return false;
+        passed.wait(epoch, std::chrono::duration_cast<std::chrono::microseconds>(deadline - now));
+    }
+}
+
+FrameSet *FrameRecorder::getFrameSet()
+{
+    unsigned st = FrameSet::PUBLISHED;
+    if (live.state.compare_exchange_strong(st, FrameSet::READING, std::memory_order_acq_rel)
+            || st == FrameSet::READING)
+        return &live;
+    return nullptr;
+}
+
+//! Make sure bytes fit in the current buffer and, if needed, the next one
+bool FrameRecorder::reserve(size_t bytes)
+{
+    if (bytes <= bufferBytes - buffers[current].fill)
+        return true;
+    return buffers[(current + 1) % nBuffers].state.load(std::memory_order_acquire) == FREE;
+}
+
+void FrameRecorder::append(const void *src, size_t bytes)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(src);
+    while (bytes > 0) {
+        Buffer &b = buffers[current];
+        if (b.fill == bufferBytes) {
+            submit();
+            continue;
+        }
+        size_t n = bufferBytes - b.fill;
+        if (n > bytes) n = bytes;
+        memcpy(b.data + b.fill, p, n);
+        b.fill += n;
+        p += n;
+        bytes -= n;
+    }
+}
+
+//! Pass the full current buffer to the writer and go on with the next
+void FrameRecorder::submit()
+{
+    buffers[current].state.store(FULL, std::memory_order_release);
+    filled.notifyAll();
+    current = (current + 1) % nBuffers;
+    buffers[current].fill = 0;
+    buffers[current].state.store(FILLING, std::memory_order_relaxed);
+}
+
+void FrameRecorder::write()
+{
+    for (;;) {
+        unsigned epoch = filled.epoch();
+        Buffer &b = buffers[next];
+        if (b.state.load(std::memory_order_acquire) == FULL) {
+            writeBuffer(b, b.fill);
+            b.fill = 0;
+            b.state.store(FREE, std::memory_order_release);
+            next = (next + 1) % nBuffers;
+            continue;
+        }
+        if (!staging) {
+            //! The last buffer is marked full before staging drops
+            if (b.state.load(std::memory_order_acquire) == FULL)
+                continue;
+            break;
+        }
+        filled.wait(epoch, std::chrono::milliseconds(100));
+    }
+}
+
+bool FrameRecorder::writeBuffer(Buffer &b, size_t bytes)
+{
+    //! Only the last buffer of a recording can be partly filled
+    size_t padded = direct ? roundUp(bytes) : bytes;
+    memset(b.data + bytes, 0, padded - bytes);
+    size_t done = 0;
+    while (done < padded) {
+        ssize_t n = pwrite(fd, b.data + done, padded - done, off_t(fileOffset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            spdlog::get("console")->error("Recorder write: {}", strerror(errno));
+            writeErrors++;
+            return false;
+        }
+        done += size_t(n);
+    }
+    fileOffset += padded;
+    bytesWritten += bytes;
+    return true;
+}
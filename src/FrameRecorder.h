@@ -0,0 +1,102 @@
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "FrameSetManager.h"
+#include "Notifier.h"
+#include "spidrdata.h"
+
+/**
+ * @brief Streams FrameSets to disk in the spidrdata.h event format.
+ *
+ * Every set becomes an EvtHeader followed, per chip, by a DevHeader and the
+ * decoded counters (16 bits per pixel, 32 in 24-bit mode; DEV_DATA_DECODED is
+ * set). The lostPackets field of a DevHeader holds the pixels lost instead,
+ * which is what the receive path counts, and spidrHeader[0] the frame id.
+ *
+ * While recording, the recorder is the FrameSetManager's consumer. A stage
+ * thread copies each set into one of a few large, page aligned buffers; a
+ * writer thread writes full buffers with O_DIRECT (plain writes where the
+ * file system refuses it). When no buffer is free the set is dropped and
+ * counted, the receive path never waits for the disk.
+ *
+ * The stage thread then passes the set on to the live consumer (getFrameSet()
+ * here instead of on the FrameSetManager) with its chip frames detached from
+ * the ring. Sets the live consumer is still busy for are skipped, the
+ * recording never waits for it either.
+ */
+class FrameRecorder
+{
+public:
+    //! @param bufferBytes size of each buffer, rounded up to 4 KiB and to at
+    //!        least one full 24-bit event
+    explicit FrameRecorder(size_t bufferBytes = 16 << 20, int buffers = 2);
+    ~FrameRecorder();
+
+    //! Header information, as FramebuilderThread::setAddrInfo() and
+    //! setDeviceIdsAndTypes()
+    void setAddrInfo(int *ipaddr, int *ports);
+    void setDeviceIdsAndTypes(int *ids, int *types);
+
+    bool open(const std::string &filename, bool overwrite = false);
+    //! Start consuming sets from fsm
+    void start(FrameSetManager *fsm);
+    //! Stop consuming, write what is buffered and close the file
+    bool close();
+    bool isOpen() { return fd >= 0; }
+    bool isRecording() { return staging; }
+
+    //! The live consumer's side while recording, as on the FrameSetManager;
+    //! releaseFrameSet() on the FrameSetManager hands a set back
+    bool wait(unsigned long timeout_ms);
+    FrameSet *getFrameSet();
+
+    // Statistics
+    std::atomic<uint64_t> eventsRecorded{0};
+    std::atomic<uint64_t> eventsDropped{0};  //! No free buffer
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> writeErrors{0};
+
+private:
+    enum BufferState { FREE, FILLING, FULL };
+    struct Buffer {
+        uint8_t *data = nullptr;
+        size_t fill = 0;
+        std::atomic_int state{FREE};
+    };
+
+    void stage();
+    void write();
+    bool record(FrameSet *fs);
+    void passOn(FrameSet *fs);
+    bool reserve(size_t bytes);
+    void append(const void *src, size_t bytes);
+    void submit();
+    bool writeBuffer(Buffer &b, size_t bytes);
+
+    size_t bufferBytes;
+    int nBuffers;
+    Buffer *buffers;
+    int current = 0;     //! Buffer being filled by the stage thread
+    int next = 0;        //! Buffer the writer thread waits for
+    uint64_t fileOffset = 0;
+    uint32_t evtNr = 0;
+
+    int fd = -1;
+    bool direct = false;
+    FrameSetManager *fsm = nullptr;
+    std::atomic_bool stopping{false};
+    std::atomic_bool staging{false};
+    std::thread stager, writer;
+    Notifier filled;
+    FrameSet live;       //! Passed on to the live consumer, see detachFrameSet()
+    Notifier passed;
+
+    EvtHeader_t evtHdr;
+    DevHeader_t devHdr[number_of_chips];
+};
+
+#endif // FRAMERECORDER_H
@@ -1,5 +1,11 @@
 #include <cassert>
+#include <chrono>
+#include <mutex>
+#include <thread>
 #include "FrameSet.h"
+#include "DetectorLayout.h"
+#include "Notifier.h"
+#include "PixelUnpacker.h"
 
 FrameSet::FrameSet()
 {
@@ -10,15 +16,28 @@ FrameSet::~FrameSet() {
     clear();
 }
 
+//! Resets the bookkeeping; the chip frames are taken out by the FrameSetManager
 void FrameSet::clear() {
-    for (int i = 0; i < number_of_chips; i++)
-      for (int j = 0; j < 2; j++)
-        if (frame[j][i] != nullptr) {
-            //delete frame[j][i];
-            //frame[j][i] = nullptr;
-            frame[j][i]->clear();
+    counters.store(1, std::memory_order_relaxed);
+    frameId.store(-1, std::memory_order_relaxed);
+    expected.store(0, std::memory_order_relaxed);
+    claimed.store(0, std::memory_order_relaxed);
+    done.store(0, std::memory_order_relaxed);
+}
+
+void FrameSet::stampPacketTimes() {
+    uint64_t first = UINT64_MAX, last = 0;
+    for (int j = 0; j < counters; j++) {
+        for (int i = 0; i < number_of_chips; i++) {
+            ChipFrame *cf = frame[j][i];
+            if (cf == nullptr || cf->firstPacket_ns == 0)
+                continue;
+            if (cf->firstPacket_ns < first) first = cf->firstPacket_ns;
+            if (cf->lastPacket_ns > last) last = cf->lastPacket_ns;
         }
-    counters = 1;
+    }
+    firstPacket_ns = last == 0 ? 0 : first;
+    lastPacket_ns = last;
 }
 
 bool FrameSet::isComplete() {
@@ -31,7 +50,6 @@ bool FrameSet::isComplete() {
 
 ChipFrame* FrameSet::takeChipFrame(int chipIndex, bool counterH) {
     assert (chipIndex >= 0 && chipIndex < number_of_chips);
-    assert (! counterH || counters == 2);
     ChipFrame **spot = &(frame[counterH ? 1 : 0][chipIndex]);
     ChipFrame *result = *spot;
     if (result != nullptr) {
@@ -45,25 +63,23 @@ void FrameSet::putChipFrame(int chipIndex, ChipFrame *cf) {
     assert (cf != nullptr);
     // in 24 bit mode use both counters, not in CRW;
     // FOR NOW not in "both counters" mode!
-    if (cf->omr.getCountL() == 3) counters = 2;
+    // Every chip of the set stores the same value, possibly concurrently.
+    if (cf->omr.getCountL() == 3) counters.store(2, std::memory_order_relaxed);
     int hi = (counters == 2 && cf->omr.getMode() == 4) ? 1 : 0;
     assert (hi == 0 || counters == 2);
     ChipFrame **spot = &(frame[hi][chipIndex]);
-    if (*spot != nullptr) delete *spot;
+    assert (*spot == nullptr);
     *spot = cf;
 }
 
 void FrameSet::copyTo32(int chipIndex, uint32_t *dest) {
     ChipFrame *f0 = frame[0][chipIndex];
     ChipFrame *f1 = frame[1][chipIndex];
-    uint16_t * src0 = f0->getRow(0);
-    int n = MPX_PIXELS;
-    if (f1 == nullptr) {
-        while (n--) *(dest++) = *(src0++);
-    } else {
-        uint16_t *src1 = f1->getRow(0);
-        while (n--) *(dest++) = (uint32_t(*(src1++)) << 12) | *(src0++) ;
+    if (f0 == nullptr) {
+        memset(dest, 0, MPX_PIXELS * sizeof(uint32_t));
+        return;
     }
+    PixelUnpacker::widen(f0->getRow(0), f1 == nullptr ? nullptr : f1->getRow(0), dest, MPX_PIXELS);
 }
 
 void FrameSet::copyTo32(uint32_t *dest) {
@@ -73,6 +89,203 @@ void FrameSet::copyTo32(uint32_t *dest) {
     }
 }
 
+/**
+ * @brief Helper threads of copyTo32(dest, threads), started on first use and
+ * kept for the life of the process: starting threads costs more than copying
+ * a set. After a copy they spin for a while, so copies at frame rate find
+ * them awake, and then sleep until the next one.
+ */
+class CopyWorkers
+{
+public:
+    static CopyWorkers &instance() {
+        static CopyWorkers workers;
+        return workers;
+    }
+
+    void run(FrameSet *set, uint32_t *dest, int threads) {
+        std::lock_guard<std::mutex> lock(busy);
+        this->set = set;
+        this->dest = dest;
+        this->threads = threads;
+        pending.store(threads - 1, std::memory_order_relaxed);
+        job.fetch_add(1, std::memory_order_release);
+        started.notifyAll();
+        work(0);
+        while (pending.load(std::memory_order_acquire) > 0) {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    constexpr static auto spin_time = std::chrono::microseconds(500);
+
+    CopyWorkers() {
+        for (int t = 1; t < number_of_chips; t++) {
+            helpers[t - 1] = std::thread(&CopyWorkers::serve, this, t);
+        }
+    }
+
+    ~CopyWorkers() {
+        stop.store(true);
+        started.notifyAll();
+        for (auto &th : helpers) {
+            th.join();
+        }
+    }
+
+    void work(int t) {
+        for (int i = t; i < number_of_chips; i += threads) {
+            set->copyTo32(i, dest + i * MPX_PIXELS);
+        }
+    }
+
+    void serve(int t) {
+        unsigned seen = 0;
+        for (;;) {
+            auto spinUntil = std::chrono::steady_clock::now() + spin_time;
+            unsigned j;
+            while ((j = job.load(std::memory_order_acquire)) == seen && !stop.load()) {
+                if (std::chrono::steady_clock::now() < spinUntil) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                unsigned epoch = started.epoch();
+                if (job.load(std::memory_order_acquire) == seen && !stop.load())
+                    started.wait(epoch, std::chrono::seconds(1));
+            }
+            if (stop.load())
+                return;
+            seen = j;
+            if (t < threads) {
+                work(t);
+                pending.fetch_sub(1, std::memory_order_release);
+            }
+        }
+    }
+
+    std::mutex busy;                //! One copy at a time
+    FrameSet *set = nullptr;
+    uint32_t *dest = nullptr;
+    int threads = 1;
+    std::atomic_uint job{0};        //! Bumped per copy
+    std::atomic_int pending{0};     //! Helpers still copying
+    std::atomic_bool stop{false};
+    Notifier started;
+    std::thread helpers[number_of_chips - 1];
+};
+
+/**
+ * @brief copyTo32() with the chips split over threads, the calling thread
+ * taking the first share and helper threads kept from earlier copies the
+ * rest. Pays off when memory bandwidth per core is the limit.
+ */
+void FrameSet::copyTo32(uint32_t *dest, int threads) {
+    if (threads > number_of_chips) threads = number_of_chips;
+    if (threads <= 1) {
+        copyTo32(dest);
+        return;
+    }
+    CopyWorkers::instance().run(this, dest, threads);
+}
+
+template <typename T>
+static inline T toPixel(const uint16_t *lo, const uint16_t *hi, int c) {
+    uint32_t v = lo[c];
+    if (hi != nullptr) v |= uint32_t(hi[c]) << 12;
+    if (sizeof(T) == 2 && v > 0xffff) v = 0xffff;
+    return T(v);
+}
+
+//! Write one chip into the image, rotated as placed
+template <typename T>
+static void placeChip(const ChipView &v, const DetectorLayout::ChipPlacement &p, T *image, int width) {
+    constexpr int n = MPX_PIXEL_COLUMNS - 1;
+    T *origin = image + size_t(p.y) * width + p.x;
+    if (!v.valid()) {
+        for (int r = 0; r < MPX_PIXEL_ROWS; r++)
+            memset(origin + size_t(r) * width, 0, MPX_PIXEL_COLUMNS * sizeof(T));
+        return;
+    }
+    for (int r = 0; r < MPX_PIXEL_ROWS; r++) {
+        const uint16_t *lo = v.lowRow(r);
+        const uint16_t *hi = v.high == nullptr ? nullptr : v.highRow(r);
+        switch (p.orientation) {
+        case DetectorLayout::ROT0: {
+            T *dst = origin + size_t(r) * width;
+            if constexpr (sizeof(T) == 4) {
+                PixelUnpacker::widen(lo, hi, dst, MPX_PIXEL_COLUMNS);
+            } else if (hi == nullptr) {
+                memcpy(dst, lo, MPX_PIXEL_COLUMNS * sizeof(T));
+            } else {
+                for (int c = 0; c <= n; c++) dst[c] = toPixel<T>(lo, hi, c);
+            }
+            break;
+        }
+        case DetectorLayout::ROT90:
+            for (int c = 0; c <= n; c++) origin[size_t(c) * width + n - r] = toPixel<T>(lo, hi, c);
+            break;
+        case DetectorLayout::ROT180: {
+            T *dst = origin + size_t(n - r) * width + n;
+            for (int c = 0; c <= n; c++) dst[-c] = toPixel<T>(lo, hi, c);
+            break;
+        }
+        case DetectorLayout::ROT270:
+            for (int c = 0; c <= n; c++) origin[size_t(n - c) * width + r] = toPixel<T>(lo, hi, c);
+            break;
+        }
+    }
+}
+
+template <typename T>
+static void assembleImage(FrameSet *fs, const DetectorLayout &layout, T *image) {
+    if (!layout.isTiled())
+        memset(image, 0, size_t(layout.width) * layout.height * sizeof(T));
+    for (int i = 0; i < number_of_chips; i++) {
+        if (layout.chips[i].used)
+            placeChip(fs->view(i), layout.chips[i], image, layout.width);
+    }
+}
+
+void FrameSet::assemble(const DetectorLayout &layout, uint32_t *image) {
+    assembleImage(this, layout, image);
+}
+
+void FrameSet::assemble(const DetectorLayout &layout, uint16_t *image) {
+    assembleImage(this, layout, image);
+}
+
+ChipView FrameSet::view(int chipIndex) {
+    assert (chipIndex >= 0 && chipIndex < number_of_chips);
+    ChipView v;
+    v.y = chipIndex * MPX_PIXEL_ROWS;
+    ChipFrame *f0 = frame[0][chipIndex];
+    ChipFrame *f1 = frame[1][chipIndex];
+    if (f0 == nullptr || (counters == 2 && f1 == nullptr))
+        return v;
+    v.low = f0->getRow(0);
+    v.pixelsLost = f0->pixelsLost;
+    if (counters == 2) {
+        v.high = f1->getRow(0);
+        v.pixelsLost += f1->pixelsLost;
+    }
+    return v;
+}
+
+int FrameSet::counterDepth() {
+    if (counters == 2) return 24;
+    for (int i = 0; i < number_of_chips; i++) {
+        if (frame[0][i] == nullptr) continue;
+        switch (frame[0][i]->omr.getCountL()) {
+        case 0: return 1;
+        case 1: return 6;
+        case 2: return 12;
+        default: return 24;
+        }
+    }
+    return 12;
+}
+
 int FrameSet::pixelsLost() {
     int count = 0;
     for (int j = 0; j < counters; j++)
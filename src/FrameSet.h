@@ -1,10 +1,36 @@
 #ifndef FRAMESET_H
 #define FRAMESET_H
 
+#include <atomic>
 #include "ChipFrame.h"
 
 const static int number_of_chips = 4;
 
+class DetectorLayout;
+
+/**
+ * @brief Read-only view of one chip's counters, in place in its ChipFrame.
+ * A pixel is low[row * rowStride + column], in 24-bit mode with
+ * high[...] << 12 on top. Only valid until the FrameSet is released.
+ */
+struct ChipView {
+    const uint16_t *low = nullptr;   //! nullptr when the chip frame was lost
+    const uint16_t *high = nullptr;  //! Upper 12 bits in 24-bit mode, else nullptr
+    int rows = MPX_PIXEL_ROWS;
+    int columns = MPX_PIXEL_COLUMNS;
+    int rowStride = MPX_PIXEL_COLUMNS; //! [pixels]
+    int x = 0, y = 0;                  //! Origin of the chip in the detector image [pixels]
+    int pixelsLost = MPX_PIXELS;
+
+    bool valid() const { return low != nullptr; }
+    const uint16_t *lowRow(int row) const { return low + row * rowStride; }
+    const uint16_t *highRow(int row) const { return high + row * rowStride; }
+    uint32_t pixel(int row, int column) const {
+        uint32_t v = lowRow(row)[column];
+        return high == nullptr ? v : v | uint32_t(highRow(row)[column]) << 12;
+    }
+};
+
 class FrameSet
 {
 public:
@@ -16,10 +42,48 @@ public:
     bool isComplete();
     void copyTo32(int chipIndex, uint32_t *dest);
     void copyTo32(uint32_t *dest);
+    void copyTo32(uint32_t *dest, int threads);
+    //! Write the detector image in one pass, width x height of the layout.
+    //! The 16-bit image saturates 24-bit counters at 0xffff.
+    void assemble(const DetectorLayout &layout, uint32_t *image);
+    void assemble(const DetectorLayout &layout, uint16_t *image);
     int pixelsLost();
+    int counterCount() { return counters; }
+    //! 1, 6, 12 or 24 bits, from the OMR of the first chip frame present
+    int counterDepth();
+    //! The chips are laid out as in copyTo32(uint32_t*): stacked, chip i
+    //! starting at row i * MPX_PIXEL_ROWS
+    ChipView view(int chipIndex);
+
+    //! Completion bit of a chip frame: low counters in the low nibble,
+    //! high (24-bit) counters in the next
+    static unsigned chipBit(int chipIndex, bool counterH) {
+        return 1u << ((counterH ? number_of_chips : 0) + chipIndex);
+    }
+    static unsigned completeMask(bool twoCounters) {
+        unsigned low = (1u << number_of_chips) - 1;
+        return twoCounters ? low | (low << number_of_chips) : low;
+    }
+
+    //! Lock-free slot bookkeeping, owned by the FrameSetManager
+    enum SlotState { FREE = 0, DRAFT = 1, PUBLISHED = 2, READING = 3, EVICTING = 4 };
+    std::atomic_uint state{FREE};
+    std::atomic_uint seq{0};        //! Frame sequence number this slot is for
+    std::atomic_int  frameId{-1};   //! Claimed by the first chip frame
+    std::atomic_uint expected{0};   //! completeMask() of the frame mode
+    std::atomic_uint claimed{0};    //! Chips that have (or gave up) a spot
+    std::atomic_uint done{0};       //! Chips that are finished with the slot
+    std::atomic_uint pins{0};       //! Threads working on it, see FrameSetManager::retire()
+
+    //! Latency timestamps, CLOCK_MONOTONIC [ns], 0 if not known
+    uint64_t firstPacket_ns = 0;    //! Earliest first packet of its chip frames
+    uint64_t lastPacket_ns = 0;     //! Latest packet that finished one
+    uint64_t published_ns = 0;
+    //! Take the packet times over from the chip frames present
+    void stampPacketTimes();
 
 private:
-    int counters = 1;
+    std::atomic_int counters{1};
     ChipFrame* frame[2][number_of_chips];
 
 };
@@ -3,99 +3,392 @@
 #include <assert.h>
 #include <iostream>
 #include <chrono>
+#include <thread>
 
-FrameSetManager::FrameSetManager()
+//! Keeps a slot from being retired while a chip works on it. Whoever holds
+//! a pin must check the slot's seq after taking it, see retire().
+class SlotPin {
+public:
+    explicit SlotPin(FrameSet *slot) : slot(slot) { slot->pins.fetch_add(1); }
+    ~SlotPin() { slot->pins.fetch_sub(1, std::memory_order_release); }
+private:
+    FrameSet *slot;
+};
+
+static unsigned roundUpPow2(unsigned n) {
+    unsigned size = 2;
+    while (size < n) size <<= 1;
+    return size;
+}
+
+FrameSetManager::FrameSetManager(unsigned depth, bool hugePages, int numaNode, bool prefault)
+    : size(roundUpPow2(depth)),
+      mask(size - 1),
+      fs(new FrameSet[size]),
+      pool(poolFrames(size), hugePages, numaNode, prefault)
 {
+    for (unsigned i = 0; i < size; i++) {
+        fs[i].seq.store(i, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < number_of_chips; i++) {
+        scratch[i] = new ChipFrame();
+    }
+}
 
+FrameSetManager::~FrameSetManager()
+{
+    for (int i = 0; i < number_of_chips; i++) {
+        delete scratch[i];
+    }
+    delete[] fs;
 }
 
 bool FrameSetManager::isFull() {
-    return head_ - tail_ == FSM_SIZE-1;
+    return head_ - tail_ >= size-1;
 }
 
 bool FrameSetManager::isEmpty() {
-    return head_ == tail_;
+    return fs[tail_ & mask].state.load(std::memory_order_acquire) < FrameSet::PUBLISHED;
 }
 
 bool FrameSetManager::wait(unsigned long timeout_ms) {
-    std::unique_lock<std::mutex> lock(tailMut);
-    auto duration = std::chrono::milliseconds(timeout_ms);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
 
-    if (isEmpty())
-        return _frameAvailableCondition.wait_for( lock, duration ) == std::cv_status::no_timeout;
-    else
-        return true;
+    for (;;) {
+        unsigned epoch = published.epoch();
+        if (!isEmpty())
+            return true;
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            return false;
+        published.wait(epoch, std::chrono::duration_cast<std::chrono::microseconds>(deadline - now));
+    }
 }
 
 FrameSet * FrameSetManager::getFrameSet() {
-    if (head_ == tail_) return nullptr;
-    std::lock_guard<std::mutex> lock(tailMut);
-    tailState = 3;
-    return &fs[tail_ & FSM_MASK];
+    return take(true);
+}
+
+FrameSet * FrameSetManager::takeFrameSet() {
+    return take(false);
+}
+
+//! @param again also return the tail set when it is being read already
+FrameSet * FrameSetManager::take(bool again) {
+    for (;;) {
+        unsigned t = tail_.load(std::memory_order_acquire);
+        FrameSet *slot = &fs[t & mask];
+        unsigned st = FrameSet::PUBLISHED;
+        if (slot->state.compare_exchange_strong(st, FrameSet::READING, std::memory_order_acq_rel)) {
+            if (slot->seq.load(std::memory_order_acquire) != t) {
+                // Evicted since we read the tail, and this is its next lap
+                slot->state.store(FrameSet::PUBLISHED, std::memory_order_release);
+                continue;
+            }
+            uint64_t now = monotonic_ns();
+            latency[DELIVERY].record(now - slot->published_ns);
+            if (slot->firstPacket_ns != 0)
+                latency[END_TO_END].record(now - slot->firstPacket_ns);
+            return slot;
+        }
+        if (again && st == FrameSet::READING && slot->seq.load(std::memory_order_acquire) == t)
+            return slot;
+        if (tail_.load(std::memory_order_acquire) == t)
+            return nullptr;
+    }
+}
+
+void FrameSetManager::resetLatency() {
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        latency[i].reset();
+    }
 }
 
 void FrameSetManager::releaseFrameSet(FrameSet *fsUsed) {
-    std::lock_guard<std::mutex> lock(tailMut);
-    if (fsUsed == &fs[tail_ & FSM_MASK]) {
-        assert (tailState == 3);
+    if (fsUsed == nullptr) {
+        fsUsed = getFrameSet();
+        if (fsUsed == nullptr)
+            return;
+    }
+    if (!inRing(fsUsed)) {
+        // Passed on by detachFrameSet()
+        recycle(fsUsed);
         fsUsed->clear();
-        tail_++;
-        tailState = 0;
-    } else if (fsUsed == nullptr) {
-        if (tail_ != head_) {
-            fs[tail_ & FSM_MASK].clear();
-            tail_++;
-        }
-        tailState = 0;
-    } else {
+        fsUsed->state.store(FrameSet::FREE, std::memory_order_release);
+        return;
+    }
+    unsigned t = tail_.load(std::memory_order_acquire);
+    FrameSet *slot = &fs[t & mask];
+    if (fsUsed != slot || slot->state.load(std::memory_order_acquire) != FrameSet::READING
+            || slot->seq.load(std::memory_order_acquire) != t) {
         std::cerr << " spurious release of FrameSet" << std::endl;
-        tailState = 0;
+        return;
+    }
+    retire(slot, t);
+}
+
+void FrameSetManager::detachFrameSet(FrameSet *fsUsed, FrameSet *to) {
+    unsigned t = tail_.load(std::memory_order_acquire);
+    FrameSet *slot = &fs[t & mask];
+    if (fsUsed != slot || slot->state.load(std::memory_order_acquire) != FrameSet::READING
+            || slot->seq.load(std::memory_order_acquire) != t) {
+        std::cerr << " spurious detach of FrameSet" << std::endl;
+        return;
+    }
+    for (int hi = 0; hi < 2; hi++) {
+        for (int i = 0; i < number_of_chips; i++) {
+            ChipFrame *cf = slot->takeChipFrame(i, hi);
+            if (cf != nullptr)
+                to->putChipFrame(i, cf);
+        }
+    }
+    to->frameId.store(slot->frameId.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    to->firstPacket_ns = slot->firstPacket_ns;
+    to->lastPacket_ns = slot->lastPacket_ns;
+    to->published_ns = slot->published_ns;
+    retire(slot, t);
+    to->state.store(FrameSet::PUBLISHED, std::memory_order_release);
+}
+
+/**
+ * @brief Recycle the tail slot and hand it to the chips for its next lap.
+ * A chip that found the slot at sequence t may still be working on it: the
+ * slot first gets a seq no chip asks for, then waits for the pins to go.
+ */
+void FrameSetManager::retire(FrameSet *slot, unsigned t) {
+    slot->seq.store(t + size - 1);
+    while (slot->pins.load() != 0)
+        std::this_thread::yield();
+    recycle(slot);
+    slot->clear();
+    slot->state.store(FrameSet::FREE, std::memory_order_relaxed);
+    slot->seq.store(t + size, std::memory_order_release);
+    tail_.store(t + 1, std::memory_order_release);
+    released.notifyAll();
+}
+
+void FrameSetManager::setBackpressure(Backpressure policy, unsigned timeout_us) {
+    block_timeout_us = timeout_us;
+    backpressure = policy;
+}
+
+/**
+ * @brief The ring is full: slot s has not been released since the last lap.
+ * Apply the backpressure policy.
+ * @return true when the slot is free now, false to drop the chip frame
+ */
+bool FrameSetManager::makeRoom(FrameSet *slot, unsigned s) {
+    Backpressure policy = backpressure.load(std::memory_order_relaxed);
+    if (policy == DROP_OLDEST) {
+        while (slot->seq.load(std::memory_order_acquire) != s) {
+            if (!evictTail()) {
+                // The consumer is reading the oldest set or it is unfinished
+                droppedNewest.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        return true;
     }
+    if (policy == BLOCK) {
+        blocked.fetch_add(1, std::memory_order_relaxed);
+        auto deadline = std::chrono::steady_clock::now()
+                + std::chrono::microseconds(block_timeout_us.load(std::memory_order_relaxed));
+        for (;;) {
+            unsigned epoch = released.epoch();
+            if (slot->seq.load(std::memory_order_acquire) == s)
+                return true;
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+                break;
+            released.wait(epoch, std::chrono::duration_cast<std::chrono::microseconds>(deadline - now));
+        }
+        blockTimeouts.fetch_add(1, std::memory_order_relaxed);
+    }
+    droppedNewest.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+/**
+ * @brief Throw away the oldest published set the consumer has not picked up.
+ * @return false if there is none to take (the consumer is reading it, or it
+ * is still being filled)
+ */
+bool FrameSetManager::evictTail() {
+    unsigned t = tail_.load(std::memory_order_acquire);
+    FrameSet *slot = &fs[t & mask];
+    unsigned st = FrameSet::PUBLISHED;
+    if (!slot->state.compare_exchange_strong(st, FrameSet::EVICTING, std::memory_order_acq_rel))
+        return tail_.load(std::memory_order_acquire) != t;
+    if (slot->seq.load(std::memory_order_acquire) != t) {
+        // Already released and published again for the next lap
+        slot->state.store(FrameSet::PUBLISHED, std::memory_order_release);
+        return true;
+    }
+    retire(slot, t);
+    droppedOldest.fetch_add(1, std::memory_order_relaxed);
+    _framesLost++;
+    return true;
 }
 
 void FrameSetManager::putChipFrame(int chipIndex, ChipFrame* cf) {
-    std::lock_guard<std::mutex> lock(headMut);
-    if (headState == 0) {
-        frameId = cf->frameId;
-        headState = 1;
-    }
-    assert (headState == 1);
-    FrameSet *dest = &fs[head_ & FSM_MASK];
-    if (frameId != cf->frameId) {
-        // starting a new frame, after publishing this
-        if (isFull()) {
-            _framesLost++;
-            dest->clear();
+    bool twoCounters = cf->omr.getCountL() == 3;
+    bool counterH = twoCounters && cf->omr.getMode() == 4;
+    unsigned complete = FrameSet::completeMask(twoCounters);
+    int id = cf->frameId;
+    // Decoded into the scratch frame because the pool ran dry: we lose this one
+    bool lost = cf == scratch[chipIndex];
+
+    for (unsigned skipped = 0; skipped < size; skipped++) {
+        unsigned s = chipSeq[chipIndex];
+        FrameSet *slot = &fs[s & mask];
+        unsigned slotSeq = slot->seq.load(std::memory_order_acquire);
+        if (int(slotSeq - s) > 0) {
+            // Published without us and already released: catch up
+            chipSeq[chipIndex] = s + 1;
+            continue;
+        } else if (slotSeq != s && !makeRoom(slot, s)) {
+            // The consumer has not released this slot since the last lap
+            expectCounterH[chipIndex] = false;
+            drop(chipIndex, cf);
+            return;
+        }
+        SlotPin pin(slot);
+        if (slot->seq.load() != s) {
+            // Published without us and retired since we looked
+            continue;
+        }
+
+        int slotId = -1;
+        if (slot->frameId.compare_exchange_strong(slotId, id, std::memory_order_acq_rel)) {
+            // First chip frame of this sequence
+            countSkipped(id);
+            unsigned h = head_.load();
+            while (h < s + 1 && !head_.compare_exchange_weak(h, s + 1)) {}
+            // Another chip may have published the slot already
+            unsigned st = FrameSet::FREE;
+            slot->state.compare_exchange_strong(st, FrameSet::DRAFT, std::memory_order_relaxed);
+            if (s >= publish_lag)
+                forcePublish(s - publish_lag, complete);
+        } else if (slotId != id) {
+            if (int8_t(uint8_t(id) - uint8_t(slotId)) < 0) {
+                // A late frame of a set the others have moved past
+                drop(chipIndex, cf);
+                return;
+            }
+            // We lost the frame of this slot, give up our spot and retry on the next
+            leaveSlot(slot, FrameSet::chipBit(chipIndex, false) | FrameSet::chipBit(chipIndex, true));
+            chipSeq[chipIndex] = s + 1;
+            continue;
+        }
+
+        unsigned bit = FrameSet::chipBit(chipIndex, counterH);
+        unsigned expected = 0;
+        slot->expected.compare_exchange_strong(expected, complete);
+        expected = slot->expected.load();
+        if (lost) {
+            leaveSlot(slot, bit);
+            drop(chipIndex, cf);
+        } else if (slot->claimed.fetch_or(bit, std::memory_order_acq_rel) & bit) {
+            // Published without us already
+            drop(chipIndex, cf);
         } else {
-            head_++;
-            _framesReceived++;
-            dest = &fs[head_ & FSM_MASK];
-            _frameAvailableCondition.notify_one();
+            slot->putChipFrame(chipIndex, cf);
+            unsigned prev = slot->done.fetch_or(bit, std::memory_order_acq_rel);
+            if ((prev & expected) != expected && ((prev | bit) & expected) == expected)
+                publish(slot);
         }
+
+        // In 24 bit mode the high counters follow into the same slot
+        expectCounterH[chipIndex] = twoCounters && !counterH;
+        if (!expectCounterH[chipIndex])
+            chipSeq[chipIndex] = s + 1;
+        return;
     }
-    dest->putChipFrame(chipIndex, cf);
-    OMR omr = cf->omr;
-    if (omr.getCountL() == 3 && omr.getMode() == 0)
-        expectCounterH = true;
-    else if (dest->isComplete()) {
-        if (isFull()) {
-            _framesLost++;
-            dest->clear();
-        } else {
-            head_++;
-            _framesReceived++;
-            _frameAvailableCondition.notify_one();
+}
+
+//! Mark chips as finished with a slot without them contributing to it
+void FrameSetManager::leaveSlot(FrameSet *slot, unsigned bits) {
+    unsigned expected = slot->expected.load(std::memory_order_acquire);
+    bits &= expected;
+    unsigned prev = slot->claimed.fetch_or(bits, std::memory_order_acq_rel);
+    bits &= ~prev;
+    if (bits == 0)
+        return;
+    prev = slot->done.fetch_or(bits, std::memory_order_acq_rel);
+    if ((prev & expected) != expected && ((prev | bits) & expected) == expected)
+        publish(slot);
+}
+
+//! Publish every slot up to and including seq that some chip still owes a frame
+void FrameSetManager::forcePublish(unsigned seq, unsigned complete) {
+    unsigned f = forced_.load();
+    while (f <= seq) {
+        if (!forced_.compare_exchange_weak(f, f + 1))
+            continue;
+        FrameSet *slot = &fs[f & mask];
+        SlotPin pin(slot);
+        if (slot->seq.load() == f) {
+            unsigned expected = 0;
+            slot->expected.compare_exchange_strong(expected, complete);
+            leaveSlot(slot, FrameSet::completeMask(true));
+        }
+        f++;
+    }
+}
+
+void FrameSetManager::publish(FrameSet *slot) {
+    slot->stampPacketTimes();
+    slot->published_ns = monotonic_ns();
+    if (slot->firstPacket_ns != 0) {
+        latency[ASSEMBLY].record(slot->lastPacket_ns - slot->firstPacket_ns);
+        latency[PUBLISH].record(slot->published_ns - slot->lastPacket_ns);
+    }
+    slot->state.store(FrameSet::PUBLISHED, std::memory_order_release);
+    _framesReceived++;
+    published.notifyAll();
+}
+
+/**
+ * @brief Count the frame ids between the last claimed set and this one as
+ * lost, whatever made every chip miss them: a full ring, an exhausted pool
+ * or the network. Sets are claimed in sequence order.
+ */
+void FrameSetManager::countSkipped(int id) {
+    int last = lastClaimedId.exchange(id, std::memory_order_relaxed);
+    if (last < 0)
+        return;
+    int skipped = int8_t(uint8_t(id) - uint8_t(last)) - 1;
+    if (skipped > 0)
+        _framesLost += skipped;
+}
+
+//! Hand the chip frames of a released set back to the pool
+void FrameSetManager::recycle(FrameSet *slot) {
+    for (int i = 0; i < number_of_chips; i++) {
+        for (int hi = 0; hi < 2; hi++) {
+            ChipFrame *cf = slot->takeChipFrame(i, hi);
+            if (cf != nullptr)
+                pool.release(cf);
         }
-        expectCounterH = false;
-        headState = 0;
     }
 }
 
+//! Return a frame we could not place
+void FrameSetManager::drop(int chipIndex, ChipFrame *cf) {
+    if (cf == scratch[chipIndex])
+        cf->clear();
+    else
+        pool.release(cf);
+}
 
+/**
+ * @brief A frame from the pool, holding the pixels of its last use. When the
+ * pool is exhausted (the consumer holds on to too many sets) the chip decodes
+ * into its scratch frame instead, which putChipFrame() then drops.
+ */
 ChipFrame *FrameSetManager::newChipFrame(int chipIndex) {
-    std::lock_guard<std::mutex> lock(headMut);
-    FrameSet *dest = &fs[head_ & FSM_MASK];
-    ChipFrame *frame = dest->takeChipFrame(chipIndex, expectCounterH);
-    return frame == nullptr ? new ChipFrame() : frame;
-    //return  new ChipFrame();
+    ChipFrame *frame = pool.acquire();
+    if (frame != nullptr)
+        return frame;
+    return scratch[chipIndex];
 }
@@ -3,40 +3,131 @@
 
 #include <stdint.h>
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
 #include "FrameSet.h"
+#include "Notifier.h"
+#include "ChipFramePool.h"
+#include "LatencyHistogram.h"
 
-#define FSM_SIZE 1024
-#define FSM_MASK (FSM_SIZE-1)
+
+/**
+ * @brief Lock-free ring of FrameSets between the chip assemblers and the consumer.
+ *
+ * Every chip walks the ring on its own: its n-th frame goes to slot n. The
+ * first chip frame claims the slot's frame id, each chip then sets its bit in
+ * the slot's claimed/done masks, and whoever completes the mask publishes
+ * the slot. A chip that finds a newer frame id than its own drops its frame
+ * (it is late); one that finds an older id marks itself done there and moves
+ * on (it lost that frame). Slots left incomplete because a chip lost frames
+ * are published anyway once any chip is publish_lag frames further on.
+ *
+ * putChipFrame() and newChipFrame() of one chip must be called from a single
+ * thread; different chips may use different threads.
+ */
 class FrameSetManager
 {
 public:
-    FrameSetManager();
+    //! @param depth number of FrameSets in the ring, rounded up to a power of two
+    //! @param hugePages, @param numaNode and @param prefault place the
+    //! ChipFrame storage, see ChipFramePool
+    explicit FrameSetManager(unsigned depth = 1024, bool hugePages = false, int numaNode = -1,
+                             bool prefault = false);
+    ~FrameSetManager();
 
     void putChipFrame(int chipIndex, ChipFrame* cf);
     ChipFrame *newChipFrame(int chipIndex);
+    //! What a chip does with a frame when the consumer has not released
+    //! the slot it needs, a full ring length ago
+    enum Backpressure {
+        DROP_NEWEST,  //! Drop the new frame
+        DROP_OLDEST,  //! Discard the oldest unread set, for live viewing
+        BLOCK         //! Wait for the consumer, up to a time-out, then drop
+    };
+    void setBackpressure(Backpressure policy, unsigned timeout_us = 0);
+    Backpressure getBackpressure() { return backpressure; }
+
+    unsigned depth() { return size; }
+    //! Sets between the oldest unreleased and the newest claimed, a lock-free
+    //! estimate of the ring fill
+    unsigned occupancy() { return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed); }
     bool isFull();
     bool isEmpty();
     bool wait(unsigned long timeout_ms);
+    //! The oldest published set, or the one already being read
     FrameSet *getFrameSet();
+    //! The oldest published set, never one somebody else is reading
+    FrameSet *takeFrameSet();
+    //! Also takes sets passed on by detachFrameSet()
     void releaseFrameSet(FrameSet *);
+    //! Pass the set being read on to a second consumer: its chip frames move
+    //! to `to`, a FrameSet outside the ring, and the slot is released. `to`
+    //! comes out PUBLISHED; releaseFrameSet(to) returns the frames.
+    void detachFrameSet(FrameSet *fsUsed, FrameSet *to);
 
     // Statistics
-    int     _framesReceived = 0;
-    int     _framesLost = 0;
+    std::atomic_int _framesReceived{0};
+    std::atomic_int _framesLost{0};
+    std::atomic<uint64_t> droppedNewest{0};  //! Chip frames dropped on a full ring
+    std::atomic<uint64_t> droppedOldest{0};  //! Unread sets discarded (DROP_OLDEST)
+    std::atomic<uint64_t> blocked{0};        //! Chip frames that waited (BLOCK)
+    std::atomic<uint64_t> blockTimeouts{0};  //! ... and then got dropped anyway
+    //! Times a chip found no free ChipFrame and had to drop its frame
+    uint64_t poolExhausted() { return pool.exhausted.load(std::memory_order_relaxed); }
+
+    //! Per-set latencies from the packet arrival times, see latency[]
+    enum LatencyStage {
+        ASSEMBLY,    //! First packet of any chip to the last packet of any chip
+        PUBLISH,     //! Last packet to the set being published
+        DELIVERY,    //! Published to the consumer's getFrameSet()
+        END_TO_END,  //! First packet to getFrameSet()
+        LATENCY_STAGES
+    };
+    LatencyHistogram latency[LATENCY_STAGES];
+    void resetLatency();
+    unsigned poolAvailable() { return pool.available(); }
+    //! ChipFrames in memory: the most that were ever in flight at once
+    unsigned poolTouched() { return pool.touched(); }
+
+    //! Enough ChipFrames for a full ring of 24-bit sets, two per chip, plus
+    //! the frame each chip is decoding, the one it is handing over and a
+    //! detached set. Only the frames in use get faulted in, so 12-bit sets
+    //! or a consumer that keeps up never touch most of them.
+    static unsigned poolFrames(unsigned depth) { return (2 * depth + 4) * number_of_chips; }
+
+    //! How many frames the leading chip may run ahead of a chip that owes a
+    //! frame before the set is published without it
+    constexpr static unsigned publish_lag = 8;
 
 private:
-    FrameSet fs[FSM_SIZE];
-    int dropped = 0;
-    uint8_t frameId;
-    bool expectCounterH = false;
-    // for diagnostics: 0=unused, 1=draft, 2=published, 3=reading
-    int headState = 0, tailState = 0;
-    std::atomic_uint head_{0};
-    std::atomic_uint tail_{0};
-    std::condition_variable _frameAvailableCondition;
-    std::mutex headMut, tailMut;
+    FrameSet *take(bool again);
+    bool inRing(FrameSet *set) { return set >= fs && set < fs + size; }
+    void leaveSlot(FrameSet *slot, unsigned bits);
+    void forcePublish(unsigned seq, unsigned complete);
+    void publish(FrameSet *slot);
+    void retire(FrameSet *slot, unsigned t);
+    bool makeRoom(FrameSet *slot, unsigned s);
+    bool evictTail();
+    void recycle(FrameSet *slot);
+    void drop(int chipIndex, ChipFrame *cf);
+    void countSkipped(int id);
+
+    unsigned size;
+    unsigned mask;
+    FrameSet *fs;
+    std::atomic_uint head_{0};      //! One past the newest claimed sequence
+    std::atomic_uint tail_{0};      //! Oldest sequence not yet released
+    std::atomic_uint forced_{0};    //! Sequences below this were force-published
+    std::atomic_int  lastClaimedId{-1};  //! Frame id of the newest claimed set
+    Notifier published;
+    Notifier released;
+    std::atomic<Backpressure> backpressure{DROP_NEWEST};
+    std::atomic_uint block_timeout_us{0};
+
+    //! Per chip, touched only by that chip's thread
+    unsigned chipSeq[number_of_chips] = {};
+    bool expectCounterH[number_of_chips] = {};
+    ChipFrame *scratch[number_of_chips];
+
+    ChipFramePool pool;
 };
 
 #endif // FRAMESETMANAGER_H
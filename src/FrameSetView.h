@@ -0,0 +1,60 @@
+#ifndef FRAMESETVIEW_H
+#define FRAMESETVIEW_H
+
+#include "FrameSet.h"
+#include "FrameSetManager.h"
+
+/**
+ * @brief Borrow token for a FrameSet handed out by the FrameSetManager.
+ *
+ * Gives read-only, zero-copy access to the chip frames through ChipViews.
+ * The set stays out of the ring until the token is released, explicitly or
+ * by destroying it, which is the same as releaseFrameSet(). Tokens can be
+ * moved but not copied, so a set is released exactly once.
+ */
+class FrameSetView
+{
+public:
+    FrameSetView() {}
+    FrameSetView(FrameSetManager *fsm, FrameSet *fs) : fsm(fsm), fs(fs) {}
+    FrameSetView(FrameSetView &&other) : fsm(other.fsm), fs(other.fs) { other.fs = nullptr; }
+    FrameSetView &operator=(FrameSetView &&other) {
+        if (this != &other) {
+            release();
+            fsm = other.fsm;
+            fs = other.fs;
+            other.fs = nullptr;
+        }
+        return *this;
+    }
+    FrameSetView(const FrameSetView &) = delete;
+    FrameSetView &operator=(const FrameSetView &) = delete;
+    ~FrameSetView() { release(); }
+
+    bool valid() const { return fs != nullptr; }
+    explicit operator bool() const { return valid(); }
+
+    int frameId() const { return fs->frameId; }
+    int chips() const { return number_of_chips; }
+    //! 2 in 24-bit mode, when every ChipView has a high half
+    int counters() const { return fs->counterCount(); }
+    bool isComplete() const { return fs->isComplete(); }
+    int pixelsLost() const { return fs->pixelsLost(); }
+    ChipView chip(int chipIndex) const { return fs->view(chipIndex); }
+    //! For copyTo32() when a 32-bit image is needed after all
+    FrameSet *frameSet() const { return fs; }
+
+    //! Hand the set back to the ring; the views are invalid afterwards
+    void release() {
+        if (fs != nullptr) {
+            fsm->releaseFrameSet(fs);
+            fs = nullptr;
+        }
+    }
+
+private:
+    FrameSetManager *fsm = nullptr;
+    FrameSet *fs = nullptr;
+};
+
+#endif // FRAMESETVIEW_H
@@ -0,0 +1,45 @@
+#include "LatencyHistogram.h"
+
+#include <cmath>
+
+uint64_t LatencyHistogram::highest(int index) {
+    if (index < 2 * sub_buckets)
+        return uint64_t(index);
+    int shift = index / sub_buckets - 1;
+    uint64_t sub = uint64_t(index % sub_buckets + sub_buckets);
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    uint64_t n = count();
+    if (n == 0)
+        return 0;
+    uint64_t target = uint64_t(std::ceil(p / 100. * double(n)));
+    if (target < 1) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < buckets; i++) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            //! The top bucket may reach past the largest value seen
+            uint64_t v = highest(i);
+            uint64_t m = max();
+            return v < m ? v : m;
+        }
+    }
+    return max();
+}
+
+double LatencyHistogram::mean() const {
+    uint64_t n = count();
+    return n == 0 ? 0. : double(sum.load(std::memory_order_relaxed)) / double(n);
+}
+
+//! Not atomic as a whole, samples recorded meanwhile may be half cleared
+void LatencyHistogram::reset() {
+    for (int i = 0; i < buckets; i++) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+}
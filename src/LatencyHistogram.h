@@ -0,0 +1,63 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <time.h>
+
+//! CLOCK_MONOTONIC [ns], the time base of all latency timestamps
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+}
+
+/**
+ * @brief Lock-free log-linear (HDR style) histogram of latencies in ns.
+ *
+ * Values below 64 ns get a bucket each; above that every power of two is
+ * split into 32 buckets, so a reported percentile is within about 3% of the
+ * recorded value over the full 64-bit range. record() is a relaxed atomic
+ * increment and may be called from any thread; readers see a snapshot that
+ * is at most a few samples behind.
+ */
+class LatencyHistogram
+{
+public:
+    void record(uint64_t ns) {
+        counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t m = maximum.load(std::memory_order_relaxed);
+        while (ns > m && !maximum.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+    }
+
+    //! @param p percentile, 0 to 100
+    //! @return the highest value in the bucket holding it [ns], 0 if empty
+    uint64_t percentile(double p) const;
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maximum.load(std::memory_order_relaxed); }
+    uint64_t sumNs() const { return sum.load(std::memory_order_relaxed); }
+    double mean() const;
+    void reset();
+
+private:
+    constexpr static int sub_bits = 5;
+    constexpr static int sub_buckets = 1 << sub_bits;
+    constexpr static int buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    static int bucket(uint64_t ns) {
+        if (ns < 2 * sub_buckets)
+            return int(ns);
+        int shift = 63 - __builtin_clzll(ns) - sub_bits;
+        return (shift + 1) * sub_buckets + int(ns >> shift) - sub_buckets;
+    }
+    static uint64_t highest(int index);
+
+    std::atomic<uint64_t> counts[buckets] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> maximum{0};
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,50 @@
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Futex based wake-up for threads waiting on lock-free state.
+ *
+ * A waiter reads epoch(), re-checks its condition and then calls wait() with
+ * that epoch. notifyAll() bumps the epoch before waking, so a notification
+ * that slips in between the check and the wait makes the wait return at once.
+ * The futex syscall is skipped entirely when nobody is waiting.
+ */
+class Notifier
+{
+public:
+    unsigned epoch() { return seq.load(std::memory_order_acquire); }
+
+    //! @return false on time-out
+    bool wait(unsigned epoch, std::chrono::microseconds timeout) {
+        struct timespec ts;
+        ts.tv_sec = time_t(timeout.count() / 1000000);
+        ts.tv_nsec = long(timeout.count() % 1000000) * 1000;
+        waiters.fetch_add(1);
+        long ret = syscall(SYS_futex, reinterpret_cast<unsigned *>(&seq), FUTEX_WAIT_PRIVATE,
+                           epoch, &ts, nullptr, 0);
+        waiters.fetch_sub(1);
+        return ret == 0 || seq.load(std::memory_order_acquire) != epoch;
+    }
+
+    void notifyAll() {
+        seq.fetch_add(1);
+        if (waiters.load() > 0) {
+            syscall(SYS_futex, reinterpret_cast<unsigned *>(&seq), FUTEX_WAKE_PRIVATE,
+                    INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+private:
+    std::atomic_uint seq{0};
+    std::atomic_int waiters{0};
+};
+
+#endif // NOTIFIER_H
@@ -0,0 +1,306 @@
+#include "PacketCapture.h"
+
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "FrameAssembler.h"
+#include "LatencyHistogram.h"
+#include "spdlog/spdlog.h"
+
+constexpr static char capture_magic[8] = "MPX3CAP";
+constexpr static uint32_t capture_version = 2; //! 1 had all records in arrival order
+constexpr static size_t max_record_size = sizeof(CaptureRecord) + sizeof(PacketContainer::data);
+
+PacketCapture::PacketCapture(size_t bufferBytes, int buffers)
+    : bufferBytes(bufferBytes < max_record_size ? max_record_size : bufferBytes),
+      nBuffers(buffers < 2 ? 2 : buffers)
+{
+    for (Chip &c : chips) {
+        c.buffers = new Buffer[nBuffers];
+        for (int i = 0; i < nBuffers; i++) {
+            c.buffers[i].data = new uint8_t[this->bufferBytes];
+            memset(c.buffers[i].data, 0, this->bufferBytes); //! Fault the pages in now
+        }
+    }
+}
+
+PacketCapture::~PacketCapture() {
+    close();
+    for (Chip &c : chips) {
+        for (int i = 0; i < nBuffers; i++) {
+            delete[] c.buffers[i].data;
+        }
+        delete[] c.buffers;
+    }
+}
+
+bool PacketCapture::open(const std::string &filename) {
+    close();
+    fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        spdlog::get("console")->error("Capture file \"{}\": {}", filename, strerror(errno));
+        return false;
+    }
+    packets = 0;
+    bytes = 0;
+    packetsDropped = 0;
+    writeErrors = 0;
+    for (Chip &c : chips) {
+        for (int i = 0; i < nBuffers; i++) {
+            c.buffers[i].fill = 0;
+            c.buffers[i].state = FREE;
+        }
+        c.current = c.next = 0;
+        c.buffers[0].state = FILLING;
+    }
+
+    CaptureFileHeader hdr;
+    memcpy(hdr.magic, capture_magic, sizeof(hdr.magic));
+    hdr.version = capture_version;
+    hdr.chips = number_of_chips;
+    if (::write(fd, &hdr, sizeof(hdr)) != ssize_t(sizeof(hdr))) {
+        spdlog::get("console")->error("Capture file \"{}\": {}", filename, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    capturing = true;
+    writer = std::thread(&PacketCapture::writeFiles, this);
+    spdlog::get("console")->info("Capturing packets to \"{}\", {} x {} MiB buffers per chip", filename,
+                                 nBuffers, bufferBytes >> 20);
+    return true;
+}
+
+void PacketCapture::close() {
+    if (fd < 0) {
+        return;
+    }
+    //! Pairs with busy/capturing in write(): once a chip is not busy after
+    //! capturing dropped, its receive thread stays out of the buffers
+    capturing = false;
+    for (Chip &c : chips) {
+        while (c.busy) {
+            std::this_thread::yield();
+        }
+        if (c.buffers[c.current].fill > 0) {
+            c.buffers[c.current].state.store(FULL, std::memory_order_release);
+        }
+    }
+    filled.notifyAll();
+    if (writer.joinable()) writer.join();
+    ::close(fd);
+    fd = -1;
+    spdlog::get("console")->info("Captured {} packets, {} bytes, {} dropped", packets, bytes, packetsDropped);
+    if (writeErrors > 0) {
+        spdlog::get("console")->error("Capture incomplete: {} failed writes", writeErrors);
+    }
+}
+
+void PacketCapture::write(const PacketContainer &pc) {
+    write(pc.chipIndex, pc.data, pc.size, pc.timestamp_ns);
+}
+
+void PacketCapture::write(int chipIndex, const char *data, long size, uint64_t timestamp_ns) {
+    if (size <= 0 || size_t(size) > sizeof(PacketContainer::data)) {
+        return;
+    }
+    Chip &c = chips[chipIndex];
+    c.busy = true;
+    if (!capturing) {
+        c.busy.store(false, std::memory_order_release);
+        return;
+    }
+    CaptureRecord rec;
+    rec.timestamp_ns = timestamp_ns != 0 ? timestamp_ns : monotonic_ns();
+    rec.size = uint32_t(size);
+    rec.chipIndex = uint16_t(chipIndex);
+    rec.reserved = 0;
+
+    Buffer *b = &c.buffers[c.current];
+    if (bufferBytes - b->fill < sizeof(rec) + size_t(size)) {
+        int n = (c.current + 1) % nBuffers;
+        if (c.buffers[n].state.load(std::memory_order_acquire) != FREE) {
+            packetsDropped++;
+            c.busy.store(false, std::memory_order_release);
+            return;
+        }
+        b->state.store(FULL, std::memory_order_release);
+        filled.notifyAll();
+        c.current = n;
+        b = &c.buffers[n];
+        b->fill = 0;
+        b->state.store(FILLING, std::memory_order_relaxed);
+    }
+    memcpy(b->data + b->fill, &rec, sizeof(rec));
+    memcpy(b->data + b->fill + sizeof(rec), data, size_t(size));
+    b->fill += sizeof(rec) + size_t(size);
+    packets.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(uint64_t(size), std::memory_order_relaxed);
+    c.busy.store(false, std::memory_order_release);
+}
+
+void PacketCapture::writeFiles() {
+    for (;;) {
+        unsigned epoch = filled.epoch();
+        bool wrote = false;
+        for (Chip &c : chips) {
+            Buffer &b = c.buffers[c.next];
+            if (b.state.load(std::memory_order_acquire) == FULL) {
+                writeBuffer(b);
+                b.fill = 0;
+                b.state.store(FREE, std::memory_order_release);
+                c.next = (c.next + 1) % nBuffers;
+                wrote = true;
+            }
+        }
+        if (wrote) {
+            continue;
+        }
+        if (!capturing) {
+            //! close() marks the last buffers full before it wakes us
+            bool left = false;
+            for (Chip &c : chips) {
+                left |= c.buffers[c.next].state.load(std::memory_order_acquire) == FULL;
+            }
+            if (left) continue;
+            break;
+        }
+        filled.wait(epoch, std::chrono::milliseconds(100));
+    }
+}
+
+bool PacketCapture::writeBuffer(Buffer &b) {
+    size_t done = 0;
+    while (done < b.fill) {
+        ssize_t n = ::write(fd, b.data + done, b.fill - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (writeErrors++ == 0) {
+                spdlog::get("console")->error("Capture write: {}", strerror(errno));
+            }
+            return false;
+        }
+        done += size_t(n);
+    }
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool PacketReplay::open(const std::string &filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        spdlog::get("console")->error("Replay file \"{}\": {}", filename, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CaptureFileHeader)) {
+        spdlog::get("console")->error("Replay file \"{}\" is empty", filename);
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        spdlog::get("console")->error("mmap \"{}\": {}", filename, strerror(errno));
+        return false;
+    }
+    map = static_cast<const uint8_t *>(p);
+    mapSize = size_t(st.st_size);
+    madvise(p, mapSize, MADV_SEQUENTIAL);
+
+    const CaptureFileHeader *hdr = reinterpret_cast<const CaptureFileHeader *>(map);
+    if (memcmp(hdr->magic, capture_magic, sizeof(hdr->magic)) != 0 || hdr->version < 1
+            || hdr->version > capture_version) {
+        spdlog::get("console")->error("\"{}\" is not a packet capture", filename);
+        close();
+        return false;
+    }
+
+    size_t pos = sizeof(CaptureFileHeader), n = 0;
+    while (pos + sizeof(CaptureRecord) <= mapSize) {
+        CaptureRecord rec;
+        memcpy(&rec, map + pos, sizeof(rec));
+        if (pos + sizeof(rec) + rec.size > mapSize || rec.size > sizeof(pc.data)
+                || rec.chipIndex >= number_of_chips) {
+            spdlog::get("console")->error("Capture truncated or corrupt after {} packets", n);
+            break;
+        }
+        records[rec.chipIndex].push_back(pos);
+        pos += sizeof(rec) + rec.size;
+        n++;
+    }
+    return true;
+}
+
+void PacketReplay::close() {
+    if (map != nullptr) {
+        munmap(const_cast<uint8_t *>(map), mapSize);
+        map = nullptr;
+        mapSize = 0;
+    }
+    for (std::vector<size_t> &r : records) {
+        r.clear();
+    }
+}
+
+uint64_t PacketReplay::run(FrameAssembler **assemblers, bool paced, const std::atomic_bool *stop) {
+    if (map == nullptr) {
+        return 0;
+    }
+    uint64_t fed = 0;
+    uint64_t start = monotonic_ns(), first = 0;
+    size_t next[number_of_chips] = {};
+
+    for (;;) {
+        if (stop != nullptr && *stop) {
+            break;
+        }
+        //! Earliest next record over the chips, each chip is in order already
+        int chip = -1;
+        CaptureRecord rec;
+        for (int c = 0; c < number_of_chips; c++) {
+            if (next[c] == records[c].size()) {
+                continue;
+            }
+            CaptureRecord r;
+            memcpy(&r, map + records[c][next[c]], sizeof(r));
+            if (chip < 0 || r.timestamp_ns < rec.timestamp_ns) {
+                chip = c;
+                rec = r;
+            }
+        }
+        if (chip < 0) {
+            break;
+        }
+        size_t pos = records[chip][next[chip]++] + sizeof(rec);
+        if (paced) {
+            if (fed == 0) first = rec.timestamp_ns;
+            uint64_t due = start + (rec.timestamp_ns - first);
+            uint64_t now = monotonic_ns();
+            //! Sleep most of the way, spin the last stretch
+            if (due > now + 200000) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - 100000));
+            }
+            while (monotonic_ns() < due) {}
+        }
+        pc.chipIndex = rec.chipIndex;
+        pc.size = rec.size;
+        pc.timestamp_ns = monotonic_ns(); //! Arrives now, as far as the latencies go
+        memcpy(pc.data, map + pos, rec.size);
+        ChipStatistics &s = assemblers[rec.chipIndex]->stats;
+        s.packets.add();
+        s.bytes.add(rec.size);
+        assemblers[rec.chipIndex]->onEvent(pc);
+        fed++;
+    }
+    return fed;
+}
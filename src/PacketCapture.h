@@ -0,0 +1,108 @@
+#ifndef PACKETCAPTURE_H
+#define PACKETCAPTURE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FrameSet.h"
+#include "Notifier.h"
+#include "PacketContainer.h"
+
+class FrameAssembler;
+
+//! Capture file layout: one CaptureFileHeader, then per datagram a
+//! CaptureRecord followed by size bytes of payload. The records of a chip are
+//! in arrival order, the chips are interleaved in blocks of a staging buffer;
+//! replay merges them again by timestamp.
+struct CaptureFileHeader {
+    char magic[8];          //! "MPX3CAP"
+    uint32_t version;
+    uint32_t chips;
+};
+
+struct CaptureRecord {
+    uint64_t timestamp_ns;  //! CLOCK_MONOTONIC when the datagram was read
+    uint32_t size;          //! [bytes]
+    uint16_t chipIndex;
+    uint16_t reserved;
+};
+
+/**
+ * @brief Appends received datagrams to a capture file.
+ *
+ * write() runs on the receive threads, at most one per chip at a time. It
+ * copies the datagram into one of a few staging buffers of that chip; a writer
+ * thread writes full buffers to the file. When a chip has no free buffer the
+ * datagram is dropped from the capture and counted, the sockets never wait
+ * for the disk. Failed writes are counted and logged, a capture with write
+ * errors is incomplete.
+ */
+class PacketCapture
+{
+public:
+    //! @param bufferBytes size of each staging buffer
+    explicit PacketCapture(size_t bufferBytes = 4 << 20, int buffers = 4);
+    ~PacketCapture();
+    bool open(const std::string &filename);
+    void close();
+    bool isOpen() { return fd >= 0; }
+    void write(const PacketContainer &pc);
+    //! For datagrams decoded in place, outside a PacketContainer
+    void write(int chipIndex, const char *data, long size, uint64_t timestamp_ns);
+
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> packetsDropped{0};  //! No free buffer
+    std::atomic<uint64_t> writeErrors{0};
+
+private:
+    enum BufferState { FREE, FILLING, FULL };
+    struct Buffer {
+        uint8_t *data = nullptr;
+        size_t fill = 0;
+        std::atomic_int state{FREE};
+    };
+    struct Chip {
+        Buffer *buffers = nullptr;
+        int current = 0;                //! Filled by the receive thread
+        int next = 0;                   //! Written next by the writer thread
+        std::atomic_bool busy{false};   //! In write(), see close()
+    };
+
+    void writeFiles();
+    bool writeBuffer(Buffer &b);
+
+    size_t bufferBytes;
+    int nBuffers;
+    Chip chips[number_of_chips];
+    int fd = -1;
+    std::atomic_bool capturing{false};
+    std::thread writer;
+    Notifier filled;
+};
+
+/**
+ * @brief Feeds a capture file through FrameAssembler::onEvent(), either as
+ * fast as possible or at the pace it was recorded.
+ */
+class PacketReplay
+{
+public:
+    ~PacketReplay() { close(); }
+    bool open(const std::string &filename);
+    void close();
+    //! @param stop checked between packets, may be nullptr
+    //! @return the number of packets fed
+    uint64_t run(FrameAssembler **assemblers, bool paced, const std::atomic_bool *stop = nullptr);
+
+private:
+    const uint8_t *map = nullptr;
+    size_t mapSize = 0;
+    std::vector<size_t> records[number_of_chips];  //! Offsets of the CaptureRecords per chip
+    PacketContainer pc;
+};
+
+#endif // PACKETCAPTURE_H
@@ -1,9 +1,12 @@
 #ifndef PACKETCONTAINER_H
 #define PACKETCONTAINER_H
 
+#include <stdint.h>
+
 typedef struct {
   int chipIndex;
   long size;
+  uint64_t timestamp_ns; //! Arrival, CLOCK_MONOTONIC
   char data[9000];
 } PacketContainer;
 
@@ -0,0 +1,173 @@
+#include "PacketMmapRing.h"
+
+#include <cstring>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//! Puts the UDP payload of an option-less IPv4 header on an 8-byte boundary:
+//! the kernel places the network header 16-byte aligned plus this reserve
+constexpr static unsigned payload_reserve = 4;
+
+PacketMmapRing::PacketMmapRing(unsigned blocks, unsigned blockSize, unsigned timeout_ms) {
+    this->blocks = blocks;
+    this->blockSize = blockSize;
+    this->timeout_ms = timeout_ms;
+}
+
+PacketMmapRing::~PacketMmapRing() {
+    close();
+}
+
+bool PacketMmapRing::open(const std::string &interface, int firstPort, int ports) {
+    close();
+    this->firstPort = firstPort;
+    this->ports = ports;
+
+    //! Protocol 0 receives nothing until bind(), after the filter is in place
+    sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return false;
+    }
+
+    //! IPv4, UDP, not a fragment, destination port in range. Fragments
+    //! are not reassembled here, the SPIDR link needs jumbo frames.
+    uint32_t last = uint32_t(firstPort + ports - 1);
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                           // Ethertype
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 9),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),                           // IP protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 7),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                           // Flags, offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 5, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),                          // IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),                           // UDP destination port
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, uint32_t(firstPort), 0, 2),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, last, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    std::memset(&req, 0, sizeof(req));
+    req.tp_block_size = blockSize;
+    req.tp_block_nr = blocks;
+    req.tp_frame_size = 2048; //! Only checked by V3, frames are packed
+    req.tp_frame_nr = blocks * (blockSize / req.tp_frame_size);
+    req.tp_retire_blk_tov = timeout_ms;
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0 ||
+            setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0 ||
+            setsockopt(sock, SOL_PACKET, PACKET_RESERVE, &payload_reserve, sizeof(payload_reserve)) != 0 ||
+            setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        int err = errno;
+        close();
+        errno = err;
+        return false;
+    }
+
+    mapSize = size_t(blocks) * blockSize;
+    void *p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, sock, 0);
+    if (p == MAP_FAILED) {
+        int err = errno;
+        map = nullptr;
+        close();
+        errno = err;
+        return false;
+    }
+    map = static_cast<char *>(p);
+    current = 0;
+
+    struct sockaddr_ll ll;
+    std::memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    if (!interface.empty()) {
+        ll.sll_ifindex = int(if_nametoindex(interface.c_str()));
+        if (ll.sll_ifindex == 0) {
+            close();
+            errno = ENODEV;
+            return false;
+        }
+    }
+    if (bind(sock, (struct sockaddr *) &ll, sizeof(ll)) != 0) {
+        int err = errno;
+        close();
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+void PacketMmapRing::close() {
+    if (map != nullptr) {
+        munmap(map, mapSize);
+        map = nullptr;
+    }
+    if (sock >= 0) {
+        ::close(sock);
+        sock = -1;
+    }
+}
+
+struct tpacket_block_desc *PacketMmapRing::nextBlock() {
+    struct tpacket_block_desc *block =
+            reinterpret_cast<struct tpacket_block_desc *>(map + size_t(current) * blockSize);
+    if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+        return nullptr;
+    }
+    return block;
+}
+
+//! Blocks are handed out and must come back in ring order
+void PacketMmapRing::releaseBlock(struct tpacket_block_desc *block) {
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    current = (current + 1) % blocks;
+}
+
+uint64_t PacketMmapRing::drops() {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    if (getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0) {
+        return 0;
+    }
+    return st.tp_drops;
+}
+
+char *PacketMmapRing::payload(struct tpacket3_hdr *hdr, int *portIndex, long *size) {
+    const struct sockaddr_ll *ll = reinterpret_cast<const struct sockaddr_ll *>(
+            reinterpret_cast<char *>(hdr) + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    if (ll->sll_pkttype == PACKET_OUTGOING || hdr->tp_snaplen < hdr->tp_len) {
+        return nullptr; //! Our own traffic (on lo), or cut short
+    }
+    char *ip = reinterpret_cast<char *>(hdr) + hdr->tp_net;
+    long ipOffset = long(hdr->tp_net) - long(hdr->tp_mac);
+    long ihl = (ip[0] & 0xf) * 4;
+    if (ipOffset + ihl + long(sizeof(struct udphdr)) > long(hdr->tp_snaplen)) {
+        return nullptr;
+    }
+    struct udphdr *udp = reinterpret_cast<struct udphdr *>(ip + ihl);
+    int port = ntohs(udp->dest) - firstPort;
+    long len = long(ntohs(udp->len)) - long(sizeof(struct udphdr));
+    if (port < 0 || port >= ports || len < 0 ||
+            ipOffset + ihl + long(sizeof(struct udphdr)) + len > long(hdr->tp_snaplen)) {
+        return nullptr;
+    }
+    char *data = reinterpret_cast<char *>(udp + 1);
+    if (reinterpret_cast<uintptr_t>(data) & 7) {
+        //! IP options: slide the payload back over the headers, still in place
+        char *aligned = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(data) & ~uintptr_t(7));
+        memmove(aligned, data, size_t(len));
+        data = aligned;
+    }
+    *portIndex = port;
+    *size = len;
+    return data;
+}
@@ -0,0 +1,86 @@
+#ifndef PACKETMMAPRING_H
+#define PACKETMMAPRING_H
+
+#include <stdint.h>
+#include <string>
+#include <time.h>
+#include <linux/if_packet.h>
+
+/**
+ * @brief AF_PACKET TPACKET_V3 receive ring for the SPIDR UDP ports.
+ *
+ * The kernel writes the filtered frames straight into blocks of a ring
+ * shared with user space and wakes the reader once per full (or timed out)
+ * block instead of once per datagram. The UDP payloads are handed out where
+ * they lie, 8-byte aligned, and stay valid until the block is released.
+ * Opening the ring needs CAP_NET_RAW.
+ */
+class PacketMmapRing
+{
+public:
+    //! @param blocks and @param blockSize [bytes, a power of two pages] shape
+    //! the ring; a partly filled block is handed over after @param timeout_ms
+    PacketMmapRing(unsigned blocks = 64, unsigned blockSize = 1 << 20, unsigned timeout_ms = 1);
+    ~PacketMmapRing();
+
+    //! Receive UDP datagrams to ports firstPort .. firstPort + ports - 1 on
+    //! one interface, "" = all
+    //! @return false with errno set, EPERM without CAP_NET_RAW
+    bool open(const std::string &interface, int firstPort, int ports);
+    void close();
+    int fd() { return sock; }
+
+    //! The oldest block handed over by the kernel, nullptr if none yet
+    struct tpacket_block_desc *nextBlock();
+    void releaseBlock(struct tpacket_block_desc *block);
+
+    /**
+     * @brief Calls f(int port index, char *payload, long size, uint64_t
+     * arrival_ns) for every datagram of a block, with the kernel's arrival
+     * time converted to CLOCK_MONOTONIC.
+     */
+    template <class F>
+    void forEach(struct tpacket_block_desc *block, F f);
+
+    //! Frames the kernel dropped on a full ring since the last call
+    uint64_t drops();
+
+private:
+    char *payload(struct tpacket3_hdr *hdr, int *portIndex, long *size);
+
+    unsigned blocks;
+    unsigned blockSize;
+    unsigned timeout_ms;
+    int sock = -1;
+    int firstPort = 0;
+    int ports = 0;
+    char *map = nullptr;
+    size_t mapSize = 0;
+    unsigned current = 0;  //! Next block to hand out
+};
+
+template <class F>
+void PacketMmapRing::forEach(struct tpacket_block_desc *block, F f) {
+    //! tp_sec/tp_nsec are CLOCK_REALTIME; one offset per block is close enough
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t offset = (int64_t(mono.tv_sec) - int64_t(real.tv_sec)) * 1000000000ll
+            + (int64_t(mono.tv_nsec) - int64_t(real.tv_nsec));
+
+    uint32_t n = block->hdr.bh1.num_pkts;
+    char *p = reinterpret_cast<char *>(block) + block->hdr.bh1.offset_to_first_pkt;
+    for (uint32_t k = 0; k < n; ++k) {
+        struct tpacket3_hdr *hdr = reinterpret_cast<struct tpacket3_hdr *>(p);
+        int portIndex;
+        long size;
+        char *data = payload(hdr, &portIndex, &size);
+        if (data != nullptr) {
+            int64_t arrival = int64_t(hdr->tp_sec) * 1000000000ll + int64_t(hdr->tp_nsec) + offset;
+            f(portIndex, data, size, uint64_t(arrival));
+        }
+        p += hdr->tp_next_offset;
+    }
+}
+
+#endif // PACKETMMAPRING_H
@@ -0,0 +1,34 @@
+#include "PacketRing.h"
+
+PacketRing::PacketRing(unsigned depth)
+{
+    unsigned size = 1;
+    while (size < depth) size <<= 1;
+    mask = size - 1;
+    slots = new PacketContainer[size];
+}
+
+PacketRing::~PacketRing()
+{
+    delete[] slots;
+}
+
+unsigned PacketRing::freeSlots()
+{
+    unsigned head = head_.load(std::memory_order_relaxed);
+    unsigned used = head - cachedTail;
+    if (used > (mask >> 1)) {
+        cachedTail = tail_.load(std::memory_order_acquire);
+        used = head - cachedTail;
+    }
+    return mask + 1 - used;
+}
+
+unsigned PacketRing::available()
+{
+    unsigned tail = tail_.load(std::memory_order_relaxed);
+    if (cachedHead == tail) {
+        cachedHead = head_.load(std::memory_order_acquire);
+    }
+    return cachedHead - tail;
+}
@@ -0,0 +1,52 @@
+#ifndef PACKETRING_H
+#define PACKETRING_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "PacketContainer.h"
+
+/**
+ * @brief Lock-free single-producer/single-consumer ring of PacketContainer slots.
+ *
+ * The receiver thread claims free slots with writeSlot(), fills them straight
+ * from the socket and makes them visible with publish(). The assembler thread
+ * reads them with readSlot() and hands them back with release().
+ * head_ and tail_ are free-running counters; the depth is a power of two.
+ */
+class PacketRing
+{
+public:
+    PacketRing(unsigned depth = 1024);
+    ~PacketRing();
+
+    //! Producer side
+    unsigned freeSlots();
+    PacketContainer *writeSlot(unsigned offset = 0) { return &slots[(head_.load(std::memory_order_relaxed) + offset) & mask]; }
+    void publish(unsigned n = 1) { head_.store(head_.load(std::memory_order_relaxed) + n, std::memory_order_release); }
+
+    //! Consumer side
+    unsigned available();
+    PacketContainer *readSlot(unsigned offset = 0) { return &slots[(tail_.load(std::memory_order_relaxed) + offset) & mask]; }
+    void release(unsigned n = 1) { tail_.store(tail_.load(std::memory_order_relaxed) + n, std::memory_order_release); }
+
+    unsigned depth() { return mask + 1; }
+    unsigned occupancy() { return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire); }
+
+    //! Packets the producer had to throw away because the ring was full
+    std::atomic<uint64_t> overflows{0};
+
+private:
+    PacketContainer *slots;
+    unsigned mask;
+
+    //! Each index sits on its own cache line together with the copy of the
+    //! other index its owner last saw, so the hot path rarely touches the
+    //! other thread's line.
+    alignas(64) std::atomic_uint head_{0};
+    unsigned cachedTail = 0;
+    alignas(64) std::atomic_uint tail_{0};
+    unsigned cachedHead = 0;
+};
+
+#endif // PACKETRING_H
@@ -0,0 +1,274 @@
+#include "PacketUring.h"
+
+#include <cstring>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+//! Buffer group of the provided-buffer ring
+constexpr static uint16_t buffer_group = 0;
+//! user_data of the cancellations, not a socket index
+constexpr static uint64_t cancel_tag = ~uint64_t(0);
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return int(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize) {
+    return int(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nrArgs) {
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+}
+
+PacketUring::PacketUring(unsigned buffers, unsigned bufferSize) {
+    this->buffers = buffers;
+    this->bufferSize = bufferSize;
+}
+
+PacketUring::~PacketUring() {
+    close();
+}
+
+bool PacketUring::open(const int *fds, int count, bool control) {
+    close();
+    if (count > int(sizeof(this->fds) / sizeof(this->fds[0])) || (buffers & (buffers - 1)) != 0 || buffers > 32768) {
+        errno = EINVAL;
+        return false;
+    }
+
+    //! One CQE per datagram, and a buffer only comes back once its CQE is
+    //! consumed: room for every buffer plus the last CQE of each receive
+    //! means the CQ never overflows (which would make io_uring_enter() fail)
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = buffers * 2;
+    ring = io_uring_setup(16, &p);
+    if (ring < 0 && errno == EINVAL) {
+        p.flags = IORING_SETUP_CQSIZE; //! Before 5.19
+        ring = io_uring_setup(16, &p);
+    }
+    if (ring < 0) {
+        return false;
+    }
+    int err = 0;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        err = ENOSYS; //! Older than 5.4, no multishot receive either
+    }
+
+    if (err == 0) {
+        sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (cqMapSize > sqMapSize) sqMapSize = cqMapSize;
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe *>(
+                mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+        if (sqMap == MAP_FAILED || sqes == MAP_FAILED) {
+            err = errno;
+            if (sqMap == MAP_FAILED) sqMap = nullptr;
+            if (sqes == MAP_FAILED) sqes = nullptr;
+        }
+    }
+    if (err == 0) {
+        char *sq = static_cast<char *>(sqMap);
+        sqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(sq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(sq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(sq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(sq + p.cq_off.cqes);
+
+        //! The provided buffers and the ring the kernel takes them from
+        bufRingSize = buffers * sizeof(struct io_uring_buf);
+        void *br = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        void *pl = mmap(nullptr, size_t(buffers) * bufferSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        bufRing = br == MAP_FAILED ? nullptr : static_cast<struct io_uring_buf_ring *>(br);
+        pool = pl == MAP_FAILED ? nullptr : static_cast<char *>(pl);
+        if (bufRing == nullptr || pool == nullptr) {
+            err = ENOMEM;
+        }
+    }
+    if (err == 0) {
+        struct io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(bufRing);
+        reg.ring_entries = buffers;
+        reg.bgid = buffer_group;
+        if (io_uring_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            err = errno; //! Before 5.19
+        }
+    }
+    if (err == 0) {
+        bufTail = 0;
+        for (unsigned bid = 0; bid < buffers; ++bid) {
+            recycle(bid);
+        }
+        __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+
+        this->count = count;
+        for (int i = 0; i < count; ++i) {
+            this->fds[i] = fds[i];
+            std::memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_controllen = control ? CMSG_SPACE(sizeof(uint32_t)) : 0;
+            arm(i);
+        }
+        if (submit(0, 0) < 0) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        //! Before 6.0 the kernel takes the multishot receives but fails them
+        //! at once with EINVAL; they would be re-armed for ever
+        submit(1, 10);
+        err = failedReceive();
+    }
+    if (err != 0) {
+        close();
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+void PacketUring::close() {
+    if (ring >= 0) {
+        cancel();
+        ::close(ring);
+        ring = -1;
+    }
+    if (sqMap != nullptr) munmap(sqMap, sqMapSize);
+    if (sqes != nullptr) munmap(sqes, sqesSize);
+    if (bufRing != nullptr) munmap(bufRing, bufRingSize);
+    if (pool != nullptr) munmap(pool, size_t(buffers) * bufferSize);
+    sqMap = nullptr;
+    sqes = nullptr;
+    bufRing = nullptr;
+    pool = nullptr;
+    count = 0;
+}
+
+//! Cancel the receives and wait for them to end. Closing the ring alone
+//! lets them go asynchronously, holding on to the sockets (and their ports)
+//! for a while after the receiver is gone.
+void PacketUring::cancel() {
+    int armed = 0;
+    for (int i = 0; i < count; ++i) {
+        unsigned tail = *sqTail;
+        unsigned slot = tail & *sqMask;
+        struct io_uring_sqe *sqe = &sqes[slot];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = uint64_t(i); //! The user_data of the receive
+        sqe->user_data = cancel_tag;
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        toSubmit++;
+        armed++;
+    }
+    for (int tries = 0; armed > 0 && tries < 10; ++tries) {
+        submit(1, 10);
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+            if (cqe->user_data != cancel_tag && !(cqe->flags & IORING_CQE_F_MORE)) {
+                armed--;
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+    count = 0;
+}
+
+//! errno of a receive that has already failed, 0 if none. Leaves the
+//! completions, datagrams among them, for forEach().
+int PacketUring::failedReceive() {
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (unsigned head = *cqHead; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+        if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res < 0 && cqe->res != -ENOBUFS) {
+            return -cqe->res;
+        }
+    }
+    return 0;
+}
+
+//! Queue a multishot recvmsg on socket index, submitted by the next submit()
+bool PacketUring::arm(int index) {
+    unsigned tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) {
+        return false; //! Full, cannot happen with one SQE per socket
+    }
+    unsigned slot = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[slot];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fds[index];
+    sqe->addr = reinterpret_cast<uint64_t>(&msgs[index]);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->user_data = uint64_t(index);
+    sqArray[slot] = slot;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+    return true;
+}
+
+int PacketUring::submit(unsigned wait, int timeout_ms) {
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000ll };
+    struct io_uring_getevents_arg arg;
+    std::memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    int ret = io_uring_enter(ring, toSubmit, wait, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret >= 0) {
+        toSubmit -= unsigned(ret) < toSubmit ? unsigned(ret) : toSubmit;
+    }
+    return ret;
+}
+
+bool PacketUring::wait(int timeout_ms) {
+    if (*cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    submit(1, timeout_ms); //! ETIME or EINTR are just an empty queue
+    return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+}
+
+void PacketUring::recycle(unsigned bid) {
+    //! Not bufRing->bufs: in C++ the empty struct of __DECLARE_FLEX_ARRAY
+    //! takes a byte and moves the array 8 bytes off the kernel's layout
+    struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(bufRing) + (bufTail & (buffers - 1));
+    buf->addr = reinterpret_cast<uint64_t>(pool + size_t(bid) * bufferSize);
+    buf->len = bufferSize;
+    buf->bid = uint16_t(bid);
+    bufTail++;
+}
+
+//! Consume the CQEs up to head, return their buffers, then re-arm
+void PacketUring::finish(unsigned head) {
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+    if (anyEnded) {
+        anyEnded = false;
+        for (int i = 0; i < count; ++i) {
+            if (ended[i]) {
+                ended[i] = false;
+                arm(i);
+                rearms++;
+            }
+        }
+        submit(0, 0);
+    }
+}
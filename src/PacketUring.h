@@ -0,0 +1,123 @@
+#ifndef PACKETURING_H
+#define PACKETURING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief io_uring receive engine for the chip sockets, on raw syscalls.
+ *
+ * Every socket gets one multishot IORING_OP_RECVMSG that keeps completing,
+ * one CQE per datagram, into buffers the kernel picks from a registered
+ * provided-buffer ring. There is no submission per packet and no syscall
+ * while completions are waiting. A buffer goes back to the ring only after
+ * forEach() has called back on it, i.e. after the datagram is decoded.
+ */
+class PacketUring
+{
+public:
+    //! @param buffers a power of two, @param bufferSize [bytes] per datagram
+    //! including the recvmsg header and control data
+    explicit PacketUring(unsigned buffers = 2048, unsigned bufferSize = 9216);
+    ~PacketUring();
+
+    //! Arm a multishot recvmsg on each of the @param count sockets in @param
+    //! fds; @param control asks for room for one SO_RXQ_OVFL cmsg
+    //! @return false with errno set, e.g. ENOSYS or EPERM without io_uring,
+    //! EINVAL without multishot recvmsg (before Linux 6.0)
+    bool open(const int *fds, int count, bool control);
+    void close();
+
+    //! Sleep until a completion arrives, up to @param timeout_ms
+    //! @return false on time-out
+    bool wait(int timeout_ms);
+
+    /**
+     * @brief Calls f(int socket index, char *payload, long size, struct
+     * msghdr &control) for every datagram completed so far, the payload
+     * 8-byte aligned, then returns the buffers and re-arms any socket whose
+     * multishot receive ended on running out of buffers. A receive that
+     * failed otherwise is not re-armed, see error.
+     * @return The number of datagrams
+     */
+    template <class F>
+    unsigned forEach(F f);
+
+    uint64_t rearms = 0;  //! Multishot receives that ended and were re-armed
+    int error = 0;        //! errno of a receive that failed for good, 0 if none
+
+private:
+    bool arm(int index);
+    void cancel();
+    int submit(unsigned wait, int timeout_ms);
+    void recycle(unsigned bid);
+    void finish(unsigned head);
+    int failedReceive();
+
+    unsigned buffers;
+    unsigned bufferSize;
+    int ring = -1;
+    int count = 0;
+    int fds[8];
+    struct msghdr msgs[8];
+    bool ended[8] = {};
+    bool anyEnded = false;
+
+    //! Mapped queues
+    void *sqMap = nullptr;
+    size_t sqMapSize = 0;
+    void *cqMap = nullptr;
+    size_t cqMapSize = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit = 0;
+
+    //! Provided buffers
+    struct io_uring_buf_ring *bufRing = nullptr;
+    size_t bufRingSize = 0;
+    char *pool = nullptr;
+    uint16_t bufTail = 0;
+};
+
+template <class F>
+unsigned PacketUring::forEach(F f) {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+        int index = int(cqe->user_data);
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = pool + size_t(bid) * bufferSize;
+            struct io_uring_recvmsg_out *out = reinterpret_cast<struct io_uring_recvmsg_out *>(buf);
+            struct msghdr &msg = msgs[index];
+            size_t skip = sizeof(*out) + msg.msg_namelen + msg.msg_controllen;
+            if (cqe->res >= int(skip) && !(out->flags & MSG_TRUNC)) {
+                struct msghdr control = {};
+                control.msg_control = buf + sizeof(*out) + msg.msg_namelen;
+                control.msg_controllen = out->controllen;
+                f(index, buf + skip, long(out->payloadlen), control);
+                n++;
+            }
+            recycle(bid);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                error = -cqe->res; //! Re-arming would only fail again
+            } else {
+                ended[index] = true;
+                anyEnded = true;
+            }
+        }
+    }
+    finish(head);
+    return n;
+}
+
+#endif // PACKETURING_H
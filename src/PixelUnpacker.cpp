@@ -0,0 +1,208 @@
+#include "PixelUnpacker.h"
+
+#include <immintrin.h>
+
+#include "spdlog/spdlog.h"
+
+template <int Bits>
+static void unpackScalarT(const uint64_t *words, int nwords, uint16_t *dst, int room) {
+    (void) room; //! The scalar loop writes exactly what it unpacks
+    constexpr int pixels_per_word = 60 / Bits;
+    constexpr uint64_t pixel_mask = (1 << Bits) - 1;
+    for (int i = 0; i < nwords; ++i) {
+        uint64_t pixelword = words[i];
+        for (int k = 0; k < pixels_per_word; ++k) {
+            *(dst++) = uint16_t(pixelword & pixel_mask);
+            pixelword >>= Bits;
+        }
+    }
+}
+
+static void decodeLutScalar(const uint16_t *lut, int counter_bits, uint16_t *pixels, int n) {
+    const uint16_t mask = uint16_t((1 << counter_bits) - 1);
+    for (int i = 0; i < n; ++i) {
+        pixels[i] = lut[pixels[i] & mask];
+    }
+}
+
+static void widenScalar(const uint16_t *low, const uint16_t *high, uint32_t *dst, int n) {
+    if (high == nullptr) {
+        for (int i = 0; i < n; ++i) dst[i] = low[i];
+    } else {
+        for (int i = 0; i < n; ++i) dst[i] = (uint32_t(high[i]) << 12) | low[i];
+    }
+}
+
+void PixelUnpacker::unpackScalar(int counter_bits, const uint64_t *words, int nwords, uint16_t *dst) {
+    switch (counter_bits) {
+    case 1:  unpackScalarT<1>(words, nwords, dst, 0); break;
+    case 6:  unpackScalarT<6>(words, nwords, dst, 0); break;
+    default: unpackScalarT<12>(words, nwords, dst, 0); break;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// AVX2 kernels
+//
+// A pshufb gathers, for every 16-bit output pixel, the two bytes of the word
+// that hold it. Pixel k starts at bit s = (Bits * k) % 8 of those two bytes;
+// multiplying by 2^(16 - Bits - s) moves it to the top of the 16-bit lane
+// (dropping the bits above it) and a shift right by 16 - Bits brings it down.
+// Stores are 8 or 16 pixels wide and may overlap; each kernel only takes the
+// SIMD path while its widest store still fits in room. The pixels a store
+// writes past the end of the run are 0, so a run cut short by packet loss
+// leaves no stray counts behind.
+// ----------------------------------------------------------------------------
+
+#define Z char(0x80) //! pshufb index that produces a zero byte
+
+__attribute__((target("avx2")))
+static void unpack12Avx2(const uint64_t *words, int nwords, uint16_t *dst, int room) {
+    //! Two words per register, one per 128-bit lane: pixels 0-4 of each,
+    //! starting at bytes 0, 1, 3, 4, 6 with bit offsets 0, 4, 0, 4, 0.
+    const __m256i shuffle = _mm256_setr_epi8(
+                0, 1, 1, 2, 3, 4, 4, 5, 6, 7, Z, Z, Z, Z, Z, Z,
+                8, 9, 9, 10, 11, 12, 12, 13, 14, 15, Z, Z, Z, Z, Z, Z);
+    const __m256i scale = _mm256_setr_epi16(16, 1, 16, 1, 16, 0, 0, 0,
+                                            16, 1, 16, 1, 16, 0, 0, 0);
+    int i = 0;
+    for (; i + 2 <= nwords && 10 * i + 13 <= room; i += 2) {
+        __m128i two = _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + i));
+        __m256i v = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(two), shuffle);
+        v = _mm256_srli_epi16(_mm256_mullo_epi16(v, scale), 4);
+        uint16_t *out = dst + 5 * i;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 5), _mm256_extracti128_si256(v, 1));
+    }
+    unpackScalarT<12>(words + i, nwords - i, dst + 5 * i, 0);
+}
+
+__attribute__((target("avx2")))
+static void unpack6Avx2(const uint64_t *words, int nwords, uint16_t *dst, int room) {
+    //! One word per register: pixels 0-7 in the low lane, 8-9 in the high lane
+    const __m256i shuffle = _mm256_setr_epi8(
+                0, 1, 0, 1, 1, 2, 2, 3, 3, 4, 3, 4, 4, 5, 5, 6,
+                6, 7, 6, 7, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z);
+    const __m256i scale = _mm256_setr_epi16(1 << 10, 1 << 4, 1 << 6, 1 << 8,
+                                            1 << 10, 1 << 4, 1 << 6, 1 << 8,
+                                            1 << 10, 1 << 4, 0, 0, 0, 0, 0, 0);
+    int i = 0;
+    for (; i < nwords && 10 * i + 16 <= room; ++i) {
+        __m256i v = _mm256_set1_epi64x(int64_t(words[i]));
+        v = _mm256_shuffle_epi8(v, shuffle);
+        v = _mm256_srli_epi16(_mm256_mullo_epi16(v, scale), 10);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 10 * i), v);
+    }
+    unpackScalarT<6>(words + i, nwords - i, dst + 10 * i, 0);
+}
+
+__attribute__((target("avx2")))
+static void unpack1Avx2(const uint64_t *words, int nwords, uint16_t *dst, int room) {
+    //! 16 pixels per register: byte 2r in the low lane, byte 2r+1 in the high
+    //! lane, each 16-bit lane then tests its own bit.
+    const __m256i shuffle[4] = {
+        _mm256_setr_epi8(0, Z, 0, Z, 0, Z, 0, Z, 0, Z, 0, Z, 0, Z, 0, Z,
+                         1, Z, 1, Z, 1, Z, 1, Z, 1, Z, 1, Z, 1, Z, 1, Z),
+        _mm256_setr_epi8(2, Z, 2, Z, 2, Z, 2, Z, 2, Z, 2, Z, 2, Z, 2, Z,
+                         3, Z, 3, Z, 3, Z, 3, Z, 3, Z, 3, Z, 3, Z, 3, Z),
+        _mm256_setr_epi8(4, Z, 4, Z, 4, Z, 4, Z, 4, Z, 4, Z, 4, Z, 4, Z,
+                         5, Z, 5, Z, 5, Z, 5, Z, 5, Z, 5, Z, 5, Z, 5, Z),
+        _mm256_setr_epi8(6, Z, 6, Z, 6, Z, 6, Z, 6, Z, 6, Z, 6, Z, 6, Z,
+                         7, Z, 7, Z, 7, Z, 7, Z, 7, Z, 7, Z, 7, Z, 7, Z)
+    };
+    const __m256i bit = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128,
+                                          1, 2, 4, 8, 16, 32, 64, 128);
+    //! Bits 60-63 are the packet type, not pixels
+    const __m256i last = _mm256_setr_epi16(-1, -1, -1, -1, -1, -1, -1, -1,
+                                           -1, -1, -1, -1, 0, 0, 0, 0);
+    int i = 0;
+    for (; i < nwords && 60 * i + 64 <= room; ++i) {
+        __m256i w = _mm256_set1_epi64x(int64_t(words[i]));
+        uint16_t *out = dst + 60 * i;
+        for (int r = 0; r < 4; ++r) {
+            __m256i v = _mm256_and_si256(_mm256_shuffle_epi8(w, shuffle[r]), bit);
+            v = _mm256_srli_epi16(_mm256_cmpeq_epi16(v, bit), 15);
+            if (r == 3)
+                v = _mm256_and_si256(v, last);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 16 * r), v);
+        }
+    }
+    unpackScalarT<1>(words + i, nwords - i, dst + 60 * i, 0);
+}
+
+#undef Z
+
+__attribute__((target("avx2")))
+static void decodeLutAvx2(const uint16_t *lut, int counter_bits, uint16_t *pixels, int n) {
+    //! Gather 32 bits at lut + 2 * value and keep the low half; the spare
+    //! entry at the end of the table keeps the top value's gather in bounds.
+    const int *base = reinterpret_cast<const int *>(lut);
+    const __m256i mask = _mm256_set1_epi32((1 << counter_bits) - 1);
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels + i));
+        __m256i lo = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), mask);
+        __m256i hi = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)), mask);
+        lo = _mm256_and_si256(_mm256_i32gather_epi32(base, lo, 2), low16);
+        hi = _mm256_and_si256(_mm256_i32gather_epi32(base, hi, 2), low16);
+        //! packus works per 128-bit lane, put the quarters back in order
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), v);
+    }
+    decodeLutScalar(lut, counter_bits, pixels + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void widenAvx2(const uint16_t *low, const uint16_t *high, uint32_t *dst, int n) {
+    int i = 0;
+    if (high == nullptr) {
+        for (; i + 16 <= n; i += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(low + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                                _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 8),
+                                _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+        }
+    } else {
+        for (; i + 16 <= n; i += 16) {
+            __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(low + i));
+            __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(high + i));
+            __m256i lo = _mm256_or_si256(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(l)),
+                                         _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(h)), 12));
+            __m256i hi = _mm256_or_si256(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(l, 1)),
+                                         _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(h, 1)), 12));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), lo);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 8), hi);
+        }
+    }
+    widenScalar(low + i, high == nullptr ? nullptr : high + i, dst + i, n - i);
+}
+
+// ----------------------------------------------------------------------------
+
+void PixelUnpacker::init(bool allowSimd) {
+    __builtin_cpu_init();
+    _avx2 = allowSimd && __builtin_cpu_supports("avx2");
+    if (_avx2) {
+        _unpack1 = unpack1Avx2;
+        _unpack6 = unpack6Avx2;
+        _unpack12 = unpack12Avx2;
+        _decodeLut = decodeLutAvx2;
+        _widen = widenAvx2;
+    } else {
+        _unpack1 = unpackScalarT<1>;
+        _unpack6 = unpackScalarT<6>;
+        _unpack12 = unpackScalarT<12>;
+        _decodeLut = decodeLutScalar;
+        _widen = widenScalar;
+    }
+    spdlog::get("console")->info("Pixel unpacking: {}", _avx2 ? "AVX2" : "scalar");
+}
+
+PixelUnpacker::UnpackFn PixelUnpacker::_unpack1 = unpackScalarT<1>;
+PixelUnpacker::UnpackFn PixelUnpacker::_unpack6 = unpackScalarT<6>;
+PixelUnpacker::UnpackFn PixelUnpacker::_unpack12 = unpackScalarT<12>;
+PixelUnpacker::LutFn PixelUnpacker::_decodeLut = decodeLutScalar;
+PixelUnpacker::WidenFn PixelUnpacker::_widen = widenScalar;
+bool PixelUnpacker::_avx2 = false;
@@ -0,0 +1,75 @@
+#ifndef PIXELUNPACKER_H
+#define PIXELUNPACKER_H
+
+#include <stdint.h>
+
+/**
+ * @brief Unpacks runs of consecutive MPX3 pixel words into a ChipFrame row.
+ *
+ * Every pixel word carries 60 bits of pixel data: 60 x 1-bit, 10 x 6-bit or
+ * 5 x 12-bit counters (24-bit mode sends the two 12-bit halves separately).
+ * unpack() writes nwords * (60 / counter_bits) pixels to dst and never
+ * touches dst[room] or beyond.
+ *
+ * decodeLut() maps whole frames of raw Medipix3RX pseudo-random counter
+ * values through a decoding table.
+ *
+ * widen() turns 16-bit counters into 32-bit pixels, merging the two 12-bit
+ * halves of 24-bit frames.
+ *
+ * init() picks AVX2 kernels when the CPU supports them and falls back to the
+ * scalar loop otherwise, so the same binary runs on either.
+ */
+class PixelUnpacker
+{
+public:
+    typedef void (*UnpackFn)(const uint64_t *words, int nwords, uint16_t *dst, int room);
+    typedef void (*LutFn)(const uint16_t *lut, int counter_bits, uint16_t *pixels, int n);
+    typedef void (*WidenFn)(const uint16_t *low, const uint16_t *high, uint32_t *dst, int n);
+
+    static void init(bool allowSimd = true);
+    static bool usingAvx2() { return _avx2; }
+
+    static void unpack(int counter_bits, const uint64_t *words, int nwords, uint16_t *dst, int room) {
+        switch (counter_bits) {
+        case 1:  _unpack1(words, nwords, dst, room); break;
+        case 6:  _unpack6(words, nwords, dst, room); break;
+        default: _unpack12(words, nwords, dst, room); break;
+        }
+    }
+
+    template <int Bits>
+    static void unpack(const uint64_t *words, int nwords, uint16_t *dst, int room) {
+        if constexpr (Bits == 1) {
+            _unpack1(words, nwords, dst, room);
+        } else if constexpr (Bits == 6) {
+            _unpack6(words, nwords, dst, room);
+        } else {
+            static_assert(Bits == 12, "Pixel words hold 1, 6 or 12-bit counters");
+            _unpack12(words, nwords, dst, room);
+        }
+    }
+
+    //! Replace n counter values in place by lut[value]. lut must have
+    //! (1 << counter_bits) + 1 entries, the last one is only read by gathers.
+    static void decodeLut(const uint16_t *lut, int counter_bits, uint16_t *pixels, int n) {
+        _decodeLut(lut, counter_bits, pixels, n);
+    }
+
+    //! dst[i] = high[i] << 12 | low[i], or just low[i] when high is nullptr
+    static void widen(const uint16_t *low, const uint16_t *high, uint32_t *dst, int n) {
+        _widen(low, high, dst, n);
+    }
+
+    static void unpackScalar(int counter_bits, const uint64_t *words, int nwords, uint16_t *dst);
+
+private:
+    static UnpackFn _unpack1;
+    static UnpackFn _unpack6;
+    static UnpackFn _unpack12;
+    static LutFn _decodeLut;
+    static WidenFn _widen;
+    static bool _avx2;
+};
+
+#endif // PIXELUNPACKER_H
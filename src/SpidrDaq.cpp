@@ -155,6 +155,10 @@ void SpidrDaq::init( int             *ipaddr,
         th = udpReceiver->spawn();
     }
     frameSetManager = udpReceiver->getFrameSetManager();
+
+    _recorder = new FrameRecorder();
+    _recorder->setAddrInfo( ipaddr, ports );
+    _recorder->setDeviceIdsAndTypes( ids, types );
 }
 
 // ----------------------------------------------------------------------------
@@ -168,6 +172,12 @@ SpidrDaq::~SpidrDaq()
 
 void SpidrDaq::stop()
 {
+  if( _recorder )
+    {
+      _recorder->close();
+      delete _recorder;
+      _recorder = nullptr;
+    }
     /*
   if( _frameBuilder )
     {
@@ -253,7 +263,23 @@ void SpidrDaq::setPixelDepth( int nbits )
 
 void SpidrDaq::setLutEnable( bool enable )
 {
-  //_frameBuilder->setLutEnable( enable );
+  // Decode the raw pixel counters on the host
+  FrameAssembler::setLutDecode( enable );
+}
+
+bool SpidrDaq::openFile( std::string filename, bool overwrite )
+{
+  if( !_recorder || !_recorder->open( filename, overwrite ) ) return false;
+  _recorder->start( frameSetManager );
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool SpidrDaq::closeFile()
+{
+  if( !_recorder ) return false;
+  return _recorder->close();
 }
 
 // ----------------------------------------------------------------------------
@@ -262,6 +288,7 @@ void SpidrDaq::setLutEnable( bool enable )
 
 bool SpidrDaq::hasFrame( unsigned long timeout_ms )
 {
+  if( _recorder && _recorder->isRecording() ) return _recorder->wait( timeout_ms );
   return frameSetManager->wait(timeout_ms);
 }
 
@@ -269,6 +296,8 @@ bool SpidrDaq::hasFrame( unsigned long timeout_ms )
 
 FrameSet *SpidrDaq::getFrameSet()
 {
+  // While recording, the recorder consumes the ring and passes the sets on
+  if( _recorder && _recorder->isRecording() ) return _recorder->getFrameSet();
   return frameSetManager->getFrameSet();
 }
 
@@ -276,9 +305,38 @@ FrameSet *SpidrDaq::getFrameSet()
 
 void SpidrDaq::releaseFrame(FrameSet *fs)
 {
+  if( fs == nullptr && _recorder && _recorder->isRecording() )
+    {
+      // Not the ring's tail: that is the recorder's
+      fs = _recorder->getFrameSet();
+      if( fs == nullptr ) return;
+    }
   frameSetManager->releaseFrameSet(fs);
 }
 
+// ----------------------------------------------------------------------------
+
+void SpidrDaq::assembleImage( FrameSet *fs, uint32_t *image )
+{
+  fs->assemble( _layout, image );
+}
+
+// ----------------------------------------------------------------------------
+
+void SpidrDaq::assembleImage( FrameSet *fs, uint16_t *image )
+{
+  fs->assemble( _layout, image );
+}
+
+// ----------------------------------------------------------------------------
+
+FrameSetView SpidrDaq::borrowFrameSet()
+{
+  FrameSet *fs = this->getFrameSet();
+  if( fs == nullptr ) return FrameSetView();
+  return FrameSetView( frameSetManager, fs );
+}
+
 // ----------------------------------------------------------------------------
 // Statistics
 // ----------------------------------------------------------------------------
@@ -300,4 +358,184 @@ int SpidrDaq::framesLostCount()
 void SpidrDaq::resetLostCount()
 {
   frameSetManager->_framesLost = 0;
+  udpReceiver->resetLostCounts();
+}
+
+// ----------------------------------------------------------------------------
+
+StatisticsSnapshot SpidrDaq::statistics( int index )
+{
+  if( index >= number_of_chips ) return StatisticsSnapshot();
+  return udpReceiver->statistics( index );
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::packetsReceivedCount( int index )
+{
+  return statistics( index ).packets;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::packetsReceivedCount()
+{
+  return statistics().packets;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::bytesReceivedCount( int index )
+{
+  return statistics( index ).bytes;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::bytesReceivedCount()
+{
+  return statistics().bytes;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::lostCount( int index )
+{
+  return statistics( index ).rowsLost;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::lostCount()
+{
+  return statistics().rowsLost;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::pixelsLostCount( int index )
+{
+  return statistics( index ).pixelsLost;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::pixelsLostCount()
+{
+  return statistics().pixelsLost;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::kernelDropsCount( int index )
+{
+  return statistics( index ).kernelDrops;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::kernelDropsCount()
+{
+  return statistics().kernelDrops;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::rubbishWordsCount( int index )
+{
+  return statistics( index ).rubbishWords;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::rubbishWordsCount()
+{
+  return statistics().rubbishWords;
+}
+
+// ----------------------------------------------------------------------------
+
+int SpidrDaq::ringOccupancy( int index )
+{
+  return statistics( index ).ringOccupancy;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::chipFramePoolExhaustedCount()
+{
+  return frameSetManager->poolExhausted();
+}
+
+// ----------------------------------------------------------------------------
+
+void SpidrDaq::setBackpressure( int policy, unsigned timeout_us )
+{
+  frameSetManager->setBackpressure( FrameSetManager::Backpressure(policy), timeout_us );
+}
+
+// ----------------------------------------------------------------------------
+
+void SpidrDaq::setStatsExport( int tcpPort, const std::string &unixPath )
+{
+  udpReceiver->setStatsExport( tcpPort, unixPath );
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::framesDroppedNewestCount()
+{
+  return frameSetManager->droppedNewest;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::framesDroppedOldestCount()
+{
+  return frameSetManager->droppedOldest;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::framesBlockedCount()
+{
+  return frameSetManager->blocked;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::blockTimeoutsCount()
+{
+  return frameSetManager->blockTimeouts;
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::latencyPercentile( int stage, double p )
+{
+  if( stage < 0 || stage >= FrameSetManager::LATENCY_STAGES ) return 0;
+  return frameSetManager->latency[stage].percentile( p );
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::latencyMax( int stage )
+{
+  if( stage < 0 || stage >= FrameSetManager::LATENCY_STAGES ) return 0;
+  return frameSetManager->latency[stage].max();
+}
+
+// ----------------------------------------------------------------------------
+
+long long SpidrDaq::latencySamples( int stage )
+{
+  if( stage < 0 || stage >= FrameSetManager::LATENCY_STAGES ) return 0;
+  return frameSetManager->latency[stage].count();
+}
+
+// ----------------------------------------------------------------------------
+
+void SpidrDaq::resetLatency()
+{
+  frameSetManager->resetLatency();
 }
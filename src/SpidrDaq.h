@@ -19,6 +19,10 @@
 
 #include "FrameSet.h"
 #include "FrameSetManager.h"
+#include "FrameSetView.h"
+#include "DetectorLayout.h"
+#include "FrameRecorder.h"
+#include "Statistics.h"
 
 class SpidrController;
 class UdpReceiver;
@@ -48,15 +52,26 @@ class MY_LIB_API SpidrDaq
   //void setDecodeFrames          ( bool decode );
   //void setCompressFrames        ( bool compress );
   void setLutEnable             ( bool enable );
-  //bool openFile                 ( std::string filename,
-  //                                bool overwrite = false );
-  //bool closeFile                ( );
+  //! Record every FrameSet to disk (see FrameRecorder). getFrameSet() goes
+  //! on working while recording, skipping the sets it is too slow for.
+  bool openFile                 ( std::string filename,
+                                  bool overwrite = false );
+  bool closeFile                ( );
 
   // Acquisition
   //int       numberOfDevices     ( ) { return (int) _frameReceivers.size(); }
   bool      hasFrame            ( unsigned long timeout_ms = 0 );
   FrameSet  *getFrameSet           ();
   void      releaseFrame        (FrameSet *fs = nullptr);
+  //! Zero-copy access to the next set; releases it when the token goes
+  //! out of scope. Not valid if there is no set available.
+  FrameSetView borrowFrameSet   ();
+  //! Chip geometry used by assembleImage(), a quad by default
+  void      setDetectorLayout   ( const DetectorLayout &layout ) { _layout = layout; }
+  const DetectorLayout &detectorLayout() { return _layout; }
+  //! The detector image of fs, detectorLayout().width x height pixels
+  void      assembleImage       ( FrameSet *fs, uint32_t *image );
+  void      assembleImage       ( FrameSet *fs, uint16_t *image );
   //int       frameShutterCounter ( int index = -1 );
   //bool      isCounterhFrame     ( int index = -1 );
   //int       frameFlags          ( int index );
@@ -74,11 +89,39 @@ class MY_LIB_API SpidrDaq
   int  framesCount              ( );
   //int  framesLostCount          ( int index );
   int  framesLostCount          ( );
-  //int  packetsReceivedCount     ( int index );
-  //int  packetsReceivedCount     ( );
-  //int  lostCount                ( int index );
-  //int  lostCount                ( );
+  //! Per chip (index) and over all chips; lock-free, see UdpReceiver::statistics()
+  long long packetsReceivedCount( int index );
+  long long packetsReceivedCount( );
+  long long bytesReceivedCount  ( int index );
+  long long bytesReceivedCount  ( );
+  //! Rows lost or cut short: the SPIDR packets carry no sequence number, so
+  //! lost packets are only seen as gaps in the rows
+  long long lostCount           ( int index );
+  long long lostCount           ( );
+  long long rubbishWordsCount   ( int index );
+  long long rubbishWordsCount   ( );
+  //! Packets waiting to be decoded, 0 without assembler threads
+  int       ringOccupancy       ( int index );
+  //! All counters at once; index -1 for the sum over the chips
+  StatisticsSnapshot statistics ( int index = -1 );
   void resetLostCount           ( );
+  long long chipFramePoolExhaustedCount( );
+  //! Backpressure when the consumer falls a full FrameSet ring behind,
+  //! see FrameSetManager::Backpressure
+  void setBackpressure          ( int policy, unsigned timeout_us = 0 );
+  //! Serve the statistics in Prometheus text format on a 127.0.0.1 TCP
+  //! port and/or a Unix socket (0 / "" = off), see StatsExporter
+  void setStatsExport           ( int tcpPort, const std::string &unixPath = "" );
+  long long framesDroppedNewestCount( );
+  long long framesDroppedOldestCount( );
+  long long framesBlockedCount  ( );
+  long long blockTimeoutsCount  ( );
+  //! Per-FrameSet latency [ns] of a FrameSetManager::LatencyStage, from
+  //! the packet arrival times to getFrameSet(); p in percent, e.g. 99.9
+  long long latencyPercentile   ( int stage, double p );
+  long long latencyMax          ( int stage );
+  long long latencySamples      ( int stage );
+  void      resetLatency        ( );
   //int  lostCountFile            ( );
   //int  lostCountFrame           ( );
 
@@ -88,8 +131,12 @@ class MY_LIB_API SpidrDaq
 
   //int  pixelsReceivedCount      ( int index );
   //int  pixelsReceivedCount      ( );
-  //int  pixelsLostCount          ( int index );
-  //int  pixelsLostCount          ( );
+  long long pixelsLostCount     ( int index );
+  long long pixelsLostCount     ( );
+  //! Datagrams the kernel dropped on a full socket buffer: pixels lost
+  //! without them were lost on the wire or in the switch
+  long long kernelDropsCount    ( int index );
+  long long kernelDropsCount    ( );
   //int  pixelsLostCountFrame     ( int index, int buf_i ); // For debugging
 
  private:
@@ -97,6 +144,8 @@ class MY_LIB_API SpidrDaq
   UdpReceiver * udpReceiver;
   FrameAssembler *_frameBuilder;
   std::thread th;
+  DetectorLayout _layout = DetectorLayout::quad();
+  FrameRecorder *_recorder = nullptr;
 
   // Functions used in c'tors
   void getIdsPortsTypes( SpidrController *spidrctrl,
@@ -0,0 +1,81 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * @brief Counter with a single writing thread. add() is a relaxed load and
+ * store rather than a locked read-modify-write, so it costs no more than a
+ * plain increment; any thread may read it at any time.
+ *
+ * reset() leaves the writer's value alone and moves the reader's baseline up
+ * to it instead, so any thread may reset without racing the writer.
+ */
+class Counter
+{
+public:
+    void add(uint64_t n = 1) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    //! For a writer that keeps its own tally and publishes it now and then
+    void set(uint64_t n) { v.store(n, std::memory_order_relaxed); }
+    //! Counted since the last reset(). The baseline is read first: it never
+    //! exceeds a value of v read after it.
+    uint64_t get() const {
+        uint64_t b = base.load(std::memory_order_acquire);
+        return v.load(std::memory_order_relaxed) - b;
+    }
+    void reset() {
+        uint64_t now = v.load(std::memory_order_relaxed);
+        uint64_t b = base.load(std::memory_order_relaxed);
+        while (b < now && !base.compare_exchange_weak(b, now, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+private:
+    std::atomic<uint64_t> v{0};
+    std::atomic<uint64_t> base{0};  //! Value of v at the last reset()
+};
+
+/**
+ * @brief Counters of one chip. packets, bytes and kernelDrops are written by
+ * the thread reading the chip's socket, the others by the thread decoding it.
+ */
+struct ChipStatistics {
+    Counter packets;        //! Datagrams received
+    Counter bytes;          //! ... and their payload
+    Counter framesDecoded;  //! Chip frames handed to the FrameSetManager
+    Counter rowsLost;       //! Rows missing or cut short by lost packets
+    Counter pixelsLost;
+    Counter kernelDrops;    //! Datagrams dropped on a full socket buffer (SO_RXQ_OVFL),
+                            //! as opposed to lost on the wire
+    Counter rubbishWords;   //! Words of no known type
+
+    //! Words per type, see Table 54 (MPX3 Packet Format)
+    Counter pSOF, pSOR, pMID, pEOR, pEOF;
+    Counter iSOF, iMID, iEOF;
+};
+
+//! Plain copy of the counters of one chip, or the sum over chips
+struct StatisticsSnapshot {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t framesDecoded = 0;
+    uint64_t rowsLost = 0;
+    uint64_t pixelsLost = 0;
+    uint64_t kernelDrops = 0;
+    uint64_t rubbishWords = 0;
+    uint64_t ringOverflows = 0;  //! Packets thrown away on a full PacketRing
+    unsigned ringOccupancy = 0;  //! Packets waiting in the PacketRing(s)
+    unsigned ringDepth = 0;      //! 0 when decoding on the receive thread
+
+    void take(const ChipStatistics &s) {
+        packets += s.packets.get();
+        bytes += s.bytes.get();
+        framesDecoded += s.framesDecoded.get();
+        rowsLost += s.rowsLost.get();
+        pixelsLost += s.pixelsLost.get();
+        kernelDrops += s.kernelDrops.get();
+        rubbishWords += s.rubbishWords.get();
+    }
+};
+
+#endif // STATISTICS_H
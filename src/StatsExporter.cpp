@@ -0,0 +1,265 @@
+#include "StatsExporter.h"
+
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "FrameSetManager.h"
+#include "UdpReceiver.h"
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+
+static const char *stage_names[FrameSetManager::LATENCY_STAGES] = {"assembly", "publish", "delivery", "end_to_end"};
+
+bool StatsExporter::listenTcp(int port) {
+    tcpFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (tcpFd < 0) {
+        spdlog::get("console")->error("Stats exporter socket: {}", strerror(errno));
+        return false;
+    }
+    int one = 1;
+    setsockopt(tcpFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); //! Not reachable from the network
+    addr.sin_port = htons(uint16_t(port));
+    if (bind(tcpFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(tcpFd, 4) != 0) {
+        spdlog::get("console")->error("Stats exporter, port {}: {}", port, strerror(errno));
+        close(tcpFd);
+        tcpFd = -1;
+        return false;
+    }
+    spdlog::get("console")->info("Serving statistics on 127.0.0.1:{}", port);
+    return true;
+}
+
+bool StatsExporter::listenUnix(const std::string &path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (path.size() >= sizeof(addr.sun_path)) {
+        spdlog::get("console")->error("Stats exporter, socket path too long: {}", path);
+        return false;
+    }
+    unixFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (unixFd < 0) {
+        spdlog::get("console")->error("Stats exporter socket: {}", strerror(errno));
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    unlink(path.c_str()); //! Left over from a previous run
+    if (bind(unixFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(unixFd, 4) != 0) {
+        spdlog::get("console")->error("Stats exporter, {}: {}", path, strerror(errno));
+        close(unixFd);
+        unixFd = -1;
+        return false;
+    }
+    unixPath = path;
+    spdlog::get("console")->info("Serving statistics on {}", path);
+    return true;
+}
+
+void StatsExporter::start() {
+    if (thread.joinable() || (tcpFd < 0 && unixFd < 0)) {
+        return;
+    }
+    stopping = false;
+    thread = std::thread(&StatsExporter::serve, this);
+}
+
+void StatsExporter::stop() {
+    stopping = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (tcpFd >= 0) {
+        close(tcpFd);
+        tcpFd = -1;
+    }
+    if (unixFd >= 0) {
+        close(unixFd);
+        unixFd = -1;
+        unlink(unixPath.c_str());
+    }
+}
+
+void StatsExporter::serve() {
+    struct pollfd pfds[2];
+    int n = 0;
+    for (int fd : {tcpFd, unixFd}) {
+        if (fd >= 0) {
+            pfds[n].fd = fd;
+            pfds[n].events = POLLIN;
+            n++;
+        }
+    }
+    while (!stopping) {
+        int ret = poll(pfds, nfds_t(n), 200);
+        if (ret <= 0) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            int fd = accept4(pfds[i].fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                answer(fd);
+                close(fd);
+            }
+        }
+    }
+}
+
+//! One response per connection, then close
+void StatsExporter::answer(int fd) {
+    char request[4096];
+    long got = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 100) > 0) {
+        got = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    }
+    bool http = got >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    std::string body = render();
+    std::string response;
+    if (http) {
+        response = fmt::format("HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                               "Content-Length: {}\r\n\r\n", body.size());
+    }
+    response += body;
+
+    //! A client that stops reading is dropped, not waited for: the
+    //! exporter serves one connection at a time
+    struct timeval timeout = { 0, send_timeout_ms * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(send_timeout_ms);
+    size_t done = 0;
+    while (done < response.size()) {
+        long n = send(fd, response.data() + done, response.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno != EINTR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                dropped++;
+            }
+            return;
+        }
+        if (n > 0) {
+            done += size_t(n);
+        }
+        if (done < response.size() && std::chrono::steady_clock::now() > deadline) {
+            dropped++; //! Reading, but too slowly
+            return;
+        }
+    }
+    scrapes++;
+}
+
+static void header(fmt::memory_buffer &out, const char *name, const char *type, const char *help) {
+    fmt::format_to(out, "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+std::string StatsExporter::render() {
+    fmt::memory_buffer out;
+    StatisticsSnapshot chips[Config::number_of_chips];
+    for (int i = 0; i < Config::number_of_chips; i++) {
+        chips[i] = receiver->statistics(i);
+    }
+
+    struct { const char *name, *type, *help; uint64_t StatisticsSnapshot::*field; } perChip[] = {
+        {"mpx3_packets_received_total", "counter", "UDP datagrams received", &StatisticsSnapshot::packets},
+        {"mpx3_bytes_received_total", "counter", "UDP payload bytes received", &StatisticsSnapshot::bytes},
+        {"mpx3_chip_frames_decoded_total", "counter", "Chip frames handed to the FrameSetManager", &StatisticsSnapshot::framesDecoded},
+        {"mpx3_rows_lost_total", "counter", "Pixel rows missing or cut short by lost packets", &StatisticsSnapshot::rowsLost},
+        {"mpx3_pixels_lost_total", "counter", "Pixels lost with missing packets", &StatisticsSnapshot::pixelsLost},
+        {"mpx3_kernel_drops_total", "counter", "Datagrams dropped by the kernel on a full socket buffer", &StatisticsSnapshot::kernelDrops},
+        {"mpx3_rubbish_words_total", "counter", "Pixel words of no known type", &StatisticsSnapshot::rubbishWords},
+        {"mpx3_packet_ring_overflows_total", "counter", "Packets thrown away on a full packet ring", &StatisticsSnapshot::ringOverflows},
+    };
+    for (auto &m : perChip) {
+        header(out, m.name, m.type, m.help);
+        for (int i = 0; i < Config::number_of_chips; i++) {
+            fmt::format_to(out, "{}{{chip=\"{}\"}} {}\n", m.name, i, chips[i].*m.field);
+        }
+    }
+    header(out, "mpx3_packet_ring_occupancy", "gauge", "Packets waiting to be decoded");
+    for (int i = 0; i < Config::number_of_chips; i++) {
+        fmt::format_to(out, "mpx3_packet_ring_occupancy{{chip=\"{}\"}} {}\n", i, chips[i].ringOccupancy);
+    }
+    header(out, "mpx3_packet_ring_depth", "gauge", "Packet ring slots, 0 when decoding on the receive thread");
+    for (int i = 0; i < Config::number_of_chips; i++) {
+        fmt::format_to(out, "mpx3_packet_ring_depth{{chip=\"{}\"}} {}\n", i, chips[i].ringDepth);
+    }
+
+    header(out, "mpx3_decode_seconds", "summary", "Time spent decoding a chip frame, LUT included");
+    for (int i = 0; i < Config::number_of_chips; i++) {
+        const LatencyHistogram *h = receiver->decodeTime(i);
+        if (h == nullptr) {
+            continue;
+        }
+        for (double q : {0.5, 0.99, 0.999}) {
+            fmt::format_to(out, "mpx3_decode_seconds{{chip=\"{}\",quantile=\"{}\"}} {:.9f}\n",
+                           i, q, double(h->percentile(q * 100.)) * 1e-9);
+        }
+        fmt::format_to(out, "mpx3_decode_seconds_sum{{chip=\"{}\"}} {:.9f}\n", i, double(h->sumNs()) * 1e-9);
+        fmt::format_to(out, "mpx3_decode_seconds_count{{chip=\"{}\"}} {}\n", i, h->count());
+    }
+
+    const char *mode = receiver->isBusyPolling() ? "busy_poll" : "epoll";
+    const LatencyHistogram &wake = receiver->wakeLatency;
+    header(out, "mpx3_wakeup_latency_seconds", "summary", "Arrival to pick-up of the first datagram after an idle spell, by receive mode");
+    for (double q : {0.5, 0.99, 0.999}) {
+        fmt::format_to(out, "mpx3_wakeup_latency_seconds{{mode=\"{}\",quantile=\"{}\"}} {:.9f}\n",
+                       mode, q, double(wake.percentile(q * 100.)) * 1e-9);
+    }
+    fmt::format_to(out, "mpx3_wakeup_latency_seconds_sum{{mode=\"{}\"}} {:.9f}\n", mode, double(wake.sumNs()) * 1e-9);
+    fmt::format_to(out, "mpx3_wakeup_latency_seconds_count{{mode=\"{}\"}} {}\n", mode, wake.count());
+    header(out, "mpx3_wakeup_latency_max_seconds", "gauge", "Largest wake-up latency");
+    fmt::format_to(out, "mpx3_wakeup_latency_max_seconds{{mode=\"{}\"}} {:.9f}\n", mode, double(wake.max()) * 1e-9);
+    header(out, "mpx3_busy_poll_parks_total", "counter", "Times the busy-poll loop ran idle and slept in epoll_wait");
+    fmt::format_to(out, "mpx3_busy_poll_parks_total {}\n", receiver->parks.get());
+
+    FrameSetManager *fsm = receiver->getFrameSetManager();
+    if (fsm != nullptr) {
+        struct { const char *name, *type, *help; uint64_t value; } sets[] = {
+            {"mpx3_frame_sets_received_total", "counter", "FrameSets published", uint64_t(fsm->_framesReceived.load(std::memory_order_relaxed))},
+            {"mpx3_frame_sets_lost_total", "counter", "FrameSets lost", uint64_t(fsm->_framesLost.load(std::memory_order_relaxed))},
+            {"mpx3_chip_frames_dropped_newest_total", "counter", "Chip frames dropped on a full FrameSet ring", fsm->droppedNewest.load(std::memory_order_relaxed)},
+            {"mpx3_frame_sets_dropped_oldest_total", "counter", "Unread FrameSets discarded for newer ones", fsm->droppedOldest.load(std::memory_order_relaxed)},
+            {"mpx3_chip_frames_blocked_total", "counter", "Chip frames that waited for the consumer", fsm->blocked.load(std::memory_order_relaxed)},
+            {"mpx3_block_timeouts_total", "counter", "Chip frames dropped after waiting", fsm->blockTimeouts.load(std::memory_order_relaxed)},
+            {"mpx3_chip_frame_pool_exhausted_total", "counter", "Chip frames decoded into scratch memory", fsm->poolExhausted()},
+            {"mpx3_chip_frame_pool_touched", "gauge", "ChipFrames of the pool faulted in", fsm->poolTouched()},
+            {"mpx3_frame_set_ring_occupancy", "gauge", "FrameSets claimed and not yet released", fsm->occupancy()},
+            {"mpx3_frame_set_ring_depth", "gauge", "FrameSet ring slots", fsm->depth()},
+        };
+        for (auto &m : sets) {
+            header(out, m.name, m.type, m.help);
+            fmt::format_to(out, "{} {}\n", m.name, m.value);
+        }
+
+        header(out, "mpx3_frame_latency_seconds", "summary", "Per FrameSet latency from packet arrival, by stage");
+        for (int s = 0; s < FrameSetManager::LATENCY_STAGES; s++) {
+            const LatencyHistogram &h = fsm->latency[s];
+            for (double q : {0.5, 0.99, 0.999}) {
+                fmt::format_to(out, "mpx3_frame_latency_seconds{{stage=\"{}\",quantile=\"{}\"}} {:.9f}\n",
+                               stage_names[s], q, double(h.percentile(q * 100.)) * 1e-9);
+            }
+            fmt::format_to(out, "mpx3_frame_latency_seconds_sum{{stage=\"{}\"}} {:.9f}\n", stage_names[s], double(h.sumNs()) * 1e-9);
+            fmt::format_to(out, "mpx3_frame_latency_seconds_count{{stage=\"{}\"}} {}\n", stage_names[s], h.count());
+        }
+        header(out, "mpx3_frame_latency_max_seconds", "gauge", "Largest per FrameSet latency, by stage");
+        for (int s = 0; s < FrameSetManager::LATENCY_STAGES; s++) {
+            fmt::format_to(out, "mpx3_frame_latency_max_seconds{{stage=\"{}\"}} {:.9f}\n",
+                           stage_names[s], double(fsm->latency[s].max()) * 1e-9);
+        }
+    }
+    return fmt::to_string(out);
+}
@@ -0,0 +1,54 @@
+#ifndef STATSEXPORTER_H
+#define STATSEXPORTER_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+class UdpReceiver;
+
+/**
+ * @brief Serves the receiver and FrameSetManager counters in the Prometheus
+ * text exposition format, for scraping by tools that do not link the DAQ.
+ *
+ * One thread listens on a localhost TCP port and/or a Unix socket. A request
+ * starting with "GET " gets an HTTP/1.0 response; a client that sends nothing
+ * (e.g. socat - UNIX-CONNECT:path) gets the bare text after 100 ms. Every
+ * counter is read with a relaxed atomic load, so a scrape never holds up the
+ * receive or decode threads. A client that does not take the response within
+ * send_timeout_ms is dropped, so it cannot hold up the other scrapers either.
+ */
+class StatsExporter
+{
+public:
+    explicit StatsExporter(UdpReceiver *receiver) : receiver(receiver) {}
+    ~StatsExporter() { stop(); }
+
+    //! @param port TCP port on 127.0.0.1
+    bool listenTcp(int port);
+    bool listenUnix(const std::string &path);
+    void start();
+    void stop();
+
+    //! The current exposition text
+    std::string render();
+
+    constexpr static int send_timeout_ms = 200;
+
+    std::atomic<uint64_t> scrapes{0};
+    //! Connections closed before the whole response was sent
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    void serve();
+    void answer(int fd);
+
+    UdpReceiver *receiver;
+    int tcpFd = -1;
+    int unixFd = -1;
+    std::string unixPath;
+    std::atomic_bool stopping{false};
+    std::thread thread;
+};
+
+#endif // STATSEXPORTER_H
@@ -1,8 +1,27 @@
 #include "UdpReceiver.h"
 #include "FrameAssembler.h"
+#include "PixelUnpacker.h"
+#include "mpx3defs.h"
 
 #include <chrono>
+#include <climits>
 #include <errno.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+
+//! Room for the SO_RXQ_OVFL drop count and SO_TIMESTAMPNS stamp of one datagram
+static const size_t control_size = CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec));
+//! ... and for the segment size of a UDP_GRO buffer
+static const size_t gro_control_size = control_size + CMSG_SPACE(sizeof(int));
+
+//! Spin-wait hint, frees the pipeline for the sibling hyper-thread
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
 
 UdpReceiver::UdpReceiver(bool lutBug) {
     this->lutBug = lutBug;
@@ -10,6 +29,134 @@ UdpReceiver::UdpReceiver(bool lutBug) {
 
 UdpReceiver::~UdpReceiver() {
     // stop(); //! TODO implement, delete some pointers?
+    delete exporter; //! First, it reads everything below
+    for (int i = 0; i < config.number_of_chips; ++i) {
+        delete[] batches[i].packets;
+        delete[] batches[i].targets;
+        delete[] batches[i].coalesced;
+        delete[] batches[i].iovecs;
+        delete[] batches[i].msgs;
+        delete[] batches[i].controls;
+        delete rings[i];
+    }
+    delete capture;
+    delete replay;
+    delete packetMmap;
+    delete uring;
+}
+
+void UdpReceiver::setBatchSize(int size) {
+    if (size < 1) {
+        size = 1;
+    } else if (size > max_batch_size) {
+        spdlog::get("console")->warn("Batch size {} too large, using {}", size, max_batch_size);
+        size = max_batch_size;
+    }
+    batch_size = size;
+}
+
+void UdpReceiver::setChipPlacement(int chipIndex, int cpu, int numaNode, int policy, int priority) {
+    if (chipIndex < 0 || chipIndex >= config.number_of_chips) {
+        spdlog::get("console")->error("setChipPlacement: no chip {}", chipIndex);
+        return;
+    }
+    placements[chipIndex].cpu = cpu;
+    placements[chipIndex].numaNode = numaNode;
+    placements[chipIndex].policy = policy;
+    placements[chipIndex].priority = priority;
+}
+
+void UdpReceiver::setAssemblerPlacement(int threadIndex, int cpu, int policy, int priority) {
+    if (threadIndex < 0 || threadIndex >= config.number_of_chips) {
+        spdlog::get("console")->error("setAssemblerPlacement: no thread {}", threadIndex);
+        return;
+    }
+    assemblerPlacements[threadIndex].cpu = cpu;
+    assemblerPlacements[threadIndex].policy = policy;
+    assemblerPlacements[threadIndex].priority = priority;
+}
+
+void UdpReceiver::setFrameSetStorage(unsigned depth, bool hugePages, int numaNode, bool prefault) {
+    if (fsm != nullptr) {
+        spdlog::get("console")->error("setFrameSetStorage: FrameSetManager already created");
+        return;
+    }
+    frame_set_depth = depth;
+    frame_set_huge_pages = hugePages;
+    frame_set_numa_node = numaNode;
+    frame_set_prefault = prefault;
+}
+
+void UdpReceiver::setBackpressure(FrameSetManager::Backpressure policy, unsigned timeout_us) {
+    backpressure = policy;
+    backpressure_timeout_us = timeout_us;
+    if (fsm != nullptr) {
+        fsm->setBackpressure(policy, timeout_us);
+    }
+}
+
+bool UdpReceiver::setCapture(const std::string &filename) {
+    if (capture == nullptr) {
+        capture = new PacketCapture();
+    }
+    return capture->open(filename);
+}
+
+bool UdpReceiver::setReplay(const std::string &filename, bool paced) {
+    if (replay == nullptr) {
+        replay = new PacketReplay();
+    }
+    replay_paced = paced;
+    if (!replay->open(filename)) {
+        delete replay;
+        replay = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void UdpReceiver::setAssemblerThreads(int n) {
+    if (n < 0) {
+        n = 0;
+    } else if (n > config.number_of_chips) {
+        n = config.number_of_chips; //! Each chip is decoded by one thread only
+    }
+    assembler_threads = n;
+}
+
+void UdpReceiver::setPacketMmap(const std::string &interface, unsigned blocks, unsigned blockKiB) {
+    packet_mmap_interface = interface;
+    packet_mmap_blocks = blocks;
+    packet_mmap_block_kib = blockKiB;
+}
+
+void UdpReceiver::setStatsExport(int tcpPort, const std::string &unixPath) {
+    stats_port = tcpPort;
+    stats_socket = unixPath;
+    if (fsm != nullptr) {
+        startStatsExport(); //! Already running, e.g. under SpidrDaq
+    }
+}
+
+void UdpReceiver::startStatsExport() {
+    delete exporter;
+    exporter = nullptr;
+    if (stats_port > 0 || !stats_socket.empty()) {
+        exporter = new StatsExporter(this);
+        if (stats_port > 0) {
+            exporter->listenTcp(stats_port);
+        }
+        if (!stats_socket.empty()) {
+            exporter->listenUnix(stats_socket);
+        }
+        exporter->start();
+    }
+}
+
+int UdpReceiver::socketBufferSize(int rate_hz, int pixel_depth, int ms) {
+    //! A 24-bit frame arrives as two 12-bit halves, the same bytes in all
+    long long bytes = (long long) MPX_PIXELS * pixel_depth / 8 * rate_hz * ms / 1000;
+    return bytes > INT_MAX / 2 ? INT_MAX / 2 : int(bytes); //! The kernel doubles it
 }
 
 bool UdpReceiver::initThread(const char *ipaddr, int UDP_Port) {
@@ -22,17 +169,73 @@ bool UdpReceiver::initThread(const char *ipaddr, int UDP_Port) {
 
     (void) ipaddr; //! Purely to suppress the warning about ipaddr not being used.
 
-    initSocket(); //! No arguments --> listens on all IP addresses
-    //! Arguments --> IP address as const char *
-    initFileDescriptorsAndBindToPorts(UDP_Port);
+    if (busy_poll.enable && per_chip_threads) {
+        spdlog::get("console")->warn("Busy polling sweeps all chips on one thread, not using chip workers");
+        per_chip_threads = false;
+    }
+    if (replay == nullptr) {
+        if (socket_tuning.udp_gro && (backend != SOCKETS || (assembler_threads > 0 && !per_chip_threads))) {
+            //! The packet ring would see the coalesced buffers, and ring
+            //! slots hold one datagram each
+            spdlog::get("console")->warn("UDP GRO needs the sockets backend without assembler threads, not using it");
+            socket_tuning.udp_gro = false;
+        }
+        initSocket(); //! No arguments --> listens on all IP addresses
+        //! Arguments --> IP address as const char *
+        initFileDescriptorsAndBindToPorts(UDP_Port);
+        if ((backend == PACKET_MMAP && !initPacketMmap(UDP_Port)) ||
+                (backend == IO_URING && !initIoUring())) {
+            backend = SOCKETS;
+        }
+        if (backend == SOCKETS) {
+            //! Arrival stamps for wakeLatency; the other backends have no
+            //! control room for them
+            int one = 1;
+            wake_timestamps = true;
+            for (int i = 0; i < config.number_of_chips; ++i) {
+                if (setsockopt(peers[i].fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) != 0) {
+                    spdlog::get("console")->warn("SO_TIMESTAMPNS, chip {}: {}", i, strerror(errno));
+                }
+            }
+        } else if (busy_poll.enable) {
+            spdlog::get("console")->warn("Busy polling needs the sockets backend, not using it");
+            busy_poll.enable = false;
+        }
+    } else {
+        per_chip_threads = false;
+        assembler_threads = 0; //! The replay decodes on the run() thread
+        busy_poll.enable = false;
+    }
+    if (per_chip_threads && assembler_threads > 0) {
+        spdlog::get("console")->warn("Chip workers decode their own packets, not using assembler threads");
+        assembler_threads = 0;
+    }
+    if (assembler_threads > 0) {
+        for (int i = 0; i < config.number_of_chips; ++i) {
+            rings[i] = new PacketRing(ring_depth);
+        }
+        spdlog::get("console")->info("Decoding on {} assembler thread(s), ring depth {}",
+                                     assembler_threads, rings[0]->depth());
+    }
+    if ((batch_size > 1 || socket_tuning.udp_gro) && !per_chip_threads) {
+        initBatches(); //! Otherwise every chip worker allocates its own
+    }
 
     FrameAssembler::lutInit(lutBug);
+    PixelUnpacker::init();
+
+    fsm = new FrameSetManager(frame_set_depth, frame_set_huge_pages, frame_set_numa_node,
+                              frame_set_prefault);
+    fsm->setBackpressure(backpressure, backpressure_timeout_us);
+    spdlog::get("console")->info("FrameSet ring depth {}, backpressure policy {}", fsm->depth(), backpressure);
 
     for (int i = 0; i < config.number_of_chips; ++i) {
         frameAssembler[i] = new FrameAssembler(i);
         frameAssembler[i]->setFrameSetManager(fsm);
     }
 
+    startStatsExport();
+
     return true;
 }
 
@@ -40,26 +243,69 @@ void UdpReceiver::run() {
 
     spdlog::get("console")->debug("Run started");
 
+    if (replay != nullptr) {
+        runReplay();
+        return;
+    }
+    if (packetMmap != nullptr) {
+        runPacketMmap();
+        return;
+    }
+    if (uring != nullptr) {
+        runIoUring();
+        if (finished) {
+            return;
+        }
+        delete uring; //! A receive failed, go on with the sockets
+        uring = nullptr;
+    }
+
+    if (per_chip_threads) {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < config.number_of_chips; ++i) {
+            workers.emplace_back(&UdpReceiver::runChip, this, i);
+        }
+        for (auto &t : workers) {
+            t.join();
+        }
+        return;
+    }
+
+    std::vector<std::thread> assemblers;
+    for (int t = 0; t < assembler_threads; ++t) {
+        assemblers.emplace_back(&UdpReceiver::assemble, this, t);
+    }
+
+    if (busy_poll.enable) {
+        runBusyPoll();
+    } else {
+        runEpoll();
+    }
+
+    for (auto &t : assemblers) {
+        t.join();
+    }
+}
+
+/**
+ * @brief Receive loop of the SOCKETS backend: sleeps in epoll_wait() until a
+ * chip socket has data, then reads it.
+ */
+void UdpReceiver::runEpoll() {
     int timeout_ms = int((timeout_us+0.5)/1000.); //! Round up
     spdlog::get("console")->debug("Poll timeout = {} us = {} ms", timeout_us, timeout_ms);
 
-    struct epoll_event events[4];
+    struct epoll_event events[Config::number_of_chips];
 
-    long poll_count = 0, ev_count = 0, sum_p = 0, sum_r = 0, sum_a = 0;
+    long poll_count = 0, ev_count = 0;
     do {
-
-        time_point begin = steady_clock::now();
-
-        int ret = epoll_wait(epfd, events, 1024, timeout_ms);
-        time_point polled = steady_clock::now();
+        int ret = epoll_wait(epfd, events, Config::number_of_chips, timeout_ms);
         poll_count++;
-        sum_p += std::chrono::duration_cast<us>(polled - begin).count();
 
         // Success
         if (ret > 0) {
             ev_count += ret;
             // An event on one of the fds has occurred.
-            time_point l0 = polled;
             for (int j = 0; j < ret; j++) {
                 uint32_t etype = events[j].events;
                 if (! (etype & EPOLLIN)) {
@@ -67,26 +313,8 @@ void UdpReceiver::run() {
                 }
 
                 peer_t *peer = (peer_t*) events[j].data.ptr; //! Does this have to be an old style cast?
-                int i = peer->chipIndex;
-                /* This consists of 12 (packets_per_frame) packets (MTU = 9000 bytes).
-             First 11 are 9000 bytes, the last one is 7560 bytes.
-             Assuming no packet loss, extra fragmentation or MTU changing size*/
-                long received_size =
-                        recv(peer->fd, inputQueues[i].data, max_packet_size, 0);
-                time_point lr = steady_clock::now();
-                inputQueues[i].chipIndex = i;
-                inputQueues[i].size = received_size;
-
-                ++packets; //! Count the number of packets received.
-
-                frameAssembler[i]->onEvent(inputQueues[i]);
-                time_point la = steady_clock::now();
-
-                {
-                    sum_r += std::chrono::duration_cast<us>(lr - l0).count();
-                    sum_a += std::chrono::duration_cast<us>(la - lr).count();
-                    l0 = la;
-                }
+                time_wake[peer->chipIndex] = true;
+                receiveChip(peer->chipIndex);
             }
 
         } else if (ret == -1 && errno != EINTR) {
@@ -94,12 +322,528 @@ void UdpReceiver::run() {
         }
 
         if (poll_count == 1000) {
-            spdlog::get("console")->debug("Polls {}, time {}, evts {}, rcv {}, ass {} ", poll_count, sum_p, ev_count, sum_r, sum_a);
-            poll_count = 0; ev_count = 0; sum_p = 0; sum_r = 0; sum_a = 0;
+            LatencyHistogram &e2e = fsm->latency[FrameSetManager::END_TO_END];
+            spdlog::get("console")->debug("Polls {}, evts {}, wake-up p50 {} p99 {} us, frame latency p50 {} p99 {} p999 {} us",
+                                          poll_count, ev_count, wakeLatency.percentile(50.) / 1000, wakeLatency.percentile(99.) / 1000,
+                                          e2e.percentile(50.) / 1000, e2e.percentile(99.) / 1000, e2e.percentile(99.9) / 1000);
+            poll_count = 0; ev_count = 0;
+        }
+    } while (!finished);
+}
+
+/**
+ * @brief Receive loop of the busy-poll mode: sweeps the non-blocking chip
+ * sockets without ever sleeping while data flows, so a datagram waits at
+ * most one sweep. With SO_BUSY_POLL set the empty reads also poll the NIC
+ * queue. After spin_us without data the loop parks in epoll_wait() and
+ * leaves the core to others until the next datagram; with spin_us 0 it
+ * never parks, which on a SCHED_FIFO thread needs a core of its own
+ * (isolcpus, nohz_full).
+ */
+void UdpReceiver::runBusyPoll() {
+    if (busy_poll.cpu >= 0) {
+        set_cpu_affinity(busy_poll.cpu);
+    }
+    int timeout_ms = int((timeout_us+0.5)/1000.); //! Round up
+    uint64_t spin_ns = uint64_t(busy_poll.spin_us) * 1000;
+    struct epoll_event events[Config::number_of_chips];
+    spdlog::get("console")->info("Busy polling the chip sockets, parking after {} us idle", busy_poll.spin_us);
+
+    bool idle = false;
+    uint64_t idle_since = 0;
+    do {
+        int n = 0;
+        for (int i = 0; i < config.number_of_chips; ++i) {
+            n += receiveChip(i);
+        }
+        if (n > 0) {
+            idle = false;
+            continue;
+        }
+        if (!idle) {
+            //! Whatever comes next is timed from its arrival
+            idle = true;
+            idle_since = monotonic_ns();
+            for (int i = 0; i < config.number_of_chips; ++i) {
+                time_wake[i] = true;
+            }
+        } else if (spin_ns > 0 && monotonic_ns() - idle_since >= spin_ns) {
+            parks.add();
+            if (epoll_wait(epfd, events, Config::number_of_chips, timeout_ms) == -1 && errno != EINTR) {
+                spdlog::get("console")->error("epoll_wait: {}", strerror(errno));
+            }
+            idle = false;
+            continue;
+        }
+        cpu_relax();
+    } while (!finished);
+}
+
+void UdpReceiver::runReplay() {
+    auto begin = steady_clock::now();
+    uint64_t n = replay->run(frameAssembler, replay_paced, &finished);
+    double s = std::chrono::duration<double>(steady_clock::now() - begin).count();
+    spdlog::get("console")->info("Replayed {} packets in {:.3f} s, {:.0f} packets/s", n, s, n / s);
+    finished = true;
+}
+
+/**
+ * @brief Receive loop of the PACKET_MMAP backend: sleeps until the kernel
+ * hands over a block, then decodes its datagrams where they lie.
+ */
+void UdpReceiver::runPacketMmap() {
+    int timeout_ms = int((timeout_us+0.5)/1000.); //! Round up
+    struct pollfd pfd = { packetMmap->fd(), POLLIN, 0 };
+    unsigned long blocks = 0;
+
+    do {
+        struct tpacket_block_desc *block = packetMmap->nextBlock();
+        if (block == nullptr) {
+            if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR) {
+                spdlog::get("console")->error("poll, packet ring: {}", strerror(errno));
+            }
+            continue;
+        }
+        packetMmap->forEach(block, [this](int chipIndex, char *data, long size, uint64_t arrival_ns) {
+            received(chipIndex, size);
+            if (capture != nullptr) {
+                capture->write(chipIndex, data, size, arrival_ns);
+            }
+            frameAssembler[chipIndex]->onPacket(data, size, arrival_ns);
+        });
+        packetMmap->releaseBlock(block);
+
+        if (++blocks % 64 == 0) {
+            packetMmapDrops.add(packetMmap->drops());
+        }
+    } while (!finished);
+    packetMmapDrops.add(packetMmap->drops());
+}
+
+/**
+ * @brief Receive loop of the IO_URING backend: sleeps in io_uring_enter()
+ * only when no completion is waiting, decodes every datagram in its
+ * provided buffer and hands the buffers back after the batch.
+ */
+void UdpReceiver::runIoUring() {
+    int timeout_ms = int((timeout_us+0.5)/1000.); //! Round up
+    uint64_t rearms = 0;
+
+    do {
+        if (!uring->wait(timeout_ms)) {
+            continue;
+        }
+        uint64_t now = monotonic_ns(); //! One clock read per batch of completions
+        uring->forEach([this, now](int chipIndex, char *data, long size, struct msghdr &control) {
+            received(chipIndex, size);
+            if (socket_tuning.rxq_ovfl) {
+                kernelDropped(chipIndex, control);
+            }
+            if (capture != nullptr) {
+                capture->write(chipIndex, data, size, now);
+            }
+            frameAssembler[chipIndex]->onPacket(data, size, now);
+        });
+        if (uring->rearms != rearms) {
+            rearms = uring->rearms;
+            spdlog::get("console")->debug("Out of io_uring buffers, receives re-armed {} times", rearms);
+        }
+        if (uring->error != 0) {
+            spdlog::get("console")->error("io_uring receive failed ({}), using epoll", strerror(uring->error));
+            return;
+        }
+    } while (!finished);
+}
+
+/**
+ * @brief Pin the calling thread, a chip worker or assembler thread, to the
+ * CPU (and NUMA node) of its placement and set its scheduling. Without the
+ * latter it would inherit the receiver's SCHED_FIFO 99 and could starve the
+ * consumer and the kernel's softirq threads on its core.
+ * @param index picks the default cpu, 1 + index off the receiver's cpu 0
+ * @return the cpu, -1 if not pinned
+ */
+int UdpReceiver::applyPlacement(const placement_t &place, int index) {
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = place.cpu;
+    if (cpu < 0 && nproc > 1) {
+        cpu = int(1 + index % (nproc - 1)); //! Keep off the receiver core
+    }
+    if (cpu >= 0) {
+        set_cpu_affinity(cpu);
+    }
+    struct sched_param sp = {};
+    sp.sched_priority = place.priority;
+    int ret = pthread_setschedparam(pthread_self(), place.policy, &sp);
+    if (ret != 0) {
+        spdlog::get("console")->error("pthread_setschedparam, policy {} priority {}: {}",
+                                      place.policy, place.priority, strerror(ret));
+    }
+    if (place.numaNode >= 0) {
+        set_memory_node(place.numaNode);
+    }
+    return cpu;
+}
+
+/**
+ * @brief Receive and decode loop of a single chip, used with setPerChipThreads().
+ * The worker is pinned to the CPU (and NUMA node) of its placement and owns
+ * its socket and FrameAssembler, so the chips only meet in
+ * FrameSetManager::putChipFrame().
+ */
+void UdpReceiver::runChip(int chipIndex) {
+    placement_t &place = placements[chipIndex];
+    int cpu = applyPlacement(place, chipIndex);
+    if (batch_size > 1 || socket_tuning.udp_gro) {
+        initBatch(chipIndex);
+    }
+    spdlog::get("console")->debug("Chip {} worker on cpu {}, node {}, policy {} priority {}",
+                                  chipIndex, cpu, place.numaNode, place.policy, place.priority);
+
+    int timeout_ms = int((timeout_us+0.5)/1000.); //! Round up
+    struct pollfd pfd = { peers[chipIndex].fd, POLLIN, 0 };
+
+    do {
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret == -1 && errno != EINTR) {
+            spdlog::get("console")->error("poll, chip {}: {}", chipIndex, strerror(errno));
+        }
+        if (ret <= 0 || !(pfd.revents & POLLIN)) {
+            continue;
         }
+        time_wake[chipIndex] = true;
+        receiveChip(chipIndex);
     } while (!finished);
 }
 
+/**
+ * @brief Read what one chip socket holds, one recv() or recvmmsg() worth,
+ * without blocking, and decode it or pass it to the chip's ring.
+ * @return The number of datagrams, 0 if the socket was empty
+ */
+int UdpReceiver::receiveChip(int chipIndex) {
+    if (rings[chipIndex] != nullptr) {
+        //! Only fill the ring, an assembler thread decodes
+        return receiveIntoRing(chipIndex);
+    }
+    if (socket_tuning.udp_gro) {
+        return receiveCoalesced(chipIndex);
+    }
+    if (batch_size > 1) {
+        //! Drain up to batch_size datagrams, then decode them all
+        int n = receiveBatch(chipIndex, batch_size);
+        if (n <= 0) {
+            return 0;
+        }
+        frameAssembler[chipIndex]->onEvents(batches[chipIndex].packets, n);
+        return n;
+    }
+    /* This consists of 12 (packets_per_frame) packets (MTU = 9000 bytes).
+       First 11 are 9000 bytes, the last one is 7560 bytes.
+       Assuming no packet loss, extra fragmentation or MTU changing size*/
+    PacketContainer &pc = inputQueues[chipIndex];
+    long received_size = receiveOne(chipIndex, pc.data);
+    if (received_size < 0) {
+        return 0;
+    }
+    pc.chipIndex = chipIndex;
+    pc.size = received_size;
+    pc.timestamp_ns = monotonic_ns();
+    received(chipIndex, received_size);
+    captured(pc);
+    frameAssembler[chipIndex]->onEvent(pc);
+    return 1;
+}
+
+/**
+ * @brief Decode loop of one assembler thread. Thread t owns the rings of
+ * chips t, t + assembler_threads, ..., so every FrameAssembler keeps a single
+ * consumer. Backs off to short sleeps when all of its rings are empty.
+ * Placed and scheduled like a chip worker, see applyPlacement().
+ */
+void UdpReceiver::assemble(int threadIndex) {
+    placement_t &place = assemblerPlacements[threadIndex];
+    int cpu = applyPlacement(place, threadIndex);
+    spdlog::get("console")->debug("Assembler thread {} on cpu {}, policy {} priority {}",
+                                  threadIndex, cpu, place.policy, place.priority);
+
+    int idle = 0;
+    while (!finished) {
+        unsigned decoded = 0;
+        for (int i = threadIndex; i < config.number_of_chips; i += assembler_threads) {
+            PacketRing *ring = rings[i];
+            unsigned n = ring->available();
+            for (unsigned k = 0; k < n; ++k) {
+                frameAssembler[i]->onEvent(*ring->readSlot(k));
+            }
+            if (n > 0) {
+                ring->release(n);
+                decoded += n;
+            }
+        }
+        if (decoded > 0) {
+            idle = 0;
+        } else if (++idle < 1000) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(us(50));
+        }
+    }
+}
+
+void UdpReceiver::received(int chipIndex, long size) {
+    if (size < 0) {
+        return;
+    }
+    ChipStatistics &s = frameAssembler[chipIndex]->stats;
+    s.packets.add();
+    s.bytes.add(uint64_t(size));
+}
+
+/**
+ * @brief Receive one datagram of a chip without blocking. With drop
+ * accounting or arrival stamps on this is a recvmsg() picking up the
+ * SO_RXQ_OVFL count and SO_TIMESTAMPNS stamp.
+ * @return The datagram size, or -1 as recv()
+ */
+long UdpReceiver::receiveOne(int chipIndex, char *data) {
+    int fd = peers[chipIndex].fd;
+    if (!socket_tuning.rxq_ovfl && !wake_timestamps) {
+        return recv(fd, data, max_packet_size, MSG_DONTWAIT);
+    }
+    char control[control_size];
+    struct iovec iov = { data, max_packet_size };
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    long received_size = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (received_size >= 0) {
+        kernelDropped(chipIndex, msg);
+        if (time_wake[chipIndex]) {
+            wokeUp(chipIndex, msg);
+        }
+    }
+    return received_size;
+}
+
+//! The kernel attaches its cumulative drop count of the socket to every
+//! datagram once it is non-zero, so a missing cmsg means no new drops.
+void UdpReceiver::kernelDropped(int chipIndex, struct msghdr &msg) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_RXQ_OVFL) {
+            continue;
+        }
+        uint32_t drops;
+        std::memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+        uint32_t fresh = drops - kernel_drops[chipIndex]; //! Wraps like the kernel's
+        if (fresh != 0) {
+            kernel_drops[chipIndex] = drops;
+            frameAssembler[chipIndex]->stats.kernelDrops.add(fresh);
+        }
+    }
+}
+
+//! Records the time since the kernel stamped the datagram (CLOCK_REALTIME)
+void UdpReceiver::wokeUp(int chipIndex, struct msghdr &msg) {
+    time_wake[chipIndex] = false;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) {
+            continue;
+        }
+        struct timespec arrival, now;
+        std::memcpy(&arrival, CMSG_DATA(c), sizeof(arrival));
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t ns = (int64_t(now.tv_sec) - int64_t(arrival.tv_sec)) * 1000000000ll
+                + (int64_t(now.tv_nsec) - int64_t(arrival.tv_nsec));
+        if (ns >= 0) {
+            wakeLatency.record(uint64_t(ns));
+        }
+    }
+}
+
+StatisticsSnapshot UdpReceiver::statistics(int chipIndex) {
+    StatisticsSnapshot snap;
+    for (int i = 0; i < config.number_of_chips; ++i) {
+        if (chipIndex >= 0 && i != chipIndex) {
+            continue;
+        }
+        if (frameAssembler[i] != nullptr) {
+            snap.take(frameAssembler[i]->stats);
+        }
+        if (rings[i] != nullptr) {
+            snap.ringOverflows += rings[i]->overflows.load(std::memory_order_relaxed);
+            snap.ringOccupancy += rings[i]->occupancy();
+            snap.ringDepth += rings[i]->depth();
+        }
+    }
+    if (chipIndex < 0) {
+        snap.kernelDrops += packetMmapDrops.get();
+    }
+    return snap;
+}
+
+const LatencyHistogram *UdpReceiver::decodeTime(int chipIndex) {
+    if (chipIndex < 0 || chipIndex >= config.number_of_chips || frameAssembler[chipIndex] == nullptr) {
+        return nullptr;
+    }
+    return &frameAssembler[chipIndex]->decodeTime;
+}
+
+void UdpReceiver::resetLostCounts() {
+    for (int i = 0; i < config.number_of_chips; ++i) {
+        if (frameAssembler[i] != nullptr) {
+            frameAssembler[i]->stats.rowsLost.reset();
+            frameAssembler[i]->stats.pixelsLost.reset();
+            frameAssembler[i]->stats.kernelDrops.reset();
+        }
+    }
+    packetMmapDrops.reset();
+}
+
+/**
+ * @brief Drain up to maxPackets datagrams from the socket of one chip with a
+ * single recvmmsg() call, into the current targets of that chip's batch.
+ * @return The number of packets received, 0 if the socket was empty or -1 on error
+ */
+int UdpReceiver::receiveBatch(int chipIndex, int maxPackets) {
+    batch_t &b = batches[chipIndex];
+    int n = recvmmsg(peers[chipIndex].fd, b.msgs, unsigned(maxPackets), MSG_DONTWAIT, nullptr);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            spdlog::get("console")->error("recvmmsg, chip {}: {}", chipIndex, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    uint64_t now = monotonic_ns(); //! One clock read per batch
+    uint64_t bytes = 0;
+    for (int k = 0; k < n; ++k) {
+        b.targets[k]->chipIndex = chipIndex;
+        b.targets[k]->size = long(b.msgs[k].msg_len);
+        b.targets[k]->timestamp_ns = now;
+        bytes += b.msgs[k].msg_len;
+        captured(*b.targets[k]);
+    }
+    if (n > 0 && b.controls != nullptr) {
+        if (time_wake[chipIndex]) {
+            wokeUp(chipIndex, b.msgs[0].msg_hdr); //! The oldest
+        }
+        //! The count is cumulative, the newest datagram carries the latest
+        kernelDropped(chipIndex, b.msgs[n - 1].msg_hdr);
+        for (int k = 0; k < n; ++k) {
+            b.msgs[k].msg_hdr.msg_controllen = control_size; //! Shrunk by the kernel
+        }
+    }
+    ChipStatistics &s = frameAssembler[chipIndex]->stats;
+    s.packets.add(uint64_t(n));
+    s.bytes.add(bytes);
+    return n;
+}
+
+/**
+ * @brief Drain up to batch_size UDP_GRO buffers of one chip with a single
+ * recvmmsg() and decode them where they lie. The kernel coalesces a run of
+ * datagrams of one size into a buffer and reports that size; every segment
+ * of it is one datagram, the last one possibly shorter, and starts 8-byte
+ * aligned as SPIDR datagrams are whole 64-bit words.
+ * @return The number of datagrams decoded
+ */
+int UdpReceiver::receiveCoalesced(int chipIndex) {
+    batch_t &b = batches[chipIndex];
+    int n = recvmmsg(peers[chipIndex].fd, b.msgs, unsigned(batch_size), MSG_DONTWAIT, nullptr);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            spdlog::get("console")->error("recvmmsg, chip {}: {}", chipIndex, strerror(errno));
+        }
+        return 0;
+    }
+    uint64_t now = monotonic_ns(); //! One clock read per batch
+    FrameAssembler *assembler = frameAssembler[chipIndex];
+    if (n > 0 && time_wake[chipIndex]) {
+        wokeUp(chipIndex, b.msgs[0].msg_hdr);
+    }
+    int datagrams = 0;
+    for (int k = 0; k < n; ++k) {
+        struct msghdr &msg = b.msgs[k].msg_hdr;
+        long size = long(b.msgs[k].msg_len);
+        long segment = size; //! No cmsg: a single datagram
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+                int gso_size;
+                std::memcpy(&gso_size, CMSG_DATA(c), sizeof(gso_size));
+                segment = gso_size > 0 ? gso_size : size;
+            }
+        }
+        //! The kernel counts a dropped buffer as one drop, however many
+        //! datagrams it held
+        if (socket_tuning.rxq_ovfl) {
+            kernelDropped(chipIndex, msg);
+        }
+        msg.msg_controllen = gro_control_size; //! Shrunk by the kernel
+
+        char *data = b.coalesced + size_t(k) * max_coalesced_size;
+        for (long offset = 0; offset < size; offset += segment) {
+            long length = size - offset < segment ? size - offset : segment;
+            received(chipIndex, length);
+            if (capture != nullptr) {
+                capture->write(chipIndex, data + offset, length, now);
+            }
+            assembler->onPacket(data + offset, length, now);
+            datagrams++;
+        }
+    }
+    return datagrams;
+}
+
+/**
+ * @brief Receive straight into the free slots of a chip's ring and publish
+ * them to the assembler thread. When the ring is full the datagram is still
+ * read, so the socket buffer keeps draining, and counted as an overflow.
+ * @return The number of packets published
+ */
+int UdpReceiver::receiveIntoRing(int chipIndex) {
+    PacketRing *ring = rings[chipIndex];
+    int room = int(ring->freeSlots());
+    if (room == 0) {
+        long received_size = receiveOne(chipIndex, inputQueues[chipIndex].data);
+        if (received_size >= 0) {
+            received(chipIndex, received_size);
+            ring->overflows++;
+        }
+        return 0;
+    }
+
+    if (batch_size > 1) {
+        batch_t &b = batches[chipIndex];
+        int n = room < batch_size ? room : batch_size;
+        for (int k = 0; k < n; ++k) {
+            b.targets[k] = ring->writeSlot(unsigned(k));
+            b.iovecs[k].iov_base = b.targets[k]->data;
+        }
+        n = receiveBatch(chipIndex, n);
+        if (n > 0) {
+            ring->publish(unsigned(n));
+        }
+        return n;
+    }
+
+    PacketContainer *pc = ring->writeSlot();
+    long received_size = receiveOne(chipIndex, pc->data);
+    if (received_size < 0) {
+        return 0;
+    }
+    pc->chipIndex = chipIndex;
+    pc->size = received_size;
+    pc->timestamp_ns = monotonic_ns();
+    received(chipIndex, received_size);
+    captured(*pc);
+    ring->publish();
+    return 1;
+}
+
 int UdpReceiver::set_scheduler() {
     int policy;
     struct sched_param sp = {.sched_priority = 99};
@@ -178,7 +922,7 @@ int UdpReceiver::print_affinity() {
 }
 
 // ! http://man7.org/linux/man-pages/man3/CPU_SET.3.html
-int UdpReceiver::set_cpu_affinity() {
+int UdpReceiver::set_cpu_affinity(int cpu) {
     cpu_set_t set; /* Define your cpu_set
                   bit mask. */
     int ret;
@@ -186,7 +930,7 @@ int UdpReceiver::set_cpu_affinity() {
 
     CPU_ZERO(&set);   /* Clears set, so that it
                      contains no CPUs */
-    CPU_SET(0, &set); /* Add CPU cpu to set */
+    CPU_SET(cpu, &set); /* Add CPU cpu to set */
     // CPU_CLR(1, &set);                               /* Remove CPU cpu from set
     // */
     ret = sched_setaffinity(0, sizeof(cpu_set_t), &set); /* Set affinity of this
@@ -208,6 +952,21 @@ int UdpReceiver::set_cpu_affinity() {
     return 0;
 }
 
+/**
+ * @brief Prefer allocations of the calling thread on one NUMA node.
+ * Uses the raw syscall so we do not need to link libnuma.
+ */
+int UdpReceiver::set_memory_node(int node) {
+    unsigned long nodemask = 1UL << node;
+    long ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8);
+
+    if (ret == -1) {
+        spdlog::get("console")->error("Set_mempolicy, node {}: {}", node, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 unsigned int UdpReceiver::inet_addr(const char *str) {
     int a, b, c, d;
     char arr[4];
@@ -252,6 +1011,8 @@ bool UdpReceiver::initFileDescriptorsAndBindToPorts(int UDP_Port) {
             return false;
         }
 
+        tuneSocket(fd, i);
+
         listen_address.sin_port = htons(UDP_Port + i);
 
         int ret = bind(fd, (struct sockaddr *)&listen_address,
@@ -275,3 +1036,144 @@ bool UdpReceiver::initFileDescriptorsAndBindToPorts(int UDP_Port) {
     }
     return true;
 }
+
+/**
+ * @brief Open the PACKET_MMAP ring for the chip ports. The UDP sockets stay
+ * bound, so the host does not answer with ICMP port unreachable, but get a
+ * minimal buffer as nobody reads them.
+ * @return false to fall back to the sockets
+ */
+bool UdpReceiver::initPacketMmap(int UDP_Port) {
+    packetMmap = new PacketMmapRing(packet_mmap_blocks, packet_mmap_block_kib * 1024);
+    if (!packetMmap->open(packet_mmap_interface, UDP_Port, config.number_of_chips)) {
+        spdlog::get("console")->warn("No packet ring ({}), receiving on the sockets", strerror(errno));
+        delete packetMmap;
+        packetMmap = nullptr;
+        return false;
+    }
+    int minimal = 0;
+    for (int i = 0; i < config.number_of_chips; ++i) {
+        setsockopt(peers[i].fd, SOL_SOCKET, SO_RCVBUF, &minimal, sizeof(minimal));
+    }
+    if (per_chip_threads || assembler_threads > 0) {
+        spdlog::get("console")->info("The packet ring decodes on the run() thread");
+        per_chip_threads = false;
+        assembler_threads = 0;
+    }
+    spdlog::get("console")->info("Receiving through a {} x {} KiB packet ring on {}", packet_mmap_blocks,
+                                 packet_mmap_block_kib, packet_mmap_interface.empty() ? "all interfaces" : packet_mmap_interface);
+    return true;
+}
+
+/**
+ * @brief Arm the multishot receives on the bound chip sockets.
+ * @return false to fall back to epoll and recv()
+ */
+bool UdpReceiver::initIoUring() {
+    int fds[Config::number_of_chips];
+    for (int i = 0; i < config.number_of_chips; ++i) {
+        fds[i] = peers[i].fd;
+    }
+    //! Room for the recvmsg header and a cmsg in front of a full datagram
+    uring = new PacketUring(io_uring_buffers, max_packet_size + 216);
+    if (!uring->open(fds, config.number_of_chips, socket_tuning.rxq_ovfl)) {
+        spdlog::get("console")->warn("No io_uring receive ({}), using epoll", strerror(errno));
+        delete uring;
+        uring = nullptr;
+        return false;
+    }
+    if (per_chip_threads || assembler_threads > 0) {
+        spdlog::get("console")->info("io_uring decodes on the run() thread");
+        per_chip_threads = false;
+        assembler_threads = 0;
+    }
+    spdlog::get("console")->info("Receiving through io_uring, {} provided buffers", io_uring_buffers);
+    return true;
+}
+
+//! Applies socket_tuning; a setting the kernel refuses is logged and skipped
+void UdpReceiver::tuneSocket(int fd, int chipIndex) {
+    const socket_tuning_t &t = socket_tuning;
+    if (t.rcvbuf > 0) {
+        //! FORCE ignores net.core.rmem_max but needs CAP_NET_ADMIN
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &t.rcvbuf, sizeof(t.rcvbuf)) != 0 &&
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &t.rcvbuf, sizeof(t.rcvbuf)) != 0) {
+            spdlog::get("console")->error("SO_RCVBUF, chip {}: {}", chipIndex, strerror(errno));
+        }
+        int actual = 0;
+        socklen_t len = sizeof(actual);
+        getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual, &len);
+        actual /= 2; //! The kernel reports twice the size, with its bookkeeping
+        if (actual < t.rcvbuf) {
+            spdlog::get("console")->warn("Chip {} receive buffer {} KiB instead of {} KiB, raise net.core.rmem_max",
+                                         chipIndex, actual / 1024, t.rcvbuf / 1024);
+        } else if (chipIndex == 0) {
+            spdlog::get("console")->info("Socket receive buffers {} KiB", actual / 1024);
+        }
+    }
+    if (t.busy_poll_us > 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &t.busy_poll_us, sizeof(t.busy_poll_us)) != 0) {
+        spdlog::get("console")->warn("SO_BUSY_POLL {} us, chip {}: {}", t.busy_poll_us, chipIndex, strerror(errno));
+    }
+    if (t.priority >= 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &t.priority, sizeof(t.priority)) != 0) {
+        spdlog::get("console")->warn("SO_PRIORITY {}, chip {}: {}", t.priority, chipIndex, strerror(errno));
+    }
+    int one = 1;
+    if (t.rxq_ovfl && setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0) {
+        spdlog::get("console")->warn("SO_RXQ_OVFL, chip {}: {}", chipIndex, strerror(errno));
+    }
+    //! Before Linux 5.0 the datagrams just keep coming one by one
+    if (t.udp_gro && setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) != 0) {
+        spdlog::get("console")->warn("UDP_GRO, chip {}: {}", chipIndex, strerror(errno));
+    }
+}
+
+bool UdpReceiver::initBatches() {
+    for (int i = 0; i < config.number_of_chips; i++) {
+        initBatch(i);
+    }
+    if (socket_tuning.udp_gro) {
+        spdlog::get("console")->info("Receiving up to {} UDP GRO buffers per socket per poll", batch_size);
+    } else {
+        spdlog::get("console")->info("Receiving up to {} packets per socket per poll", batch_size);
+    }
+    return true;
+}
+
+//! Allocates on the calling thread, so a pinned chip worker gets its receive
+//! buffers on its own NUMA node by first touch.
+void UdpReceiver::initBatch(int chipIndex) {
+    batch_t &b = batches[chipIndex];
+    bool gro = socket_tuning.udp_gro;
+    if (gro) {
+        b.coalesced = new char[size_t(max_coalesced_size) * size_t(batch_size)];
+    } else if (rings[chipIndex] == nullptr) {
+        //! With a ring the datagrams land in ring slots instead
+        b.packets = new PacketContainer[batch_size];
+    }
+    b.targets = new PacketContainer*[batch_size];
+    b.iovecs = new struct iovec[batch_size];
+    b.msgs = new struct mmsghdr[batch_size];
+    std::memset(b.msgs, 0, sizeof(struct mmsghdr) * size_t(batch_size));
+    size_t controlSize = gro ? gro_control_size : control_size;
+    if (socket_tuning.rxq_ovfl || wake_timestamps || gro) {
+        b.controls = new char[controlSize * size_t(batch_size)];
+    }
+    for (int k = 0; k < batch_size; k++) {
+        b.targets[k] = b.packets == nullptr ? nullptr : &b.packets[k];
+        if (gro) {
+            b.iovecs[k].iov_base = b.coalesced + size_t(k) * max_coalesced_size;
+            b.iovecs[k].iov_len = max_coalesced_size;
+        } else {
+            b.iovecs[k].iov_base = b.packets == nullptr ? nullptr : b.packets[k].data;
+            b.iovecs[k].iov_len = max_packet_size;
+        }
+        b.msgs[k].msg_hdr.msg_iov = &b.iovecs[k];
+        b.msgs[k].msg_hdr.msg_iovlen = 1;
+        if (b.controls != nullptr) {
+            b.msgs[k].msg_hdr.msg_control = b.controls + size_t(k) * controlSize;
+            b.msgs[k].msg_hdr.msg_controllen = controlSize;
+        }
+    }
+}
@@ -2,21 +2,34 @@
 #define UDPRECEIVER_H
 
 #include <arpa/inet.h>
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <math.h> /* ceil */
+#include <linux/mempolicy.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <stdio.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
 #include "FrameAssembler.h"
+#include "LatencyHistogram.h"
+#include "PacketCapture.h"
 #include "PacketContainer.h"
+#include "PacketMmapRing.h"
+#include "PacketRing.h"
+#include "PacketUring.h"
+#include "Statistics.h"
+#include "StatsExporter.h"
 #include "configs.h"
 
 
@@ -33,12 +46,58 @@ struct peer_t {
     int chipIndex;
 };
 
+//! Pre-allocated recvmmsg() state for one chip: one PacketContainer,
+//! iovec and mmsghdr per datagram that may be drained in a single call.
+//! targets[k] is where datagram k lands, either packets[k] or a ring slot.
+//! With UDP_GRO the kernel fills coalesced[k] with up to 64 KiB of datagrams
+//! of one size instead.
+struct batch_t {
+    PacketContainer *packets = nullptr;
+    PacketContainer **targets = nullptr;
+    char *coalesced = nullptr;
+    struct iovec *iovecs = nullptr;
+    struct mmsghdr *msgs = nullptr;
+    char *controls = nullptr;  //! SO_RXQ_OVFL, SO_TIMESTAMPNS (and UDP_GRO) cmsg space per datagram
+};
+
+//! Options applied to every chip socket, see UdpReceiver::setSocketTuning()
+struct socket_tuning_t {
+    int rcvbuf = 0;        //! SO_RCVBUF(FORCE) [bytes], 0 = kernel default
+    int busy_poll_us = 0;  //! SO_BUSY_POLL, 0 = off
+    int priority = -1;     //! SO_PRIORITY, -1 = leave as is
+    bool rxq_ovfl = true;  //! Count kernel drops with SO_RXQ_OVFL
+    bool udp_gro = false;  //! UDP_GRO, receive runs of datagrams in one buffer
+};
+
+//! Receive loop without epoll, see UdpReceiver::setBusyPoll()
+struct busy_poll_t {
+    bool enable = false;
+    unsigned spin_us = 50;  //! Idle spin before parking in epoll_wait(), 0 = never park
+    int cpu = -1;           //! Core of the receive loop, -1 = the initThread() one
+};
+
+//! Where a chip worker runs, -1 means "don't care".
+struct placement_t {
+    int cpu = -1;
+    int numaNode = -1;
+    int policy = SCHED_OTHER; //! Not the receiver's SCHED_FIFO 99
+    int priority = 0;
+};
+
 class UdpReceiver {
 
 public:
   UdpReceiver(bool lutBug); //! TODO add parent pointer
   virtual ~UdpReceiver();
   bool initThread(const char *ipaddr="", int UDP_Port=8192);
+  //! Where run() gets the datagrams from
+  enum Backend {
+      SOCKETS,      //! One UDP socket per chip, epoll and recv()/recvmmsg()
+      PACKET_MMAP,  //! AF_PACKET TPACKET_V3 ring, decoded in place; needs
+                    //! CAP_NET_RAW, falls back to SOCKETS without it
+      IO_URING      //! Multishot recvmsg() into provided buffers, decoded in
+                    //! place; falls back to SOCKETS before Linux 6.0
+  };
   void run();
   std::thread spawn() {
       return std::thread(&UdpReceiver::run, this);
@@ -46,31 +105,155 @@ public:
 
   int set_scheduler();
   int print_affinity();
-  int set_cpu_affinity();
+  int set_cpu_affinity(int cpu = 0);
+  int set_memory_node(int node);
 
   void setPollTimeout(int timeout) { timeout_us = timeout; }
+  //! Number of datagrams drained per socket per epoll wake-up using
+  //! recvmmsg(). 1 keeps the plain recv() path. Call before initThread().
+  void setBatchSize(int size);
+  int getBatchSize() { return batch_size; }
+  //! Number of threads decoding packets from per-chip SPSC rings.
+  //! 0 decodes inline on the receiver thread. Call before initThread().
+  void setAssemblerThreads(int n);
+  //! CPU and scheduling of assembler thread t. By default it runs on cpu
+  //! 1 + t (modulo the other cores), off the receiver's cpu 0, under
+  //! SCHED_OTHER.
+  void setAssemblerPlacement(int threadIndex, int cpu, int policy = SCHED_OTHER, int priority = 0);
+  void setRingDepth(unsigned depth) { ring_depth = depth; }
+  //! Give every chip its own worker thread owning its socket and
+  //! FrameAssembler, instead of one thread polling all sockets.
+  void setPerChipThreads(bool enable) { per_chip_threads = enable; }
+  //! CPU, NUMA node and scheduling of a chip worker. By default chip i runs
+  //! on cpu 1 + i (modulo the other cores), off the receiver's cpu 0, under
+  //! SCHED_OTHER.
+  void setChipPlacement(int chipIndex, int cpu, int numaNode = -1,
+                        int policy = SCHED_OTHER, int priority = 0);
+  //! Depth of the FrameSet ring and where its ChipFrames live: on 2 MiB
+  //! huge pages and/or bound to a NUMA node (-1 = any), faulted in up front
+  //! or on first use. Call before initThread().
+  void setFrameSetStorage(unsigned depth, bool hugePages = false, int numaNode = -1,
+                          bool prefault = false);
+  //! What to do when the consumer falls a full FrameSet ring behind
+  void setBackpressure(FrameSetManager::Backpressure policy, unsigned timeout_us = 0);
+  //! Receive buffer, busy polling, priority, drop accounting and GRO of
+  //! the chip sockets. Call before initThread().
+  void setSocketTuning(const socket_tuning_t &tuning) { socket_tuning = tuning; }
+  //! Receive buffer [bytes] holding @param ms of chip frames at
+  //! @param rate_hz with @param pixel_depth bit counters
+  static int socketBufferSize(int rate_hz, int pixel_depth, int ms);
+  //! Append every datagram handed to the decoders to a capture file
+  bool setCapture(const std::string &filename);
+  //! Decode a capture file instead of listening on the sockets, as fast as
+  //! possible or at the recorded pace. run() returns at the end of the file.
+  bool setReplay(const std::string &filename, bool paced = false);
+  //! Call before initThread()
+  void setBackend(Backend backend) { this->backend = backend; }
+  Backend getBackend() { return backend; }
+  //! PACKET_MMAP ring on @param interface ("" = all) of @param blocks
+  //! blocks of @param blockKiB
+  void setPacketMmap(const std::string &interface, unsigned blocks = 64, unsigned blockKiB = 1024);
+  //! Spin over the non-blocking chip sockets instead of sleeping in
+  //! epoll_wait(), SOCKETS backend only. Call before initThread().
+  void setBusyPoll(const busy_poll_t &settings) { busy_poll = settings; }
+  bool isBusyPolling() { return busy_poll.enable; }
+  //! Provided buffers of the IO_URING backend, a power of two
+  void setIoUringBuffers(unsigned buffers) { io_uring_buffers = buffers; }
+  //! Serve the statistics in Prometheus text format on a localhost TCP
+  //! port and/or a Unix socket (0 / "" = off). After initThread() it
+  //! restarts the exporter on the new endpoints.
+  void setStatsExport(int tcpPort, const std::string &unixPath = "");
 
   bool isFinished() { return finished; }
 
   constexpr static int max_packet_size = 9000;
+  constexpr static int max_batch_size = 64;
+  constexpr static int max_coalesced_size = 65536; //! A UDP_GRO buffer
   // constexpr static int max_buffer_size =
   //    (11 * max_packet_size) +
   //    7560; //! [bytes] You can check this on Wireshark,
   //          //! by triggering 1 frame readout
 
-  uint64_t packets = 0, frames = 0;
+  //! Counters of one chip, or the sum over all chips for -1. Lock-free,
+  //! may be called at any time during acquisition.
+  StatisticsSnapshot statistics(int chipIndex = -1);
+  uint64_t packetsReceived() { return statistics().packets; }
+  //! Restart the lost row, pixel and drop counts; from any thread, also
+  //! while the chips are being decoded
+  void resetLostCounts();
+  uint64_t frames = 0;
 
   FrameSetManager *getFrameSetManager() { return fsm; }
   uint64_t last_frame_number = 0;
 
+  //! Kernel arrival to pick-up of the first datagram of each socket after
+  //! an idle spell (an epoll wake-up, an empty sweep or a park), SOCKETS
+  //! backend only
+  LatencyHistogram wakeLatency;
+  //! Decode time per chip frame of a chip, nullptr before initThread()
+  const LatencyHistogram *decodeTime(int chipIndex);
+  Counter parks;  //! Times the busy-poll loop parked in epoll_wait()
+
 private:
   unsigned int inet_addr(const char *str);
   bool initSocket(const char *inetIPAddr = "");
   bool initFileDescriptorsAndBindToPorts(int UDP_Port);
+  void tuneSocket(int fd, int chipIndex);
+  bool initPacketMmap(int UDP_Port);
+  bool initIoUring();
+  bool initBatches();
+  void startStatsExport();
+  void initBatch(int chipIndex);
+  int receiveBatch(int chipIndex, int maxPackets);
+  int receiveCoalesced(int chipIndex);
+  int receiveIntoRing(int chipIndex);
+  void assemble(int threadIndex);
+  int applyPlacement(const placement_t &place, int index);
+  void runChip(int chipIndex);
+  void runEpoll();
+  void runBusyPoll();
+  int receiveChip(int chipIndex);
+  void runReplay();
+  void runPacketMmap();
+  void runIoUring();
+  void received(int chipIndex, long size);
+  long receiveOne(int chipIndex, char *data);
+  void kernelDropped(int chipIndex, struct msghdr &msg);
+  void wokeUp(int chipIndex, struct msghdr &msg);
+  void captured(const PacketContainer &pc) {
+      if (capture != nullptr) capture->write(pc);
+  }
 
   int timeout_us = 10000;
+  int batch_size = 1;
+  int assembler_threads = 0;
+  unsigned ring_depth = 1024;
+  bool per_chip_threads = false;
+  placement_t placements[Config::number_of_chips];
+  placement_t assemblerPlacements[Config::number_of_chips];
+  unsigned frame_set_depth = 1024;
+  bool frame_set_huge_pages = false;
+  int frame_set_numa_node = -1;
+  bool frame_set_prefault = false;
+  FrameSetManager::Backpressure backpressure = FrameSetManager::DROP_NEWEST;
+  unsigned backpressure_timeout_us = 0;
+  socket_tuning_t socket_tuning;
+  Backend backend = SOCKETS;
+  std::string packet_mmap_interface;
+  unsigned packet_mmap_blocks = 64;
+  unsigned packet_mmap_block_kib = 1024;
+  PacketMmapRing *packetMmap = nullptr;
+  Counter packetMmapDrops;  //! Frames dropped on the full PACKET_MMAP ring, of no one chip
+  unsigned io_uring_buffers = 2048;
+  PacketUring *uring = nullptr;
+  //! Last SO_RXQ_OVFL count seen per chip, the kernel's is cumulative
+  uint32_t kernel_drops[Config::number_of_chips] = {};
+  busy_poll_t busy_poll;
+  bool wake_timestamps = false;  //! SO_TIMESTAMPNS on the chip sockets
+  //! Time the next datagram of a chip, see wakeLatency
+  bool time_wake[Config::number_of_chips] = {};
 
-  bool finished = false;
+  std::atomic_bool finished{false};
 
   Config config;
   NetworkSettings networkSettings;
@@ -80,8 +263,16 @@ private:
   peer_t peers[Config::number_of_chips];
 
   bool lutBug = false;
-  FrameSetManager *fsm = new FrameSetManager();
+  PacketCapture *capture = nullptr;
+  PacketReplay *replay = nullptr;
+  bool replay_paced = false;
+  int stats_port = 0;
+  std::string stats_socket;
+  StatsExporter *exporter = nullptr;
+  FrameSetManager *fsm = nullptr;
   PacketContainer inputQueues[Config::number_of_chips];
-  FrameAssembler *frameAssembler[Config::number_of_chips];
+  batch_t batches[Config::number_of_chips];
+  PacketRing *rings[Config::number_of_chips] = {};
+  FrameAssembler *frameAssembler[Config::number_of_chips] = {};
 };
 #endif // UDPRECEIVER_H
@@ -1,6 +1,7 @@
 #ifndef CONFIGS_H
 #define CONFIGS_H
 
+#include <sched.h>
 #include <stdint.h>
 #include <string>
 
@@ -14,6 +15,47 @@ struct Config{
     const int nr_of_triggers = 10000;
     const int continuousRW_frequency = 2000; //! [Hz]
     const bool readoutMode_sequential = false;
+    const int pixel_depth = 12;       //! Counter bits
+
+    const int recv_batch_size = 16;   //! Datagrams per recvmmsg(), 1 = recv()
+    const int assembler_threads = 1;  //! Decode threads behind the packet rings,
+                                      //! 0 = decode on the receiver thread
+    const int assembler_sched_policy = SCHED_OTHER; //! Of the assembler threads, not inherited
+    const int assembler_sched_priority = 0;         //! 1..99 for SCHED_FIFO / SCHED_RR
+    const unsigned packet_ring_depth = 1024; //! Packets per chip ring
+    const bool per_chip_threads = false; //! One receive+decode thread per chip
+    const int chip_cpus[number_of_chips] = {-1, -1, -1, -1}; //! -1 = any core but 0,
+                                                              //! which the receiver holds
+    const int chip_sched_policy = SCHED_OTHER;  //! Of the chip workers, not inherited
+    const int chip_sched_priority = 0;          //! 1..99 for SCHED_FIFO / SCHED_RR
+    const int chip_numa_nodes[number_of_chips] = {-1, -1, -1, -1}; //! -1 = any
+    const unsigned frame_set_ring_depth = 1024; //! FrameSets between decoders and consumer
+    const bool frame_set_huge_pages = false;    //! ChipFrames on 2 MiB pages
+    const int frame_set_numa_node = -1;         //! Node of the NIC, -1 = any
+    const bool frame_set_prefault = false;      //! Fault all ChipFrames in at start-up
+                                                //! instead of on first use
+    const int backpressure = 0;                 //! Full FrameSet ring: 0 = drop newest,
+                                                //! 1 = drop oldest, 2 = block
+    const unsigned backpressure_timeout_us = 1000; //! Longest a chip blocks
+    const int socket_buffer_ms = 50;            //! Receive buffer per socket, in ms of frames
+                                                //! at continuousRW_frequency
+    const int socket_busy_poll_us = 0;          //! SO_BUSY_POLL, 0 = off
+    const int socket_priority = -1;             //! SO_PRIORITY, -1 = default
+    const bool socket_drop_accounting = true;   //! Count kernel drops, SO_RXQ_OVFL
+    const bool socket_udp_gro = false;          //! Coalesced receive, sockets backend
+                                                //! without assembler threads only
+    const bool busy_poll = false;               //! Spin over the sockets instead of epoll
+    const unsigned busy_poll_spin_us = 50;      //! Idle spin before sleeping, 0 = never
+                                                //! (needs an isolated core)
+    const int busy_poll_cpu = -1;               //! Core of the spinning thread, -1 = as is
+    const int receive_backend = 0;              //! 0 = sockets, 1 = AF_PACKET ring,
+                                                //! 2 = io_uring
+    const std::string packet_mmap_interface = ""; //! NIC of the SPIDR link, "" = all
+    const unsigned packet_mmap_blocks = 64;     //! Packet ring of 64 x 1 MiB blocks
+    const unsigned packet_mmap_block_kib = 1024;
+    const unsigned io_uring_buffers = 2048;     //! Provided receive buffers, a power of two
+    const int stats_port = 0;                   //! Prometheus text on 127.0.0.1, 0 = off
+    const std::string stats_socket = "";        //! ... and/or on this Unix socket
 
     int trig_freq_mhz = 0; //! Set this depending on readoutMode_sequential later
                            //! Yes, this really is [millihertz]
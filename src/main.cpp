@@ -97,7 +97,7 @@ bool initDetector(SpidrController *spidrcontrol, Config config) {
     spidrcontrol->setCsmSpm(i, 0);      /* Single pixel mode */
     spidrcontrol->setPolarity(i, true); /* Use Positive polarity */
     spidrcontrol->setGainMode(i, 1);    /* HGM */
-    spidrcontrol->setPixelDepth(i, 12, false, false); /* 12 bit, single frame readout */
+    spidrcontrol->setPixelDepth(i, config.pixel_depth, false, false); /* Single frame readout */
     spidrcontrol->setColourMode(i, false); /* Fine pitch mode */
   }
   spidrcontrol->resetCounters();
@@ -183,6 +183,58 @@ void stopTrigger(SpidrController *spidrcontrol, bool readoutMode_sequential) {
   }
 }
 
+void configureReceiver(UdpReceiver *udpReceiver, Config &config) {
+  udpReceiver->setPollTimeout(config.timeout_us); /* [microseconds] */
+  udpReceiver->setBatchSize(config.recv_batch_size);
+  udpReceiver->setAssemblerThreads(config.assembler_threads);
+  for (int t = 0; t < config.assembler_threads; t++) {
+    udpReceiver->setAssemblerPlacement(t, -1, config.assembler_sched_policy, config.assembler_sched_priority);
+  }
+  udpReceiver->setRingDepth(config.packet_ring_depth);
+  udpReceiver->setPerChipThreads(config.per_chip_threads);
+  for (int i = 0; i < config.number_of_chips; i++) {
+    udpReceiver->setChipPlacement(i, config.chip_cpus[i], config.chip_numa_nodes[i],
+                                  config.chip_sched_policy, config.chip_sched_priority);
+  }
+  udpReceiver->setFrameSetStorage(config.frame_set_ring_depth, config.frame_set_huge_pages,
+                                  config.frame_set_numa_node, config.frame_set_prefault);
+  udpReceiver->setBackpressure(FrameSetManager::Backpressure(config.backpressure),
+                               config.backpressure_timeout_us);
+  socket_tuning_t tuning;
+  tuning.rcvbuf = UdpReceiver::socketBufferSize(config.continuousRW_frequency, config.pixel_depth,
+                                                config.socket_buffer_ms);
+  tuning.busy_poll_us = config.socket_busy_poll_us;
+  tuning.priority = config.socket_priority;
+  tuning.rxq_ovfl = config.socket_drop_accounting;
+  tuning.udp_gro = config.socket_udp_gro;
+  udpReceiver->setSocketTuning(tuning);
+  busy_poll_t busyPoll;
+  busyPoll.enable = config.busy_poll;
+  busyPoll.spin_us = config.busy_poll_spin_us;
+  busyPoll.cpu = config.busy_poll_cpu;
+  udpReceiver->setBusyPoll(busyPoll);
+  udpReceiver->setBackend(UdpReceiver::Backend(config.receive_backend));
+  udpReceiver->setPacketMmap(config.packet_mmap_interface, config.packet_mmap_blocks,
+                             config.packet_mmap_block_kib);
+  udpReceiver->setIoUringBuffers(config.io_uring_buffers);
+  udpReceiver->setStatsExport(config.stats_port, config.stats_socket);
+}
+
+/* Decode a packet capture without a detector: replay <file> [paced] */
+int replayCapture(const char *filename, bool paced, Config &config) {
+  UdpReceiver *udpReceiver = new UdpReceiver(false);
+  configureReceiver(udpReceiver, config);
+  if (!udpReceiver->setReplay(filename, paced) || !udpReceiver->initThread()) {
+      return -1;
+  }
+  udpReceiver->run();
+  FrameSetManager *frameSetManager = udpReceiver->getFrameSetManager();
+  spdlog::get("console")->info("Frames {}, lost {}", frameSetManager->_framesReceived,
+                               frameSetManager->_framesLost);
+  delete udpReceiver;
+  return 0;
+}
+
 /**
  * @brief main, initialise the testDriver class and run
  * @return 0
@@ -203,6 +255,10 @@ int main(int argc, char * argv[]) {
   spdlog::get("console")->set_level(spdlog::level::debug);
   spdlog::get("console")->info("[INIT]");
 
+  if (mode == "replay" && argc > 2) {
+      return replayCapture(argv[2], argc > 3 && std::string(argv[3]) == "paced", config);
+  }
+
   /* Exit now if you cannot connect to the SPIDR*/
   spidrcontrol = initSpidrController(spidrcontrol, networkSettings.socketIPAddr, networkSettings.TCPPort);
   if (spidrcontrol == nullptr) {
@@ -236,7 +292,10 @@ int main(int argc, char * argv[]) {
   std::thread th;
   updateTimeout_us(config);
 
-  udpReceiver->setPollTimeout(config.timeout_us); /* [microseconds] */
+  configureReceiver(udpReceiver, config);
+  if (mode == "capture" && argc > 2) {
+      udpReceiver->setCapture(argv[2]);
+  }
 
   if (udpReceiver->initThread("", networkSettings.portno)) {
       th = udpReceiver->spawn();
@@ -70,6 +70,16 @@ SOURCES += \
     ChipFrame.cpp \
     FrameSet.cpp \
     FrameSetManager.cpp \
+    PacketRing.cpp \
+    PixelUnpacker.cpp \
+    ChipFramePool.cpp \
+    DetectorLayout.cpp \
+    FrameRecorder.cpp \
+    LatencyHistogram.cpp \
+    PacketCapture.cpp \
+    PacketMmapRing.cpp \
+    PacketUring.cpp \
+    StatsExporter.cpp \
     main.cpp
 
 HEADERS += \
@@ -90,6 +100,19 @@ HEADERS += \
     OMR.h \
     ChipFrame.h \
     FrameSet.h \
-    FrameSetManager.h
+    FrameSetManager.h \
+    PacketRing.h \
+    PixelUnpacker.h \
+    Notifier.h \
+    ChipFramePool.h \
+    FrameSetView.h \
+    DetectorLayout.h \
+    FrameRecorder.h \
+    LatencyHistogram.h \
+    Statistics.h \
+    PacketCapture.h \
+    PacketMmapRing.h \
+    PacketUring.h \
+    StatsExporter.h
 
 CONFIG += static
@@ -1,6 +1,999 @@
-#include <iostream>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+#include "DetectorLayout.h"
+#include "FrameAssembler.h"
+#include "FrameRecorder.h"
+#include "FrameSetManager.h"
+#include "PacketCapture.h"
+#include "PixelUnpacker.h"
+#include "TrafficGenerator.h"
+
+/**
+ * Decode path tests: chip frames encoded as the SPIDR sends them
+ * (TrafficGenerator::encodeFrame()) go through FrameAssembler and the
+ * FrameSetManager, and the FrameSets that come out are checked against
+ * TrafficGenerator::pixel(). Exits non-zero when a check fails.
+ */
+
+constexpr static int packet_words = 1125; //! 9000 byte datagrams, as the SPIDR sends
+constexpr static unsigned fsm_depth = 64;
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } \
+} while (0)
+
+enum Loss { NO_LOSS, RANDOM_LOSS, PERIODIC_LOSS };
+static const char *lossNames[] = {"no loss", "1% random loss", "every 97th packet lost"};
+
+//! What came out of the FrameSetManager
+struct Result {
+    int sets = 0;
+    int setsLost = 0;
+    int incomplete = 0;   //! Sets with a chip frame missing
+    int checked = 0;      //! Chip frames without loss, compared pixel by pixel
+    int wrongPixels = 0;
+    int strayPixels = 0;  //! Pixels of chip frames with loss neither right nor 0
+    int idGaps = 0;       //! Frame ids missing between consecutive sets
+};
+
+//! A pixel of a chip frame with loss is right or, where lost, 0. Each half
+//! of a 24-bit counter counts on its own.
+static bool lossyPixelOk(int depth, uint32_t pixel, uint32_t expected) {
+    uint32_t halfMask = depth == 24 ? 0xfff : ~0u;
+    for (int shift = 0; shift < (depth == 24 ? 24 : 1); shift += 12) {
+        uint32_t p = (pixel >> shift) & halfMask, e = (expected >> shift) & halfMask;
+        if (p != 0 && p != e)
+            return false;
+    }
+    return true;
+}
+
+//! The counter the decoder should make of the generator's pixel
+static uint32_t expectedPixel(int depth, bool lut, int chipIndex, int row, int column) {
+    uint32_t v = TrafficGenerator::pixel(chipIndex, row, column);
+    if (depth != 24) {
+        v &= (1u << depth) - 1;
+        return lut ? FrameAssembler::lutValue(depth, uint16_t(v)) : v;
+    }
+    v &= 0xffffff;
+    if (!lut) return v;
+    return uint32_t(FrameAssembler::lutValue(12, uint16_t(v >> 12))) << 12
+            | FrameAssembler::lutValue(12, uint16_t(v & 0xfff));
+}
+
+static void takeSets(FrameSetManager *fsm, int depth, bool lut, Result &r, int &lastId) {
+    while (FrameSet *fs = fsm->getFrameSet()) {
+        r.sets++;
+        int id = fs->frameId.load();
+        if (lastId >= 0) {
+            r.idGaps += int(uint8_t(id - lastId)) - 1;
+        }
+        lastId = id;
+        for (int c = 0; c < number_of_chips; c++) {
+            ChipView v = fs->view(c);
+            if (!v.valid()) {
+                r.incomplete++;
+                continue;
+            }
+            if (v.pixelsLost != 0) {
+                for (int row = 0; row < MPX_PIXEL_ROWS; row++) {
+                    for (int col = 0; col < MPX_PIXEL_COLUMNS; col++) {
+                        if (!lossyPixelOk(depth, v.pixel(row, col), expectedPixel(depth, lut, c, row, col))) {
+                            r.strayPixels++;
+                        }
+                    }
+                }
+                continue;
+            }
+            r.checked++;
+            for (int row = 0; row < MPX_PIXEL_ROWS; row++) {
+                for (int col = 0; col < MPX_PIXEL_COLUMNS; col++) {
+                    if (v.pixel(row, col) != expectedPixel(depth, lut, c, row, col)) {
+                        r.wrongPixels++;
+                    }
+                }
+            }
+        }
+        fsm->releaseFrameSet(fs);
+    }
+}
+
+/**
+ * @brief Decode frames frames per chip, packets of the chips interleaved as
+ * they arrive from the SPIDR, each frame with its own id in the EOF word.
+ * Loss only hits the first frames; the last publish_lag + 1 frames are
+ * clean, so every set is either published or counted lost at the end.
+ *
+ * Frames with every pixel word inverted go first, so the pool frames hold
+ * other pixels than the pattern when they come round again.
+ */
+static Result decode(int depth, Loss loss, int frames, bool lut = false) {
+    int halves = depth == 24 ? 2 : 1;
+    std::vector<uint64_t> words[2][number_of_chips][2];
+    for (int c = 0; c < number_of_chips; c++) {
+        for (int h = 0; h < halves; h++) {
+            TrafficGenerator::encodeFrame(depth, c, h == 0 ? 0 : 4, words[0][c][h]);
+            words[1][c][h] = words[0][c][h];
+            for (uint64_t &w : words[1][c][h]) {
+                uint64_t type = w & PKT_TYPE_MASK;
+                if (type == PIXEL_DATA_SOF || type == PIXEL_DATA_SOR || type == PIXEL_DATA_MID)
+                    w ^= ~PKT_TYPE_MASK;
+            }
+        }
+    }
+    int packets = int((words[0][0][0].size() + packet_words - 1) / packet_words);
+
+    FrameAssembler::setLutDecode(lut);
+    FrameSetManager *fsm = new FrameSetManager(fsm_depth);
+    FrameAssembler *assemblers[number_of_chips];
+    for (int c = 0; c < number_of_chips; c++) {
+        assemblers[c] = new FrameAssembler(c);
+        assemblers[c]->setFrameSetManager(fsm);
+    }
+
+    Result r, inverted;
+    int lastId = -1, lastInvertedId = -1;
+    int poison = 16;
+    int total = frames + int(FrameSetManager::publish_lag) + 1;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    long n = 0;
+    PacketContainer pc;
+    for (int f = -poison; f < total; f++) {
+        std::vector<uint64_t> (&frame)[number_of_chips][2] = words[f < 0 ? 1 : 0];
+        uint16_t frameId = uint16_t(f + poison + 1);
+        for (int c = 0; c < number_of_chips; c++) {
+            for (int h = 0; h < halves; h++) {
+                uint64_t &eof = frame[c][h].back();
+                eof = (eof & ~FRAME_FLAGS_MASK) | (uint64_t(frameId) << FRAME_FLAGS_SHIFT);
+            }
+        }
+        for (int h = 0; h < halves; h++) {
+            for (int k = 0; k < packets; k++) {
+                for (int c = 0; c < number_of_chips; c++) {
+                    n++;
+                    if (f >= 0 && f < frames && ((loss == RANDOM_LOSS && uniform(rng) < 0.01)
+                                                 || (loss == PERIODIC_LOSS && n % 97 == 0))) {
+                        continue;
+                    }
+                    const std::vector<uint64_t> &w = frame[c][h];
+                    size_t first = size_t(k) * packet_words;
+                    size_t len = std::min(w.size() - first, size_t(packet_words));
+                    pc.chipIndex = c;
+                    pc.size = long(len * sizeof(uint64_t));
+                    pc.timestamp_ns = monotonic_ns();
+                    memcpy(pc.data, w.data() + first, size_t(pc.size));
+                    assemblers[c]->onEvent(pc);
+                }
+            }
+        }
+        if (f == -1) {
+            takeSets(fsm, depth, lut, inverted, lastInvertedId);
+        } else if (f >= 0) {
+            takeSets(fsm, depth, lut, r, lastId);
+        }
+    }
+    r.setsLost = fsm->_framesLost;
+
+    for (int c = 0; c < number_of_chips; c++) {
+        CHECK(assemblers[c]->decodeTime.count() == assemblers[c]->stats.framesDecoded.get(),
+              "chip %d: decode time of %d chip frames, %d decoded", c, int(assemblers[c]->decodeTime.count()),
+              int(assemblers[c]->stats.framesDecoded.get()));
+        delete assemblers[c];
+    }
+    delete fsm;
+    FrameAssembler::setLutDecode(false);
+    return r;
+}
+
+/**
+ * @brief Every frame decodes to the generator's pattern, with the scalar and
+ * the AVX2 unpackers, and through the look-up table for raw counters
+ */
+static void testRoundTrip() {
+    int frames = 20;
+    int total = frames + int(FrameSetManager::publish_lag) + 1;
+    for (bool simd : {false, true}) {
+        PixelUnpacker::init(simd);
+        for (int depth : {1, 6, 12, 24}) {
+            for (bool lut : {false, true}) {
+                if (lut && depth == 1) continue; //! No LUT for 1-bit counters
+                Result r = decode(depth, NO_LOSS, frames, lut);
+                CHECK(r.sets == total && r.setsLost == 0, "%d-bit, avx2 %d, lut %d: %d sets, %d lost of %d",
+                      depth, PixelUnpacker::usingAvx2(), lut, r.sets, r.setsLost, total);
+                CHECK(r.checked == total * number_of_chips && r.wrongPixels == 0,
+                      "%d-bit, avx2 %d, lut %d: %d of %d chip frames checked, %d wrong pixels",
+                      depth, PixelUnpacker::usingAvx2(), lut, r.checked, total * number_of_chips, r.wrongPixels);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Lost packets cost pixels, not sets: every frame comes out as one
+ * set with all chips in it, in order, or is counted lost
+ */
+static void testLoss() {
+    PixelUnpacker::init();
+    for (int depth : {1, 6, 12, 24}) {
+        for (Loss loss : {RANDOM_LOSS, PERIODIC_LOSS}) {
+            int frames = 300;
+            int total = frames + int(FrameSetManager::publish_lag) + 1;
+            Result r = decode(depth, loss, frames);
+            CHECK(r.sets + r.setsLost == total, "%d-bit, %s: %d sets + %d lost != %d frames",
+                  depth, lossNames[loss], r.sets, r.setsLost, total);
+            CHECK(r.idGaps == r.setsLost, "%d-bit, %s: %d frame ids skipped, %d sets counted lost",
+                  depth, lossNames[loss], r.idGaps, r.setsLost);
+            CHECK(r.incomplete == 0, "%d-bit, %s: %d chip frames missing from sets",
+                  depth, lossNames[loss], r.incomplete);
+            CHECK(r.wrongPixels == 0, "%d-bit, %s: %d wrong pixels in %d loss-free chip frames",
+                  depth, lossNames[loss], r.wrongPixels, r.checked);
+            CHECK(r.strayPixels == 0, "%d-bit, %s: %d stray pixels in chip frames with loss",
+                  depth, lossNames[loss], r.strayPixels);
+        }
+    }
+}
+
+/**
+ * @brief Chip threads and a consumer on a short ring at once, the chips
+ * losing frames so sets get force-published and, under DROP_OLDEST,
+ * evicting the tail under the consumer. Every set the consumer gets must be
+ * a claimed one, newer than the last, holding only frames of its own id.
+ * The full frame number rides in the pixels, the 8-bit id wraps too soon.
+ * The chips stay within a few frames of each other, as the SPIDR sends
+ * them: the 8-bit ids only line up chips less than 128 frames apart.
+ */
+static void testConcurrentRing() {
+    const int frames = 50000;
+    for (FrameSetManager::Backpressure policy : {FrameSetManager::DROP_NEWEST, FrameSetManager::DROP_OLDEST}) {
+        FrameSetManager *fsm = new FrameSetManager(8);
+        fsm->setBackpressure(policy);
+        std::atomic_int chipsRunning{number_of_chips};
+        std::atomic_int progress[number_of_chips] = {};
+        std::vector<std::thread> chips;
+        for (int c = 0; c < number_of_chips; c++) {
+            chips.emplace_back([fsm, c, &chipsRunning, &progress]() {
+                std::mt19937 rng(unsigned(c + 1));
+                std::uniform_int_distribution<int> percent(0, 99);
+                for (int id = 1; id <= frames; id++) {
+                    for (int other = 0; other < number_of_chips; other++) {
+                        while (progress[other].load() < id - 32) {
+                            std::this_thread::yield();
+                        }
+                    }
+                    progress[c].store(id);
+                    if (percent(rng) < 2) {
+                        continue; //! Lost on the way
+                    }
+                    ChipFrame *cf = fsm->newChipFrame(c);
+                    cf->frameId = uint8_t(id);
+                    cf->omr.setCountL(2);
+                    cf->omr.setMode(0);
+                    cf->getRow(0)[0] = uint16_t(c);
+                    cf->getRow(0)[1] = uint16_t(id);
+                    fsm->putChipFrame(c, cf);
+                    if (id % 64 == 0) {
+                        std::this_thread::yield(); //! Let the consumer in on a single core
+                    }
+                }
+                progress[c].store(frames + 32);
+                chipsRunning--;
+            });
+        }
+
+        int sets = 0, unclaimed = 0, outOfOrder = 0, foreign = 0, last = 0;
+        std::mt19937 rng(99);
+        std::uniform_int_distribution<int> percent(0, 99);
+        for (;;) {
+            bool running = chipsRunning > 0;
+            if (!fsm->wait(1)) {
+                if (!running) break;
+                continue;
+            }
+            FrameSet *fs = fsm->getFrameSet();
+            if (fs == nullptr) {
+                continue;
+            }
+            sets++;
+            int id = fs->frameId.load();
+            if (id < 0) {
+                unclaimed++;
+            }
+            int number = 0;
+            for (int c = 0; c < number_of_chips; c++) {
+                ChipView v = fs->view(c);
+                if (!v.valid()) {
+                    continue;
+                }
+                if (v.pixel(0, 0) != uint32_t(c) || (v.pixel(0, 1) & 0xff) != uint32_t(id & 0xff)
+                        || (number != 0 && int(v.pixel(0, 1)) != number)) {
+                    foreign++;
+                }
+                number = int(v.pixel(0, 1));
+            }
+            if (number != 0) {
+                if (number <= last) {
+                    outOfOrder++;
+                }
+                last = number;
+            }
+            if (percent(rng) < 5) {
+                std::this_thread::sleep_for(std::chrono::microseconds(50)); //! A slow consumer
+            }
+            fsm->releaseFrameSet(fs);
+        }
+        for (std::thread &t : chips) {
+            t.join();
+        }
+        CHECK(sets > 0, "policy %d: no sets delivered", policy);
+        CHECK(unclaimed == 0, "policy %d: %d sets without a frame id", policy, unclaimed);
+        CHECK(outOfOrder == 0, "policy %d: %d sets out of order", policy, outOfOrder);
+        CHECK(foreign == 0, "policy %d: %d chip frames in the wrong set", policy, foreign);
+        delete fsm;
+    }
+}
+
+//! Hand one 12-bit frame per chip to fsm, numbered in pixels (0, 0) and (0, 1)
+static void putNumberedSet(FrameSetManager *fsm, int number) {
+    for (int c = 0; c < number_of_chips; c++) {
+        ChipFrame *cf = fsm->newChipFrame(c);
+        cf->frameId = uint8_t(number);
+        cf->omr.setCountL(2);
+        cf->omr.setMode(0);
+        cf->getRow(0)[0] = uint16_t(c);
+        cf->getRow(0)[1] = uint16_t(number);
+        fsm->putChipFrame(c, cf);
+    }
+}
+
+//! The number of a set of putNumberedSet() frames, -1 if they disagree
+static int setNumber(FrameSet *fs) {
+    int number = int(fs->view(0).pixel(0, 1));
+    for (int c = 0; c < number_of_chips; c++) {
+        ChipView v = fs->view(c);
+        if (!v.valid() || v.pixel(0, 0) != uint32_t(c) || int(v.pixel(0, 1)) != number) {
+            return -1;
+        }
+    }
+    return number;
+}
+
+//! Take every published set off fsm, appending the set numbers
+static void drainNumbers(FrameSetManager *fsm, std::vector<int> &numbers) {
+    while (FrameSet *fs = fsm->getFrameSet()) {
+        numbers.push_back(setNumber(fs));
+        fsm->releaseFrameSet(fs);
+    }
+}
+
+static bool increasing(const std::vector<int> &numbers) {
+    for (size_t i = 0; i < numbers.size(); i++) {
+        if (numbers[i] < 0 || (i > 0 && numbers[i] <= numbers[i - 1]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Each backpressure policy on a full ring: DROP_NEWEST keeps the
+ * oldest sets, DROP_OLDEST the newest unless the consumer is reading the
+ * oldest, BLOCK waits for a slow consumer and drops after the time-out for a
+ * stalled one. Sets still come out whole and in order.
+ */
+static void testBackpressure() {
+    const unsigned depth = 8;
+    const uint64_t chips = number_of_chips;
+
+    // Stalled consumer, the new frames are dropped
+    FrameSetManager *fsm = new FrameSetManager(depth);
+    fsm->setBackpressure(FrameSetManager::DROP_NEWEST);
+    for (int number = 1; number <= 20; number++) {
+        putNumberedSet(fsm, number);
+    }
+    std::vector<int> numbers;
+    drainNumbers(fsm, numbers);
+    putNumberedSet(fsm, 21);
+    drainNumbers(fsm, numbers);
+    CHECK(fsm->droppedNewest == 12 * chips && fsm->droppedOldest == 0,
+          "DROP_NEWEST: %d chip frames dropped, %d sets discarded, expected 48 and 0",
+          int(fsm->droppedNewest), int(fsm->droppedOldest));
+    CHECK(numbers.size() == depth + 1 && numbers.front() == 1 && numbers[depth - 1] == int(depth)
+          && numbers.back() == 21 && increasing(numbers),
+          "DROP_NEWEST: %d sets delivered, not 1 to 8 and 21 in order", int(numbers.size()));
+    delete fsm;
+
+    // Stalled consumer, the oldest unread sets make room
+    fsm = new FrameSetManager(depth);
+    fsm->setBackpressure(FrameSetManager::DROP_OLDEST);
+    for (int number = 1; number <= 20; number++) {
+        putNumberedSet(fsm, number);
+    }
+    numbers.clear();
+    drainNumbers(fsm, numbers);
+    CHECK(fsm->droppedOldest == 12 && fsm->droppedNewest == 0,
+          "DROP_OLDEST: %d sets discarded, %d chip frames dropped, expected 12 and 0",
+          int(fsm->droppedOldest), int(fsm->droppedNewest));
+    CHECK(numbers.size() == depth && numbers.front() == 13 && numbers.back() == 20 && increasing(numbers),
+          "DROP_OLDEST: %d sets delivered, not 13 to 20 in order", int(numbers.size()));
+
+    // The consumer holds the oldest set: that one stays, the new frames go
+    uint64_t newest = fsm->droppedNewest, oldest = fsm->droppedOldest;
+    for (int number = 21; number <= 28; number++) {
+        putNumberedSet(fsm, number);
+    }
+    FrameSet *held = fsm->getFrameSet();
+    int heldNumber = held != nullptr ? setNumber(held) : -1;
+    for (int number = 29; number <= 32; number++) {
+        putNumberedSet(fsm, number);
+    }
+    CHECK(heldNumber == 21 && setNumber(held) == 21 && fsm->droppedNewest - newest == 4 * chips
+          && fsm->droppedOldest == oldest,
+          "DROP_OLDEST: held set %d, %d chip frames dropped and %d sets discarded while held",
+          heldNumber, int(fsm->droppedNewest - newest), int(fsm->droppedOldest - oldest));
+    fsm->releaseFrameSet(held);
+    putNumberedSet(fsm, 33); //! Into the slot just released
+    putNumberedSet(fsm, 34); //! Discards 22
+    numbers.clear();
+    drainNumbers(fsm, numbers);
+    CHECK(fsm->droppedOldest - oldest == 1 && numbers.size() == depth && numbers.front() == 23
+          && numbers.back() == 34 && increasing(numbers),
+          "DROP_OLDEST: %d sets discarded after the release, %d delivered, not 23 to 34 in order",
+          int(fsm->droppedOldest - oldest), int(numbers.size()));
+    delete fsm;
+
+    // Stalled consumer, every chip waits out the time-out and drops
+    fsm = new FrameSetManager(depth);
+    fsm->setBackpressure(FrameSetManager::BLOCK, 2000);
+    for (int number = 1; number <= 10; number++) {
+        putNumberedSet(fsm, number);
+    }
+    numbers.clear();
+    drainNumbers(fsm, numbers);
+    CHECK(fsm->blocked == 2 * chips && fsm->blockTimeouts == 2 * chips && fsm->droppedNewest == 2 * chips,
+          "BLOCK, stalled: %d chip frames blocked, %d timed out, %d dropped, expected 8 each",
+          int(fsm->blocked), int(fsm->blockTimeouts), int(fsm->droppedNewest));
+    CHECK(numbers.size() == depth && numbers.front() == 1 && numbers.back() == int(depth) && increasing(numbers),
+          "BLOCK, stalled: %d sets delivered, not 1 to 8 in order", int(numbers.size()));
+    delete fsm;
+
+    // Slow consumer, the chips wait for it and nothing is lost
+    const int frames = 40;
+    fsm = new FrameSetManager(depth);
+    fsm->setBackpressure(FrameSetManager::BLOCK, 1000000);
+    numbers.clear();
+    std::thread consumer([&]() {
+        while (numbers.size() < size_t(frames)) {
+            if (!fsm->wait(100)) {
+                break;
+            }
+            FrameSet *fs = fsm->getFrameSet();
+            if (fs == nullptr) {
+                continue;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+            numbers.push_back(setNumber(fs));
+            fsm->releaseFrameSet(fs);
+        }
+    });
+    for (int number = 1; number <= frames; number++) {
+        putNumberedSet(fsm, number);
+    }
+    consumer.join();
+    CHECK(fsm->blocked > 0 && fsm->blockTimeouts == 0 && fsm->droppedNewest == 0,
+          "BLOCK, slow: %d chip frames blocked, %d timed out, %d dropped",
+          int(fsm->blocked), int(fsm->blockTimeouts), int(fsm->droppedNewest));
+    CHECK(numbers.size() == size_t(frames) && increasing(numbers),
+          "BLOCK, slow: %d of %d sets delivered, in order %d", int(numbers.size()), frames, increasing(numbers));
+    delete fsm;
+}
+
+enum Corner { TOP_LEFT, TOP_RIGHT, BOTTOM_LEFT, BOTTOM_RIGHT };
+
+//! The chip corner each image corner of a chip shows, per orientation:
+//! rotations are clockwise, so at 90 degrees the chip's bottom-left comes top-left
+static const Corner rotatedCorners[4][4] = {
+    {TOP_LEFT, TOP_RIGHT, BOTTOM_LEFT, BOTTOM_RIGHT},
+    {BOTTOM_LEFT, TOP_LEFT, BOTTOM_RIGHT, TOP_RIGHT},
+    {BOTTOM_RIGHT, BOTTOM_LEFT, TOP_RIGHT, TOP_LEFT},
+    {TOP_RIGHT, BOTTOM_RIGHT, TOP_LEFT, BOTTOM_LEFT},
+};
+
+static uint16_t cornerValue(int chipIndex, Corner corner) { return uint16_t(chipIndex * 16 + corner + 1); }
+
+//! Assemble fs into layout and check the corners of every chip in the image
+template <typename T>
+static void checkCorners(FrameSet *fs, const DetectorLayout &layout, const char *name) {
+    constexpr int n = MPX_PIXEL_COLUMNS - 1;
+    std::vector<T> image(size_t(layout.width) * layout.height, T(0xdead));
+    fs->assemble(layout, image.data());
+    for (int c = 0; c < number_of_chips; c++) {
+        const DetectorLayout::ChipPlacement &p = layout.chips[c];
+        if (!p.used) continue;
+        for (int k = TOP_LEFT; k <= BOTTOM_RIGHT; k++) {
+            int x = p.x + (k == TOP_RIGHT || k == BOTTOM_RIGHT ? n : 0);
+            int y = p.y + (k >= BOTTOM_LEFT ? n : 0);
+            T got = image[size_t(y) * layout.width + x];
+            T expected = cornerValue(c, rotatedCorners[p.orientation][k]);
+            CHECK(got == expected, "%s, %d-bit image: chip %d, rotation %d, image corner %d is %u, expected %u",
+                  name, int(sizeof(T) * 8), c, int(p.orientation) * 90, k, unsigned(got), unsigned(expected));
+        }
+    }
+}
+
+/**
+ * @brief FrameSet::assemble() turns and places the chips as the layout says:
+ * every rotation in a strip, and the quad with the lower chips upside down
+ */
+static void testLayout() {
+    constexpr int n = MPX_PIXEL_COLUMNS - 1;
+    FrameSetManager *fsm = new FrameSetManager(8);
+    for (int c = 0; c < number_of_chips; c++) {
+        ChipFrame *cf = fsm->newChipFrame(c);
+        cf->frameId = 1;
+        cf->omr.setCountL(2);
+        cf->omr.setMode(0);
+        for (int r = 0; r < MPX_PIXEL_ROWS; r++) {
+            memset(cf->getRow(r), 0, MPX_PIXEL_COLUMNS * sizeof(uint16_t));
+        }
+        cf->getRow(0)[0] = cornerValue(c, TOP_LEFT);
+        cf->getRow(0)[n] = cornerValue(c, TOP_RIGHT);
+        cf->getRow(n)[0] = cornerValue(c, BOTTOM_LEFT);
+        cf->getRow(n)[n] = cornerValue(c, BOTTOM_RIGHT);
+        fsm->putChipFrame(c, cf);
+    }
+    FrameSet *fs = fsm->getFrameSet();
+    CHECK(fs != nullptr, "layout: no set published");
+    if (fs != nullptr) {
+        DetectorLayout rotations(number_of_chips * MPX_PIXEL_COLUMNS, MPX_PIXEL_ROWS);
+        for (int c = 0; c < number_of_chips; c++) {
+            rotations.setChip(c, c * MPX_PIXEL_COLUMNS, 0, DetectorLayout::Orientation(c % 4));
+        }
+        checkCorners<uint16_t>(fs, rotations, "rotations");
+        checkCorners<uint32_t>(fs, rotations, "rotations");
+        checkCorners<uint16_t>(fs, DetectorLayout::quad(), "quad");
+        checkCorners<uint32_t>(fs, DetectorLayout::quad(), "quad");
+
+        //! The quad's image corners are the outer corners of its chips
+        std::vector<uint32_t> image(size_t(4) * MPX_PIXELS);
+        fs->assemble(DetectorLayout::quad(), image.data());
+        int w = 2 * MPX_PIXEL_COLUMNS;
+        CHECK(image[0] == cornerValue(0, TOP_LEFT) && image[size_t(w) - 1] == cornerValue(1, TOP_RIGHT)
+              && image[size_t(w - 1) * w] == cornerValue(3, TOP_RIGHT)
+              && image[size_t(w) * w - 1] == cornerValue(2, TOP_LEFT),
+              "quad: image corners %u %u %u %u", image[0], image[size_t(w) - 1], image[size_t(w - 1) * w],
+              image[size_t(w) * w - 1]);
+        fsm->releaseFrameSet(fs);
+    }
+    delete fsm;
+}
+
+/**
+ * @brief A live consumer next to a recording: every set gets recorded or,
+ * when the disk falls behind, counted dropped, and a set the consumer holds
+ * stays intact while the ring moves on under it.
+ */
+static void testRecordingWithConsumer() {
+    const int frames = 300;
+    char path[] = "/tmp/mpx3-recording-XXXXXX";
+    close(mkstemp(path));
+    FrameSetManager *fsm = new FrameSetManager(16);
+    FrameRecorder *recorder = new FrameRecorder(1 << 20, 4);
+    CHECK(recorder->open(path, true), "cannot record to %s", path);
+    recorder->start(fsm);
+
+    std::atomic_bool producing{true};
+    int got = 0, torn = 0, outOfOrder = 0;
+    std::thread consumer([&]() {
+        int last = 0;
+        while (producing) {
+            if (!recorder->wait(10)) {
+                continue;
+            }
+            FrameSet *fs = recorder->getFrameSet();
+            if (fs == nullptr) {
+                continue;
+            }
+            got++;
+            int number = setNumber(fs);
+            if (number <= last) {
+                outOfOrder++;
+            }
+            last = number;
+            std::this_thread::sleep_for(std::chrono::microseconds(500)); //! The ring moves on
+            if (setNumber(fs) != number) {
+                torn++;
+            }
+            fsm->releaseFrameSet(fs);
+        }
+    });
+
+    for (int number = 1; number <= frames; number++) {
+        while (fsm->occupancy() > fsm->depth() / 2) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        putNumberedSet(fsm, number);
+    }
+    for (int i = 0; i < 5000 && recorder->eventsRecorded + recorder->eventsDropped < uint64_t(frames); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    producing = false;
+    consumer.join();
+    recorder->close();
+
+    struct stat st;
+    stat(path, &st);
+    size_t eventBytes = EVT_HEADER_SIZE + number_of_chips * (DEV_HEADER_SIZE + MPX_PIXELS * sizeof(uint16_t));
+    uint64_t recorded = recorder->eventsRecorded;
+    CHECK(recorded > 0 && recorded + recorder->eventsDropped == uint64_t(frames)
+          && size_t(st.st_size) == recorded * eventBytes,
+          "recording: %d recorded + %d dropped of %d sets, %ld bytes", int(recorded),
+          int(recorder->eventsDropped), frames, long(st.st_size));
+    CHECK(got > 0 && torn == 0 && outOfOrder == 0,
+          "recording: consumer got %d sets, %d changed while held, %d out of order", got, torn, outOfOrder);
+    CHECK(fsm->poolAvailable() == FrameSetManager::poolFrames(fsm->depth()),
+          "recording: %u of %u chip frames back in the pool", fsm->poolAvailable(),
+          FrameSetManager::poolFrames(fsm->depth()));
+    delete recorder;
+    delete fsm;
+    unlink(path);
+}
+
+/**
+ * @brief What FrameRecorder writes reads back: the spidrdata.h headers with
+ * the address, device and frame information, and the decoded counters, for
+ * 12-bit sets (16 bits per pixel) and 24-bit sets (32 bits per pixel)
+ */
+static void testRecordingFormat() {
+    const int sets12 = 5, sets24 = 3;
+    char path[] = "/tmp/mpx3-recording-XXXXXX";
+    close(mkstemp(path));
+    FrameSetManager *fsm = new FrameSetManager(16);
+    //! One buffer holds the whole recording, nothing gets dropped
+    FrameRecorder *recorder = new FrameRecorder(16 << 20, 2);
+    int ipaddr[4] = {10, 1, 168, 192}, ports[4] = {8192, 8193, 8194, 8195};
+    int ids[number_of_chips], types[number_of_chips];
+    for (int c = 0; c < number_of_chips; c++) {
+        ids[c] = 0x1000 + c;
+        types[c] = 3;
+    }
+    recorder->setAddrInfo(ipaddr, ports);
+    recorder->setDeviceIdsAndTypes(ids, types);
+    CHECK(recorder->open(path, true), "cannot record to %s", path);
+    recorder->start(fsm);
+
+    for (int number = 1; number <= sets12 + sets24; number++) {
+        if (number <= sets12) {
+            putNumberedSet(fsm, number);
+        } else {
+            //! Low counters numbered as putNumberedSet() does, the high ones carry the number again
+            for (int c = 0; c < number_of_chips; c++) {
+                for (int mode : {0, 4}) {
+                    ChipFrame *cf = fsm->newChipFrame(c);
+                    cf->frameId = uint8_t(number);
+                    cf->omr.setCountL(3);
+                    cf->omr.setMode(mode);
+                    cf->getRow(0)[0] = uint16_t(mode == 0 ? c : number);
+                    cf->getRow(0)[1] = uint16_t(mode == 0 ? number : 0);
+                    fsm->putChipFrame(c, cf);
+                }
+            }
+        }
+        for (int i = 0; i < 5000 && recorder->eventsRecorded + recorder->eventsDropped < uint64_t(number); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    recorder->close();
+    CHECK(recorder->eventsRecorded == uint64_t(sets12 + sets24) && recorder->writeErrors == 0,
+          "format: %d of %d sets recorded, %d write errors", int(recorder->eventsRecorded), sets12 + sets24,
+          int(recorder->writeErrors));
+
+    std::vector<uint8_t> file;
+    if (FILE *f = fopen(path, "rb")) {
+        uint8_t block[1 << 16];
+        size_t n;
+        while ((n = fread(block, 1, sizeof(block), f)) > 0) {
+            file.insert(file.end(), block, block + n);
+        }
+        fclose(f);
+    }
+    size_t pos = 0;
+    int events = 0;
+    while (pos + EVT_HEADER_SIZE <= file.size()) {
+        EvtHeader_t evt;
+        memcpy(&evt, file.data() + pos, EVT_HEADER_SIZE);
+        pos += EVT_HEADER_SIZE;
+        int number = events + 1;
+        uint32_t depth = number <= sets12 ? 12 : 24;
+        size_t pixelBytes = depth == 24 ? sizeof(uint32_t) : sizeof(uint16_t);
+        size_t devData = MPX_PIXELS * pixelBytes;
+        CHECK(evt.headerId == EVT_HEADER_ID && evt.headerSize == EVT_HEADER_SIZE
+              && evt.format == EVT_HEADER_VERSION && evt.nrOfDevices == uint32_t(number_of_chips)
+              && evt.dataSize == number_of_chips * (DEV_HEADER_SIZE + devData),
+              "format: event %d header id %08x, size %u, format %u, %u devices, %u data bytes",
+              events, evt.headerId, evt.headerSize, evt.format, evt.nrOfDevices, evt.dataSize);
+        CHECK(evt.evtNr == uint32_t(events) && evt.pixelDepth == depth && evt.ipAddress == 0xc0a8010au
+              && evt.ports[0] == 8192 && evt.ports[3] == 8195,
+              "format: event %d numbered %u, depth %u, address %08x, ports %u..%u", events, evt.evtNr,
+              evt.pixelDepth, evt.ipAddress, evt.ports[0], evt.ports[3]);
+        if (pos + evt.dataSize > file.size()) {
+            CHECK(false, "format: event %d cut short", events);
+            break;
+        }
+        for (int c = 0; c < number_of_chips; c++) {
+            DevHeader_t dev;
+            memcpy(&dev, file.data() + pos, DEV_HEADER_SIZE);
+            pos += DEV_HEADER_SIZE;
+            CHECK(dev.headerId == DEV_HEADER_ID && dev.headerSize == DEV_HEADER_SIZE
+                  && dev.format == (DEV_HEADER_VERSION | DEV_DATA_DECODED) && dev.dataSize == devData
+                  && dev.deviceId == uint32_t(ids[c]) && dev.deviceType == uint32_t(types[c])
+                  && dev.spidrHeader[0] == uint32_t(uint8_t(number)) && dev.lostPackets == 0,
+                  "format: event %d chip %d header id %08x, format %08x, %u bytes, device %x type %u, "
+                  "frame %u, %u lost", events, c, dev.headerId, dev.format, dev.dataSize, dev.deviceId,
+                  dev.deviceType, dev.spidrHeader[0], dev.lostPackets);
+            uint32_t p0, p1;
+            if (depth == 24) {
+                memcpy(&p0, file.data() + pos, sizeof(p0));
+                memcpy(&p1, file.data() + pos + sizeof(p0), sizeof(p1));
+            } else {
+                uint16_t p[2];
+                memcpy(p, file.data() + pos, sizeof(p));
+                p0 = p[0];
+                p1 = p[1];
+            }
+            uint32_t e0 = depth == 24 ? uint32_t(c) | uint32_t(number) << 12 : uint32_t(c);
+            CHECK(p0 == e0 && p1 == uint32_t(number), "format: event %d chip %d pixels %u %u, expected %u %u",
+                  events, c, p0, p1, e0, number);
+            pos += devData;
+        }
+        events++;
+    }
+    CHECK(events == sets12 + sets24 && pos == file.size(), "format: %d events read, %d of %d bytes",
+          events, int(pos), int(file.size()));
+    delete recorder;
+    delete fsm;
+    unlink(path);
+}
+
+/**
+ * @brief Packets captured by one thread per chip replay into the same sets.
+ * The staging buffers hold more frames than publish_lag, so the chips only
+ * line up again if replay merges their blocks back into arrival order.
+ */
+static void testCaptureReplay() {
+    const int depth = 12, frames = 20;
+    int total = frames + int(FrameSetManager::publish_lag) + 1;
+    std::vector<uint64_t> words[number_of_chips];
+    for (int c = 0; c < number_of_chips; c++) {
+        TrafficGenerator::encodeFrame(depth, c, 0, words[c]);
+    }
+    int packets = int((words[0].size() + packet_words - 1) / packet_words);
+
+    char path[] = "/tmp/mpx3-capture-XXXXXX";
+    close(mkstemp(path));
+    //! Enough buffers for the whole capture, nothing gets dropped
+    PacketCapture *capture = new PacketCapture(1 << 20, 4);
+    CHECK(capture->open(path), "cannot capture to %s", path);
+    std::vector<std::thread> chips;
+    for (int c = 0; c < number_of_chips; c++) {
+        chips.emplace_back([&, c]() {
+            std::vector<uint64_t> w = words[c];
+            for (int f = 0; f < total; f++) {
+                uint64_t &eof = w.back();
+                eof = (eof & ~FRAME_FLAGS_MASK) | (uint64_t(f + 1) << FRAME_FLAGS_SHIFT);
+                for (int k = 0; k < packets; k++) {
+                    size_t first = size_t(k) * packet_words;
+                    size_t len = std::min(w.size() - first, size_t(packet_words));
+                    //! Arrival order as from the SPIDR: the chips take turns
+                    uint64_t arrival = 1 + (uint64_t(f) * packets + k) * number_of_chips + c;
+                    capture->write(c, reinterpret_cast<const char *>(w.data() + first),
+                                   long(len * sizeof(uint64_t)), arrival);
+                }
+            }
+        });
+    }
+    for (std::thread &t : chips) {
+        t.join();
+    }
+    capture->close();
+    uint64_t captured = uint64_t(total) * packets * number_of_chips;
+    CHECK(capture->packets == captured && capture->packetsDropped == 0 && capture->writeErrors == 0,
+          "capture: %d of %d packets, %d dropped, %d write errors", int(capture->packets), int(captured),
+          int(capture->packetsDropped), int(capture->writeErrors));
+    delete capture;
+
+    PixelUnpacker::init();
+    FrameSetManager *fsm = new FrameSetManager(fsm_depth);
+    FrameAssembler *assemblers[number_of_chips];
+    for (int c = 0; c < number_of_chips; c++) {
+        assemblers[c] = new FrameAssembler(c);
+        assemblers[c]->setFrameSetManager(fsm);
+    }
+    PacketReplay *replay = new PacketReplay();
+    CHECK(replay->open(path), "cannot replay %s", path);
+    uint64_t fed = replay->run(assemblers, false);
+    Result r;
+    int lastId = -1;
+    takeSets(fsm, depth, false, r, lastId);
+    CHECK(fed == captured, "replay: %d of %d packets fed", int(fed), int(captured));
+    CHECK(r.sets == total && fsm->_framesLost == 0 && r.incomplete == 0 && r.idGaps == 0,
+          "replay: %d of %d sets, %d lost, %d chip frames missing, %d ids skipped", r.sets, total,
+          int(fsm->_framesLost), r.incomplete, r.idGaps);
+    CHECK(r.checked == total * number_of_chips && r.wrongPixels == 0,
+          "replay: %d of %d chip frames checked, %d wrong pixels", r.checked, total * number_of_chips,
+          r.wrongPixels);
+    delete replay;
+    for (int c = 0; c < number_of_chips; c++) {
+        delete assemblers[c];
+    }
+    delete fsm;
+    unlink(path);
+}
+
+/**
+ * @brief Percentiles come out exact below 64 ns and at most about 3% above
+ * the true value beyond, never below it nor above the maximum, over the full
+ * 64-bit range; concurrent record() calls are all counted.
+ */
+static void testLatencyHistogram() {
+    LatencyHistogram h;
+    CHECK(h.count() == 0 && h.percentile(50) == 0 && h.mean() == 0., "histogram: empty one not zero");
+
+    for (uint64_t ns = 1; ns <= 63; ns++) {
+        h.record(ns);
+    }
+    CHECK(h.percentile(0) == 1 && h.percentile(50) == 32 && h.percentile(100) == 63,
+          "histogram: small values p0 %lu, p50 %lu, p100 %lu, expected 1, 32, 63",
+          (unsigned long)h.percentile(0), (unsigned long)h.percentile(50), (unsigned long)h.percentile(100));
+    h.reset();
+    CHECK(h.count() == 0 && h.max() == 0 && h.sumNs() == 0 && h.percentile(99) == 0,
+          "histogram: %lu samples left after reset", (unsigned long)h.count());
+
+    const uint64_t n = 100000;
+    for (uint64_t ns = 1; ns <= n; ns++) {
+        h.record(ns);
+    }
+    for (double p : {1., 50., 90., 99., 99.9}) {
+        uint64_t exact = uint64_t(p / 100. * double(n) + 0.5);
+        uint64_t v = h.percentile(p);
+        CHECK(v >= exact && double(v) <= double(exact) * 1.032,
+              "histogram: p%g of 1..%lu is %lu, expected %lu to 3%% above", p, (unsigned long)n,
+              (unsigned long)v, (unsigned long)exact);
+    }
+    CHECK(h.count() == n && h.max() == n && h.percentile(100) == n && h.sumNs() == n * (n + 1) / 2
+          && h.mean() == double(n + 1) / 2,
+          "histogram: count %lu, max %lu, p100 %lu, mean %g", (unsigned long)h.count(), (unsigned long)h.max(),
+          (unsigned long)h.percentile(100), h.mean());
+
+    // A long tail: the top percentiles land on the outliers, capped at the maximum
+    h.reset();
+    for (int i = 0; i < 990; i++) {
+        h.record(1000000);
+    }
+    for (int i = 0; i < 10; i++) {
+        h.record(1000000000);
+    }
+    uint64_t p99 = h.percentile(99), p995 = h.percentile(99.5);
+    CHECK(p99 >= 1000000 && p99 <= 1032000 && p995 == 1000000000,
+          "histogram: long tail p99 %lu, p99.5 %lu", (unsigned long)p99, (unsigned long)p995);
+
+    h.reset();
+    h.record(~0ull);
+    h.record(uint64_t(1) << 40);
+    CHECK(h.percentile(50) == (uint64_t(1) << 40) + (uint64_t(1) << 35) - 1 && h.percentile(100) == ~0ull,
+          "histogram: top of the range p50 %lu, p100 %lu", (unsigned long)h.percentile(50),
+          (unsigned long)h.percentile(100));
+
+    h.reset();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&h, t]() {
+            for (uint64_t i = 0; i < 100000; i++) {
+                h.record(uint64_t(t + 1) * 1000);
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    CHECK(h.count() == 400000 && h.max() == 4000 && h.sumNs() == 1000000000 && h.percentile(25) >= 1000
+          && h.percentile(25) < 1032 && h.percentile(100) == 4000,
+          "histogram: 4 threads, count %lu, max %lu, p25 %lu", (unsigned long)h.count(), (unsigned long)h.max(),
+          (unsigned long)h.percentile(25));
+}
+
+/**
+ * @brief Counter::reset() moves the reader's baseline, not the writer's
+ * value: counts go on from the reset, and readers resetting while the
+ * writer counts never see the count go negative (wrap) or jump.
+ */
+static void testCounterReset() {
+    Counter c;
+    c.add(10);
+    CHECK(c.get() == 10, "counter: %lu after adding 10", (unsigned long)c.get());
+    c.reset();
+    CHECK(c.get() == 0, "counter: %lu after reset", (unsigned long)c.get());
+    c.add();
+    c.add(4);
+    c.reset();
+    c.reset(); //! A second reset with nothing counted between changes nothing
+    c.add(3);
+    CHECK(c.get() == 3, "counter: %lu counted since the reset, expected 3", (unsigned long)c.get());
+    c.set(100); //! The writer's own tally, the baseline stays at 15
+    CHECK(c.get() == 85, "counter: %lu after set(100), expected 85", (unsigned long)c.get());
+
+    // Readers resetting at random while the writer counts
+    const uint64_t adds = 2000000;
+    Counter shared;
+    std::atomic_bool writing{true};
+    std::atomic_int wrapped{0};
+    std::thread writer([&]() {
+        for (uint64_t i = 0; i < adds; i++) {
+            shared.add();
+        }
+        writing = false;
+    });
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; r++) {
+        readers.emplace_back([&]() {
+            while (writing) {
+                shared.reset();
+                for (int i = 0; i < 100; i++) {
+                    if (shared.get() > adds) {
+                        wrapped++;
+                    }
+                }
+                std::this_thread::yield();
+            }
+        });
+    }
+    writer.join();
+    for (std::thread &t : readers) {
+        t.join();
+    }
+    CHECK(wrapped == 0, "counter: %d reads past the total while resetting", int(wrapped));
+    CHECK(shared.get() <= adds, "counter: %lu left of %lu", (unsigned long)shared.get(), (unsigned long)adds);
+    shared.reset();
+    shared.add(7);
+    CHECK(shared.get() == 7, "counter: %lu after the last reset and 7 more", (unsigned long)shared.get());
+}
 
 int main() {
-    std::puts("This is a test");
+    auto console = spdlog::stderr_color_mt("console");
+    console->set_level(spdlog::level::warn);
+    FrameAssembler::lutInit(false);
+
+    testRoundTrip();
+    testLoss();
+    testConcurrentRing();
+    testBackpressure();
+    testLayout();
+    testRecordingWithConsumer();
+    testRecordingFormat();
+    testCaptureReplay();
+    testLatencyHistogram();
+    testCounterReset();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    puts("All tests passed");
     return 0;
 }
@@ -1,10 +1,26 @@
 TEMPLATE = app
 TARGET = TestMpx3DriverTests
 
-QT -= gui
-CONFIG *= console
+QT -= gui core
+CONFIG *= console c++1z
+CONFIG -= qt
 
 DESTDIR = $$PWD/../build
 
+INCLUDEPATH += ../src ../src/libs ../generator
+
 SOURCES += \
-    main.cpp
+    main.cpp \
+    ../generator/TrafficGenerator.cpp \
+    ../src/FrameAssembler.cpp \
+    ../src/FrameRecorder.cpp \
+    ../src/FrameSet.cpp \
+    ../src/FrameSetManager.cpp \
+    ../src/PacketCapture.cpp \
+    ../src/ChipFrame.cpp \
+    ../src/ChipFramePool.cpp \
+    ../src/DetectorLayout.cpp \
+    ../src/PixelUnpacker.cpp \
+    ../src/LatencyHistogram.cpp
+
+LIBS += -lpthread